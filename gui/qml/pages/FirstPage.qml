@@ -6,6 +6,8 @@ import Nemo.Configuration 1.0
 Page {
     id: page
 
+    property int framesRemaining: 0
+
     Timer {
         interval: 1000
         repeat: false
@@ -37,9 +39,15 @@ Page {
 
         function recordingFinished(filename) {
             console.log(filename)
+            framesRemaining = 0
             filenameLabel.text = filename
         }
 
+        function progress(remaining, bytesWritten) {
+            framesRemaining = remaining
+            filenameLabel.text = qsTr("%1 MB written").arg((bytesWritten / 1048576).toFixed(1))
+        }
+
         Component.onDestruction: {
             dbus.call("Quit")
         }
@@ -159,7 +167,9 @@ Page {
                     case 2:
                         return qsTr("Stop")
                     case 3:
-                        return qsTr("Saving, please wait")
+                        return framesRemaining > 0
+                                ? qsTr("Saving, %1 frames left").arg(framesRemaining)
+                                : qsTr("Saving, please wait")
                     }
                 }
                 enabled: serviceState > 0 && serviceState < 3
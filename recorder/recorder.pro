@@ -6,24 +6,57 @@ INSTALLS += target
 
 QMAKE_RPATHDIR += /usr/share/$${TARGET}/lib
 
-QT += dbus concurrent platformsupport-private
+QT += dbus platformsupport-private
 CONFIG += wayland-scanner link_pkgconfig
-PKGCONFIG += wayland-client mlite5
+PKGCONFIG += wayland-client mlite5 libpulse-simple liblz4 libjpeg
 WAYLANDCLIENTSOURCES += protocol/lipstick-recorder.xml
 
 SOURCES += \
+    src/changedetector.cpp \
     src/main.cpp \
     src/recorder.cpp \
     src/QAviWriter.cpp \
     src/gwavi.cpp \
-    src/dbusadaptor.cpp
+    src/mkvmuxer.cpp \
+    src/avioutput.cpp \
+    src/segmentthread.cpp \
+    src/audiosource.cpp \
+    src/audiocapture.cpp \
+    src/spoolfile.cpp \
+    src/spooltranscoder.cpp \
+    src/dbusadaptor.cpp \
+    src/shmpool.cpp \
+    src/encoderthread.cpp \
+    src/pixelconvert.cpp \
+    src/scaler.cpp \
+    src/jpegencoder.cpp \
+    src/framescheduler.cpp \
+    src/loadcontroller.cpp
 
 
 HEADERS += \
+    src/changedetector.h \
     src/recorder.h \
     src/QAviWriter.h \
+    src/muxer.h \
     src/gwavi.h \
-    src/dbusadaptor.h
+    src/mkvmuxer.h \
+    src/avioutput.h \
+    src/segmentthread.h \
+    src/audiosource.h \
+    src/audiocapture.h \
+    src/spoolfile.h \
+    src/spooltranscoder.h \
+    src/dbusadaptor.h \
+    src/shmpool.h \
+    src/spscring.h \
+    src/eventfd.h \
+    src/encoderthread.h \
+    src/pixelconvert.h \
+    src/scaler.h \
+    src/jpegencoder.h \
+    src/framescheduler.h \
+    src/loadcontroller.h
 
 dbusService.files = dbus/org.coderus.screenrecorder.service
 dbusService.path = /usr/share/dbus-1/services/
@@ -9,6 +9,27 @@ Description          : Easy creation of AVI video files for Qt-based application
 #include "QAviWriter.h"
 
 #include <QBuffer>
+#include <QFile>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include <QMutexLocker>
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "audiocapture.h"
+#include "mkvmuxer.h"
+#include "segmentthread.h"
+
+Q_LOGGING_CATEGORY(logavi, "screenrecorder.avi", QtDebugMsg)
+
+// Every frame of an AVI segment also takes an entry in its idx1 index.
+static const qint64 IndexEntryBytes = 16;
+
+// Audio is written in blocks of this many sample frames, a multiple of 4 KiB
+// whatever the sample format.
+static const quint64 AudioBlockFrames = 16384;
 
 QAviWriter::QAviWriter(const QString &codec, QObject *parent)
     : QObject(parent)
@@ -24,15 +45,67 @@ QAviWriter::QAviWriter(const QString &codec, QObject *parent)
  */
 bool QAviWriter::open()
 {
-    d_gwavi = new GWAVI(d_file_name.toUtf8().constData(),
-                        (unsigned int)d_size.width(),
-                        (unsigned int)d_size.height(),
-                        24,
-                        d_codec.toLatin1().constData(),
-                        d_fps,
-                        nullptr);
+    d_bytes_written = 0;
+    d_segment = (d_segment_seconds > 0 || d_segment_mb > 0) ? 1 : 0;
+    d_segment_frames = 0;
+    d_segment_bytes = 0;
+    d_frame_count = 0;
+    d_audio_frames = 0;
+    addOpenFile(fileName());
+    d_muxer = createMuxer(fileName());
+    if (!d_muxer) {
+        removeOpenFile(fileName());
+        return false;
+    }
+    d_checkpoint_timer.start();
+
+    if (d_segment > 0) {
+        d_segments = new SegmentThread;
+        d_segments->start();
+    }
 
-    return (d_gwavi != nullptr);
+    return true;
+}
+
+//! Opens a muxer writing @p fileName, nullptr if the file cannot be created.
+Muxer *QAviWriter::createMuxer(const QString &fileName) const
+{
+    AudioFormat audio;
+    if (d_audio)
+        audio = d_audio->format();
+
+    // The muxers report failures to create the file by throwing.
+    try {
+        if (d_container == Matroska) {
+            return new MkvMuxer(fileName.toUtf8().constData(),
+                                (unsigned int)d_size.width(),
+                                (unsigned int)d_size.height(),
+                                d_codec.toLatin1().constData(),
+                                d_fps,
+                                audio,
+                                d_output);
+        }
+
+        GWAVI::gwavi_audio_t gwaviAudio;
+        gwaviAudio.channels = audio.channels;
+        gwaviAudio.bits = audio.bits;
+        gwaviAudio.samples_per_second = audio.sampleRate;
+        GWAVI *gwavi = new GWAVI(fileName.toUtf8().constData(),
+                                 (unsigned int)d_size.width(),
+                                 (unsigned int)d_size.height(),
+                                 24,
+                                 d_codec.toLatin1().constData(),
+                                 d_fps,
+                                 audio.channels ? &gwaviAudio : nullptr,
+                                 d_output);
+        gwavi->SetIndexSpill(d_index_spill);
+        return gwavi;
+    } catch (const std::exception &e) {
+        qCWarning(logavi) << "Could not create" << fileName << "-" << e.what();
+    } catch (...) {
+        qCWarning(logavi) << "Could not create" << fileName;
+    }
+    return nullptr;
 }
 
 /**
@@ -43,11 +116,166 @@ bool QAviWriter::open()
  */
 bool QAviWriter::close()
 {
-    int error = d_gwavi->Finalize();
-	if (!error)
-        d_gwavi = nullptr;
+    if (d_audio)
+        muxAudio(true);
 
-    return (error == 0);
+    if (!d_segments) {
+        // The file is closed either way, a failure only means it may be damaged.
+        int error = d_muxer->Finalize();
+        delete d_muxer;
+        d_muxer = nullptr;
+        d_has_frame = false;
+        removeOpenFile(fileName());
+
+        return (error == 0);
+    }
+
+    // The last segment is finalized after the ones still in the queue, so every
+    // segmentFinished() is emitted in order before this returns.
+    d_segments->waitForTasks();
+    if (d_next_muxer) {
+        delete d_next_muxer;
+        d_next_muxer = nullptr;
+        QFile::remove(segmentFileName(d_segment + 1));
+        removeOpenFile(segmentFileName(d_segment + 1));
+    }
+    d_preparing = false;
+
+    bool ok = false;
+    Muxer *muxer = d_muxer;
+    const QString name = fileName();
+    d_segments->post([this, muxer, name, &ok] { ok = finishSegment(muxer, name); });
+    d_segments->waitForTasks();
+    delete d_segments;
+    d_segments = nullptr;
+    d_muxer = nullptr;
+    d_has_frame = false;
+
+    return ok;
+}
+
+QString QAviWriter::fileName() const
+{
+    const int segment = d_segment.load(std::memory_order_relaxed);
+    return segment > 0 ? segmentFileName(segment) : d_file_name;
+}
+
+bool QAviWriter::isWriting(const QString &fileName) const
+{
+    const QFileInfo target(fileName);
+    const QString canonical = target.canonicalFilePath();
+    QMutexLocker locker(&d_open_lock);
+    for (const QString &open : d_open_files) {
+        const QFileInfo info(open);
+        // A segment being opened ahead may not exist yet, it has no canonical path.
+        if (info.absoluteFilePath() == target.absoluteFilePath()
+                || (!canonical.isEmpty() && info.canonicalFilePath() == canonical))
+            return true;
+    }
+    return false;
+}
+
+void QAviWriter::addOpenFile(const QString &fileName)
+{
+    QMutexLocker locker(&d_open_lock);
+    d_open_files.append(fileName);
+}
+
+void QAviWriter::removeOpenFile(const QString &fileName)
+{
+    QMutexLocker locker(&d_open_lock);
+    d_open_files.removeOne(fileName);
+}
+
+//! Numbers the segments in the file name given, "name.avi" becomes "name-001.avi".
+QString QAviWriter::segmentFileName(int segment) const
+{
+    const QString number = QStringLiteral("-%1").arg(segment, 3, 10, QLatin1Char('0'));
+    const int dot = d_file_name.lastIndexOf(QLatin1Char('.'));
+    if (dot <= d_file_name.lastIndexOf(QLatin1Char('/')))
+        return d_file_name + number;
+    return d_file_name.left(dot) + number + d_file_name.mid(dot);
+}
+
+//! Whether a segment with this many frames and bytes has reached a limit.
+bool QAviWriter::segmentFull(qint64 frames, qint64 bytes) const
+{
+    if (d_segment_seconds > 0 && frames >= qint64(d_segment_seconds) * d_fps)
+        return true;
+    return d_segment_mb > 0 && bytes > (qint64(d_segment_mb) << 20);
+}
+
+//! Index bytes each frame adds to a segment, Matroska only indexes clusters.
+qint64 QAviWriter::indexEntryBytes() const
+{
+    return d_container == Avi ? IndexEntryBytes : 0;
+}
+
+//! Counts a frame written to the current segment. Once the segment is half full
+//! the next one is opened in the background, so it is ready when the muxer gets there.
+void QAviWriter::segmentAdded(qint64 bytes)
+{
+    ++d_segment_frames;
+    d_segment_bytes += bytes + indexEntryBytes();
+    if (!d_preparing && segmentFull(d_segment_frames * 2, d_segment_bytes * 2))
+        prepareSegment();
+}
+
+void QAviWriter::prepareSegment()
+{
+    d_preparing = true;
+    const QString name = segmentFileName(d_segment + 1);
+    addOpenFile(name);
+    d_segments->post([this, name] {
+        d_next_muxer = createMuxer(name);
+        if (!d_next_muxer)
+            removeOpenFile(name);
+    });
+}
+
+/**
+ * Continues in the segment opened by prepareSegment() and hands the finished one
+ * to the background thread for finalizing. Only waits if the next file is still
+ * being opened, which means the segments are very short.
+ */
+void QAviWriter::nextSegment()
+{
+    // Audio not captured yet goes to the next segment.
+    if (d_audio)
+        muxAudio(true);
+
+    if (!d_preparing)
+        prepareSegment();
+    d_segments->waitForTasks();
+    d_preparing = false;
+
+    Muxer *next = d_next_muxer;
+    d_next_muxer = nullptr;
+    if (!next) {
+        qCWarning(logavi) << "Could not open" << segmentFileName(d_segment + 1) << "- continuing in" << fileName();
+        d_segment_seconds = d_segment_mb = 0;
+        return;
+    }
+
+    Muxer *done = d_muxer;
+    const QString name = fileName();
+    d_segments->post([this, done, name] { finishSegment(done, name); });
+
+    d_muxer = next;
+    ++d_segment;
+    d_segment_frames = 0;
+    d_segment_bytes = 0;
+    d_checkpoint_timer.restart();
+}
+
+//! Runs on the segment thread.
+bool QAviWriter::finishSegment(Muxer *muxer, const QString &fileName)
+{
+    const bool ok = muxer->Finalize() == 0;
+    delete muxer;
+    removeOpenFile(fileName);
+    emit segmentFinished(fileName, ok);
+    return ok;
 }
 
 void QAviWriter::setFileName(const QString &fileName)
@@ -68,40 +296,132 @@ void QAviWriter::setSize(const QSize &size)
 //! This function allows you to add an encoded video frame to the AVI file.
 bool QAviWriter::addFrame(const QImage &img, const char* format, int quality)
 {
-    if (!d_gwavi)
+    if (!d_muxer)
 		return false;
 
+    return addEncodedFrame(encodeFrame(img, format, quality));
+}
+
+QByteArray QAviWriter::encodeFrame(const QImage &img, const char* format, int quality)
+{
 	QByteArray ba;
 	QBuffer buffer(&ba);
 	buffer.open(QIODevice::WriteOnly);
 	img.save(&buffer, format, quality);
+    return ba;
+}
 
-    int error = d_gwavi->AddVideoFrame(ba.constData(), (size_t)ba.size());
-	if (!error)
-		++d_frame_count;
+bool QAviWriter::addEncodedFrame(const QByteArray &data)
+{
+    if (!d_muxer || data.isEmpty())
+        return false;
+
+    // Chunk header and the payload padded to 4 bytes, as written by GWAVI. A
+    // Matroska block header is about the same size.
+    const qint64 chunk = 8 + ((data.size() + 3) & ~3);
+    if (d_segments && d_segment_frames > 0 && segmentFull(d_segment_frames, d_segment_bytes + chunk + indexEntryBytes()))
+        nextSegment();
+
+    int error = d_muxer->AddVideoFrame(data.constData(), (size_t)data.size());
+    if (!error) {
+        ++d_frame_count;
+        d_has_frame = true;
+        d_bytes_written.fetch_add(chunk, std::memory_order_relaxed);
+        if (d_segments) {
+            // Copied into the buffer kept from the previous frame, sharing the
+            // payload would make the encoder detach it for the next frame.
+            d_last_payload.resize(data.size());
+            memcpy(d_last_payload.data(), data.constData(), size_t(data.size()));
+            segmentAdded(chunk);
+        }
+        if (d_audio)
+            muxAudio(false);
+        checkpoint();
+    }
 
     return (error == 0);
 }
 
-bool QAviWriter::addFrame(const QPixmap &img, const char *format, int quality)
+//! Adds the previous frame again without encoding or writing its payload.
+bool QAviWriter::repeatFrame()
 {
-    if (!d_gwavi)
+    if (!d_muxer || !d_has_frame)
         return false;
 
-    QByteArray ba;
-    QBuffer buffer(&ba);
-    buffer.open(QIODevice::WriteOnly);
-    img.save(&buffer, format, quality);
+    if (d_segments && d_segment_frames > 0 && segmentFull(d_segment_frames, d_segment_bytes + indexEntryBytes()))
+        nextSegment();
 
-    int error = d_gwavi->AddVideoFrame(ba.constData(), (size_t)ba.size());
-    if (!error)
+    // A new segment has no chunk to refer to yet, it gets the frame itself.
+    qint64 chunk = 0;
+    int error;
+    if (d_segments && d_segment_frames == 0) {
+        chunk = 8 + ((d_last_payload.size() + 3) & ~3);
+        error = d_muxer->AddVideoFrame(d_last_payload.constData(), (size_t)d_last_payload.size());
+    } else {
+        error = d_muxer->AddRepeatedVideoFrame();
+    }
+    if (!error) {
         ++d_frame_count;
+        d_bytes_written.fetch_add(chunk, std::memory_order_relaxed);
+        if (d_segments)
+            segmentAdded(chunk);
+        if (d_audio)
+            muxAudio(false);
+        checkpoint();
+    }
 
     return (error == 0);
 }
 
+/**
+ * Writes the captured audio up to the time of the video written so far, in
+ * blocks of AudioBlockFrames. With @p all also a last partial block, as far as
+ * it was captured. Audio thus trails the video it belongs to by up to a block.
+ */
+void QAviWriter::muxAudio(bool all)
+{
+    const AudioFormat &format = d_audio->format();
+    const size_t blockAlign = format.blockAlign();
+    const quint64 target = quint64(d_frame_count) * format.sampleRate / d_fps;
+
+    while (d_audio_frames < target) {
+        const quint64 due = std::min(target - d_audio_frames, AudioBlockFrames);
+        const quint64 frames = std::min<quint64>(due, d_audio->available() / blockAlign);
+        if (frames == 0 || (frames < AudioBlockFrames && !all))
+            return;
+
+        d_audio_block.resize(int(frames * blockAlign));
+        d_audio->read(d_audio_block.data(), size_t(d_audio_block.size()));
+        if (d_muxer->AddAudioFrame(d_audio_block.constData(), size_t(d_audio_block.size())) != 0)
+            return;
+        d_audio_frames += frames;
+
+        const qint64 chunk = 8 + ((d_audio_block.size() + 3) & ~3);
+        d_bytes_written.fetch_add(chunk, std::memory_order_relaxed);
+        if (d_segments)
+            d_segment_bytes += chunk + indexEntryBytes();
+    }
+}
+
+int QAviWriter::recover(const QString &fileName)
+{
+    if (fileName.endsWith(QStringLiteral(".mkv"), Qt::CaseInsensitive))
+        return 1;
+    return GWAVI::Recover(fileName.toUtf8().constData());
+}
+
+//! Lets the muxer make the frames added so far survive a crash, once per interval.
+void QAviWriter::checkpoint()
+{
+    if (d_checkpoint_interval <= 0 || !d_checkpoint_timer.hasExpired(d_checkpoint_interval * 1000))
+        return;
+
+    d_muxer->Checkpoint();
+    d_checkpoint_timer.restart();
+}
+
 QAviWriter::~QAviWriter()
 {
-    if (d_gwavi)
+    if (d_muxer)
 		close();
 }
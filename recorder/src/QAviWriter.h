@@ -9,16 +9,30 @@ Description          : Easy creation of AVI video files for Qt-based application
 #ifndef Q_AVI_WRITER_H
 #define Q_AVI_WRITER_H
 
+#include <QElapsedTimer>
 #include <QImage>
+#include <QMutex>
 #include <QObject>
-#include <QPixmap>
 #include <QSize>
+#include <QStringList>
+
+#include <atomic>
 
 #include "gwavi.h"
+#include "muxer.h"
+
+class AudioCapture;
+class SegmentThread;
 
 class QAviWriter : public QObject
 {
+    Q_OBJECT
 public:
+    enum Container {
+        Avi,
+        Matroska,
+    };
+
     QAviWriter(const QString &codec = QStringLiteral("MJPG"), QObject *parent = nullptr);
 	~QAviWriter();
 
@@ -26,21 +40,73 @@ public:
 	bool close();
 
     void setFileName(const QString &fileName);
-    QString fileName() const {return d_file_name;}
+    //! The file being written, the current segment when recording in segments.
+    QString fileName() const;
+    //! Whether @p fileName is one of the files still open: the one being written,
+    //! the next segment opened ahead or a segment still being finalized. Paths
+    //! are compared resolved, safe to call from any thread.
+    bool isWriting(const QString &fileName) const;
 
     void setFps(unsigned int fps);
 
     void setSize(const QSize &size);
     QSize size() const {return d_size;}
 
+    //! Lets full index chunks of long recordings move to a temporary file. On by default.
+    void setIndexSpill(bool enable) {d_index_spill = enable;}
+    //! How the file is written, io_uring when available by default.
+    void setOutput(AviOutput::Kind output) {d_output = output;}
+    //! The file format, AVI by default. Frames are stored the same way in both.
+    void setContainer(Container container) {d_container = container;}
+    //! Seconds between checkpoints that keep the file recoverable after a crash, 0 for none.
+    void setCheckpointInterval(int seconds) {d_checkpoint_interval = seconds;}
+    //! Finishes an AVI file left behind by a crash. Returns 0 on success, 1 if
+    //! there is nothing to do and -1 on error. Matroska files need no recovery,
+    //! they play up to the last checkpoint as they are.
+    static int recover(const QString &fileName);
+    //! Splits the recording into files of at most this length or size, starting
+    //! a new one on a frame boundary. 0 for no limit, both 0 write a single file.
+    void setSegmentLimits(int seconds, int megabytes) {d_segment_seconds = seconds; d_segment_mb = megabytes;}
+    //! Interleaves the audio of @p audio with the video, nullptr for none. The
+    //! audio is written up to the time of the frames written so far.
+    void setAudio(AudioCapture *audio) {d_audio = audio;}
+    //! Name of the output backend of the open file.
+    QString outputName() const {return d_muxer ? QString::fromLatin1(d_muxer->OutputName()) : QString();}
+
 	//! Returns the number of frames in the output video file
     unsigned int count() const {return d_frame_count;}
 	//! This function allows you to add an encoded video frame to the AVI file.
     bool addFrame(const QImage &img, const char* format = "JPG", int quality = -1);
-    bool addFrame(const QPixmap &img, const char* format = "JPG", int quality = -1);
+    //! Compresses a frame without touching the file, safe to call from any thread.
+    static QByteArray encodeFrame(const QImage &img, const char* format = "JPG", int quality = -1);
+    //! Adds a frame compressed by encodeFrame(). Only one thread may add frames at a time.
+    bool addEncodedFrame(const QByteArray &data);
+    //! Adds the last encoded frame again, for frames identical to the previous one.
+    //! Only an index entry referring to the existing chunk is written, nothing at all in Matroska.
+    bool repeatFrame();
+    bool hasFrame() const {return d_has_frame;}
+    //! Bytes of frame and audio chunks written since open(), safe to read from any thread.
+    qint64 bytesWritten() const {return d_bytes_written.load(std::memory_order_relaxed);}
+
+signals:
+    //! Emitted from a background thread once a segment file is complete.
+    void segmentFinished(const QString &fileName, bool ok);
 
 private:
-	//! Name of the output .avi file
+    void checkpoint();
+    Muxer *createMuxer(const QString &fileName) const;
+    qint64 indexEntryBytes() const;
+    QString segmentFileName(int segment) const;
+    bool segmentFull(qint64 frames, qint64 bytes) const;
+    void segmentAdded(qint64 bytes);
+    void prepareSegment();
+    void nextSegment();
+    bool finishSegment(Muxer *muxer, const QString &fileName);
+    void muxAudio(bool all);
+    void addOpenFile(const QString &fileName);
+    void removeOpenFile(const QString &fileName);
+
+	//! Name of the output .avi or .mkv file
 	QString d_file_name;
 	//! FourCC representing the codec of the video encoded stream
 	QString d_codec;
@@ -48,10 +114,37 @@ private:
 	QSize d_size;
 	//! Framerate: number of frames per second of the output video file
     unsigned int d_fps = 0;
+    bool d_index_spill = true;
+    AviOutput::Kind d_output = AviOutput::Auto;
+    Container d_container = Avi;
+    int d_checkpoint_interval = 10;
+    QElapsedTimer d_checkpoint_timer;
+    int d_segment_seconds = 0;
+    int d_segment_mb = 0;
+    //! Number of the segment being written, 0 when not recording in segments
+    std::atomic<int> d_segment{0};
+    qint64 d_segment_frames = 0;
+    qint64 d_segment_bytes = 0;
+    //! Opened ahead of time by d_segments, valid once its tasks are done
+    Muxer *d_next_muxer = nullptr;
+    bool d_preparing = false;
+    //! Copy of the last frame, a new segment starts with it instead of a repeat
+    QByteArray d_last_payload;
+    SegmentThread *d_segments = nullptr;
+    //! Files created and not finalized yet, segments are finalized on d_segments
+    mutable QMutex d_open_lock;
+    QStringList d_open_files;
+    AudioCapture *d_audio = nullptr;
+    //! Sample frames written, the audio time of the whole recording
+    quint64 d_audio_frames = 0;
+    QByteArray d_audio_block;
 	//! The number of frames in the output video file
-    unsigned int d_frame_count = 0;
+    std::atomic<unsigned int> d_frame_count{0};
+    std::atomic<qint64> d_bytes_written{0};
 
-    GWAVI *d_gwavi = nullptr;
+    Muxer *d_muxer = nullptr;
+    //! Whether a frame was added that repeatFrame() can refer to
+    bool d_has_frame = false;
 
 };
 #endif
@@ -0,0 +1,176 @@
+#include "audiocapture.h"
+
+#include <time.h>
+
+#include <algorithm>
+
+#include <QLoggingCategory>
+
+#include "audiosource.h"
+
+Q_LOGGING_CATEGORY(logaudio, "screenrecorder.audio", QtDebugMsg)
+
+// Room for the audio of the frames the encoder has yet to write, the muxer only
+// takes audio up to the video it has written.
+static const int RingSeconds = 4;
+static const int PeriodMs = 20;
+
+// Drift that is closed at once, and drift that starts the slow correction.
+static const qint64 JumpMs = 50;
+static const qint64 SlewMs = 10;
+// While slewing one sample frame in this many is dropped or doubled, 0.2%.
+static const quint64 SlewInterval = 500;
+// Wakeups after a read jitter by a few milliseconds, a new measurement only
+// moves the average by this fraction.
+static const qint64 Smoothing = 16;
+
+static const qint64 NanosPerSecond = 1000000000;
+
+static qint64 monotonicNow()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * NanosPerSecond + ts.tv_nsec;
+}
+
+AudioCapture::AudioCapture(AudioSource *source, QObject *parent)
+    : QThread(parent)
+    , m_source(source)
+    , m_format(source->format())
+    , m_ring(size_t(RingSeconds) * m_format.sampleRate * m_format.blockAlign())
+{
+}
+
+AudioCapture::~AudioCapture()
+{
+    requestStop();
+    wait();
+    delete m_source;
+}
+
+const AudioFormat &AudioCapture::format() const
+{
+    return m_format;
+}
+
+void AudioCapture::setOrigin(qint64 origin)
+{
+    m_origin.store(origin, std::memory_order_release);
+}
+
+void AudioCapture::requestStop()
+{
+    m_stop.store(true, std::memory_order_release);
+    m_source->interrupt();
+}
+
+void AudioCapture::run()
+{
+    const size_t blockAlign = m_format.blockAlign();
+    std::vector<char> period(size_t(m_format.sampleRate) * PeriodMs / 1000 * blockAlign);
+    // A read may end inside a sample frame, the rest comes with the next one.
+    size_t filled = 0;
+
+    while (!m_stop.load(std::memory_order_acquire)) {
+        const qint64 n = m_source->read(period.data() + filled, qint64(period.size() - filled));
+        if (n <= 0)
+            break;
+        const qint64 captured = monotonicNow() - m_source->latency();
+
+        filled += size_t(n);
+        const size_t frames = filled / blockAlign;
+        const qint64 origin = m_origin.load(std::memory_order_acquire);
+        if (origin)
+            place(period.data(), frames, captured - origin);
+        filled -= frames * blockAlign;
+        std::copy(period.begin() + frames * blockAlign, period.begin() + frames * blockAlign + filled, period.begin());
+    }
+
+    qCDebug(logaudio) << "Audio drift:" << drift() / 1000 << "ms, inserted" << insertedFrames()
+                      << "dropped" << droppedFrames() << "overrun" << overrunFrames() << "sample frames";
+}
+
+/**
+ * Adds a read whose last sample was captured @p end nanoseconds after the video
+ * origin, correcting the drift between the sample count and that time.
+ */
+void AudioCapture::place(const char *data, quint64 frames, qint64 end)
+{
+    const qint64 rate = m_format.sampleRate;
+    const size_t blockAlign = m_format.blockAlign();
+    const qint64 expected = end * rate / NanosPerSecond;
+    if (expected <= 0)
+        return;
+
+    const qint64 drift = qint64(m_position + frames) - expected;
+    m_drift.store(drift * 1000000 / rate, std::memory_order_relaxed);
+
+    // The first read is cut or padded to start exactly at the origin.
+    if (m_position == 0 || qAbs(drift) > JumpMs * rate / 1000) {
+        if (drift > 0) {
+            const quint64 skip = std::min<quint64>(quint64(drift), frames);
+            data += skip * blockAlign;
+            frames -= skip;
+            m_dropped.fetch_add(skip, std::memory_order_relaxed);
+        } else {
+            pushSilence(quint64(-drift));
+        }
+        m_smoothed = 0;
+        push(data, frames);
+        return;
+    }
+
+    m_smoothed += (drift - m_smoothed) / Smoothing;
+    const qint64 slew = SlewMs * rate / 1000;
+    if (qAbs(m_smoothed) <= slew) {
+        push(data, frames);
+        return;
+    }
+
+    // Drops or doubles the frame in the middle of every interval.
+    const bool drop = m_smoothed > 0;
+    quint64 corrections = 0;
+    quint64 start = 0;
+    m_corrected.clear();
+    for (quint64 at = SlewInterval / 2; at < frames; at += SlewInterval) {
+        const quint64 stop = drop ? at : at + 1;
+        m_corrected.insert(m_corrected.end(), data + start * blockAlign, data + stop * blockAlign);
+        start = drop ? at + 1 : at;
+        ++corrections;
+    }
+    m_corrected.insert(m_corrected.end(), data + start * blockAlign, data + frames * blockAlign);
+
+    if (drop) {
+        m_smoothed -= qint64(corrections);
+        m_dropped.fetch_add(corrections, std::memory_order_relaxed);
+    } else {
+        m_smoothed += qint64(corrections);
+        m_inserted.fetch_add(corrections, std::memory_order_relaxed);
+    }
+    push(m_corrected.data(), m_corrected.size() / blockAlign);
+}
+
+// Whole sample frames only, whatever does not fit is lost and counted.
+void AudioCapture::push(const char *data, quint64 frames)
+{
+    const size_t blockAlign = m_format.blockAlign();
+    const size_t room = (m_ring.capacity() - m_ring.size()) / blockAlign;
+    const size_t pushed = size_t(std::min<quint64>(frames, room));
+    m_ring.pushMany(data, pushed * blockAlign);
+    m_position += pushed;
+    if (pushed < frames)
+        m_overrun.fetch_add(frames - pushed, std::memory_order_relaxed);
+}
+
+void AudioCapture::pushSilence(quint64 frames)
+{
+    // Unsigned 8 bit samples are silent in the middle of their range.
+    static const size_t ChunkFrames = 1024;
+    const std::vector<char> silence(ChunkFrames * m_format.blockAlign(), m_format.bits == 8 ? char(0x80) : 0);
+    m_inserted.fetch_add(frames, std::memory_order_relaxed);
+    while (frames > 0) {
+        const quint64 chunk = std::min<quint64>(frames, ChunkFrames);
+        push(silence.data(), chunk);
+        frames -= chunk;
+    }
+}
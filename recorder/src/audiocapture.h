@@ -0,0 +1,75 @@
+#ifndef AUDIOCAPTURE_H
+#define AUDIOCAPTURE_H
+
+#include <QThread>
+
+#include <atomic>
+#include <vector>
+
+#include "muxer.h"
+#include "spscring.h"
+
+class AudioSource;
+
+/**
+ * Reads an AudioSource on its own thread into a lock-free ring, which the muxer
+ * drains. Capturing never waits for the muxer: what does not fit the ring is
+ * dropped and made up for with silence once there is room again.
+ *
+ * The ring holds exactly the samples of the video timeline. Each read is placed
+ * at its capture time, CLOCK_MONOTONIC minus the latency of the source, and
+ * compared with the origin of the video, the time of frame 0 derived from the
+ * compositor timestamps. Audio from before the origin is dropped. A large drift,
+ * a late start or a gap after an overrun, is closed at once with silence or by
+ * dropping samples. A small one, the audio clock running at a slightly
+ * different rate, is worked off by dropping or doubling single sample frames.
+ */
+class AudioCapture : public QThread
+{
+public:
+    // Takes ownership of the source.
+    explicit AudioCapture(AudioSource *source, QObject *parent = nullptr);
+    virtual ~AudioCapture();
+
+    const AudioFormat &format() const;
+
+    // CLOCK_MONOTONIC nanoseconds of the first video frame. Refined as frames
+    // arrive, audio is kept from the first call on.
+    void setOrigin(qint64 origin);
+    void requestStop();
+
+    // Consumer side, the muxer thread.
+    size_t available() const { return m_ring.size(); }
+    size_t read(char *data, size_t size) { return m_ring.popMany(data, size); }
+
+    // Microseconds the audio was ahead of the video at the last read.
+    qint64 drift() const { return m_drift.load(std::memory_order_relaxed); }
+    quint64 insertedFrames() const { return m_inserted.load(std::memory_order_relaxed); }
+    quint64 droppedFrames() const { return m_dropped.load(std::memory_order_relaxed); }
+    quint64 overrunFrames() const { return m_overrun.load(std::memory_order_relaxed); }
+
+protected:
+    void run() override;
+
+private:
+    void place(const char *data, quint64 frames, qint64 captured);
+    void push(const char *data, quint64 frames);
+    void pushSilence(quint64 frames);
+
+    AudioSource *m_source;
+    AudioFormat m_format;
+    SpscRing<char> m_ring;
+    std::vector<char> m_corrected;
+
+    std::atomic<qint64> m_origin{0};
+    std::atomic<bool> m_stop{false};
+    quint64 m_position = 0; // sample frames pushed so far
+    qint64 m_smoothed = 0;  // drift in sample frames, averaged over reads
+
+    std::atomic<qint64> m_drift{0};
+    std::atomic<quint64> m_inserted{0};
+    std::atomic<quint64> m_dropped{0};
+    std::atomic<quint64> m_overrun{0};
+};
+
+#endif // AUDIOCAPTURE_H
@@ -0,0 +1,284 @@
+#include "audiosource.h"
+
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pulse/error.h>
+#include <pulse/simple.h>
+
+#include <QFile>
+#include <QLoggingCategory>
+
+#include "eventfd.h"
+
+Q_LOGGING_CATEGORY(logaudiosource, "screenrecorder.audiosource", QtDebugMsg)
+
+// Format asked from PulseAudio, it converts from whatever the device has.
+static const unsigned PulseRate = 48000;
+static const unsigned PulseChannels = 2;
+static const unsigned PulseFragmentMs = 20;
+
+// How long opening a FIFO waits for its writer to send the WAV header.
+static const int HeaderTimeoutMs = 2000;
+
+static const qint64 NanosPerSecond = 1000000000;
+
+static qint64 monotonicNow()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * NanosPerSecond + ts.tv_nsec;
+}
+
+static unsigned readLe(const char *p, int size)
+{
+    unsigned value = 0;
+    for (int i = size - 1; i >= 0; --i)
+        value = (value << 8) | uchar(p[i]);
+    return value;
+}
+
+class PulseAudioSource : public AudioSource
+{
+public:
+    explicit PulseAudioSource(pa_simple *stream)
+        : m_stream(stream)
+    {
+        m_format.channels = PulseChannels;
+        m_format.bits = 16;
+        m_format.sampleRate = PulseRate;
+    }
+
+    ~PulseAudioSource()
+    {
+        pa_simple_free(m_stream);
+    }
+
+    static PulseAudioSource *open(const QString &device)
+    {
+        pa_sample_spec spec;
+        spec.format = PA_SAMPLE_S16LE;
+        spec.rate = PulseRate;
+        spec.channels = PulseChannels;
+
+        // Small fragments, so read() returns often and the capture can stop quickly.
+        pa_buffer_attr attr;
+        attr.maxlength = uint32_t(-1);
+        attr.tlength = uint32_t(-1);
+        attr.prebuf = uint32_t(-1);
+        attr.minreq = uint32_t(-1);
+        attr.fragsize = uint32_t(pa_usec_to_bytes(PulseFragmentMs * 1000, &spec));
+
+        int error = 0;
+        const QByteArray name = device.toUtf8();
+        pa_simple *stream = pa_simple_new(nullptr, "screenrecorder", PA_STREAM_RECORD, name.constData(),
+                                          "Screen recording", &spec, nullptr, &attr, &error);
+        if (!stream) {
+            qCWarning(logaudiosource) << "Could not record from" << device << "-" << pa_strerror(error);
+            return nullptr;
+        }
+        return new PulseAudioSource(stream);
+    }
+
+    qint64 read(char *data, qint64 maxSize) override
+    {
+        int error = 0;
+        if (pa_simple_read(m_stream, data, size_t(maxSize), &error) < 0) {
+            qCWarning(logaudiosource) << "Recording failed:" << pa_strerror(error);
+            return -1;
+        }
+        return maxSize;
+    }
+
+    qint64 latency() const override
+    {
+        int error = 0;
+        const pa_usec_t usec = pa_simple_get_latency(m_stream, &error);
+        return usec == pa_usec_t(-1) ? 0 : qint64(usec) * 1000;
+    }
+
+private:
+    pa_simple *m_stream;
+};
+
+/**
+ * Reads a WAV stream. A regular file is handed out in real time, as if it was
+ * being recorded, a FIFO at the pace of its writer.
+ */
+class WavAudioSource : public AudioSource
+{
+public:
+    WavAudioSource(int fd, bool paced)
+        : m_fd(fd)
+        , m_wakeFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+        , m_paced(paced)
+    {
+    }
+
+    ~WavAudioSource()
+    {
+        close(m_fd);
+        if (m_wakeFd >= 0)
+            close(m_wakeFd);
+    }
+
+    static WavAudioSource *open(const QString &fileName)
+    {
+        const QByteArray name = QFile::encodeName(fileName);
+        struct stat st;
+        if (stat(name.constData(), &st) < 0) {
+            qCWarning(logaudiosource) << "Could not open" << fileName << "-" << strerror(errno);
+            return nullptr;
+        }
+        // Also opened for writing, a FIFO does not end when its writer goes away.
+        const bool fifo = S_ISFIFO(st.st_mode);
+        const int fd = ::open(name.constData(), (fifo ? O_RDWR : O_RDONLY) | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            qCWarning(logaudiosource) << "Could not open" << fileName << "-" << strerror(errno);
+            return nullptr;
+        }
+
+        WavAudioSource *source = new WavAudioSource(fd, !fifo);
+        if (source->m_wakeFd < 0 || !source->readHeader()) {
+            qCWarning(logaudiosource) << fileName << "is not a supported WAV stream";
+            delete source;
+            return nullptr;
+        }
+        return source;
+    }
+
+    qint64 read(char *data, qint64 maxSize) override
+    {
+        if (m_remaining >= 0)
+            maxSize = qMin(maxSize, m_remaining);
+        if (maxSize == 0)
+            return 0;
+
+        if (m_paced) {
+            if (!m_start)
+                m_start = monotonicNow();
+            // Returns the data once its last sample would have been recorded.
+            const qint64 due = m_start + (m_position + maxSize) * NanosPerSecond / (m_format.sampleRate * m_format.blockAlign());
+            const qint64 now = monotonicNow();
+            if (due > now && !wait(int((due - now + 999999) / 1000000), false))
+                return 0;
+        }
+
+        forever {
+            const ssize_t n = ::read(m_fd, data, size_t(maxSize));
+            if (n > 0) {
+                m_position += n;
+                if (m_remaining >= 0)
+                    m_remaining -= n;
+                return n;
+            }
+            if (n == 0)
+                return 0;
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN) {
+                qCWarning(logaudiosource) << "Reading audio failed:" << strerror(errno);
+                return -1;
+            }
+            if (!wait(-1, true))
+                return 0;
+        }
+    }
+
+    void interrupt() override
+    {
+        signalEventFd(m_wakeFd);
+    }
+
+private:
+    // Waits for @p timeout milliseconds, or until there is data if @p forData is
+    // set. Returns false once interrupted.
+    bool wait(int timeout, bool forData)
+    {
+        pollfd fds[2] = {
+            { m_wakeFd, POLLIN, 0 },
+            { m_fd, POLLIN, 0 },
+        };
+        while (poll(fds, forData ? 2 : 1, timeout) < 0 && errno == EINTR) {
+        }
+        return !(fds[0].revents & POLLIN);
+    }
+
+    bool readFully(char *data, size_t size)
+    {
+        const qint64 deadline = monotonicNow() + HeaderTimeoutMs * (NanosPerSecond / 1000);
+        while (size > 0) {
+            const ssize_t n = ::read(m_fd, data, size);
+            if (n > 0) {
+                data += n;
+                size -= size_t(n);
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                return false;
+            const qint64 left = deadline - monotonicNow();
+            if (left <= 0)
+                return false;
+            wait(int(left / 1000000) + 1, true);
+        }
+        return true;
+    }
+
+    // Integer PCM only, the chunks before "data" other than "fmt " are skipped.
+    bool readHeader()
+    {
+        char riff[12];
+        if (!readFully(riff, sizeof(riff)) || memcmp(riff, "RIFF", 4) || memcmp(riff + 8, "WAVE", 4))
+            return false;
+
+        bool haveFormat = false;
+        forever {
+            char chunk[8];
+            if (!readFully(chunk, sizeof(chunk)))
+                return false;
+            const unsigned size = readLe(chunk + 4, 4);
+
+            if (!memcmp(chunk, "data", 4)) {
+                // Streams often leave the size open.
+                m_remaining = (size == 0 || size == 0xffffffffu) ? -1 : qint64(size);
+                return haveFormat;
+            }
+
+            QByteArray body(int(size + (size & 1)), '\0');
+            if (size > 1024 * 1024 || !readFully(body.data(), size_t(body.size())))
+                return false;
+            if (!memcmp(chunk, "fmt ", 4) && size >= 16) {
+                const unsigned tag = readLe(body.constData(), 2);
+                m_format.channels = readLe(body.constData() + 2, 2);
+                m_format.sampleRate = readLe(body.constData() + 4, 4);
+                m_format.bits = readLe(body.constData() + 14, 2);
+                // WAVE_FORMAT_PCM, or WAVE_FORMAT_EXTENSIBLE with a PCM subformat.
+                const bool pcm = tag == 1 || (tag == 0xfffe && size >= 26 && readLe(body.constData() + 24, 2) == 1);
+                haveFormat = pcm && m_format.channels > 0 && m_format.channels <= 8 && m_format.sampleRate > 0
+                        && (m_format.bits == 8 || m_format.bits == 16 || m_format.bits == 24 || m_format.bits == 32);
+            }
+        }
+    }
+
+    int m_fd;
+    int m_wakeFd;
+    bool m_paced;
+    qint64 m_start = 0;
+    qint64 m_position = 0;
+    qint64 m_remaining = -1; // bytes left in the data chunk, -1 for up to the end
+};
+
+AudioSource *AudioSource::create(const QString &spec)
+{
+    if (spec == QLatin1String("pulse"))
+        return PulseAudioSource::open(QStringLiteral("@DEFAULT_MONITOR@"));
+    if (spec.startsWith(QLatin1String("pulse:")))
+        return PulseAudioSource::open(spec.mid(6));
+    return WavAudioSource::open(spec);
+}
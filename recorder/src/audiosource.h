@@ -0,0 +1,35 @@
+#ifndef AUDIOSOURCE_H
+#define AUDIOSOURCE_H
+
+#include <QString>
+
+#include "muxer.h"
+
+/**
+ * Where AudioCapture gets the PCM of a recording from. read() blocks until some
+ * data is there, which a live source produces in real time.
+ */
+class AudioSource
+{
+public:
+    virtual ~AudioSource() {}
+
+    // "pulse" records what the device plays, "pulse:<source>" a PulseAudio
+    // source by name, anything else is a WAV file or a FIFO carrying one.
+    // Returns nullptr if the source cannot be opened.
+    static AudioSource *create(const QString &spec);
+
+    const AudioFormat &format() const { return m_format; }
+
+    // Returns the number of bytes read, 0 at the end of the data and -1 on error.
+    virtual qint64 read(char *data, qint64 maxSize) = 0;
+    // Nanoseconds between the capture of the last byte read and now.
+    virtual qint64 latency() const { return 0; }
+    // Makes a blocked read() return 0, safe to call from any thread.
+    virtual void interrupt() {}
+
+protected:
+    AudioFormat m_format;
+};
+
+#endif // AUDIOSOURCE_H
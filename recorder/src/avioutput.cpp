@@ -0,0 +1,459 @@
+// Offsets go past 2 GB in OpenDML files, also on 32-bit targets.
+#define _FILE_OFFSET_BITS 64
+
+#include "avioutput.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <system_error>
+#include <vector>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
+#endif
+
+/*
+ * The file is preallocated ahead of the writer in extents of this many seconds
+ * of data at the rate seen so far, so it does not grow by small appends.
+ */
+static const int64_t PreallocSeconds = 4;
+static const int64_t PreallocMin = 8 * 1024 * 1024;
+static const int64_t PreallocMax = 256 * 1024 * 1024;
+
+// Written data is handed to writeback and dropped from the page cache in steps of this size.
+static const int64_t WriteBehindStep = 8 * 1024 * 1024;
+
+static void throwError(int error)
+{
+    throw std::system_error(error, std::generic_category());
+}
+
+static int64_t monotonicMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+AviOutput::AviOutput(int fd, size_t bufferSize)
+    : m_fd(fd)
+    , m_bufferSize(bufferSize)
+{
+}
+
+AviOutput::~AviOutput()
+{
+}
+
+void AviOutput::setWriteBehind(bool enable)
+{
+    m_prealloc = enable;
+    m_writeBehind = enable;
+    m_startMs = monotonicMs();
+}
+
+/**
+ * Keeps space allocated up to @p end and an extent of a few seconds beyond it.
+ * The size of the file stays the same, so a crash does not leave zeros at the
+ * end and trim() only has to give back the rest. Filesystems without
+ * fallocate() (vfat memory cards) just grow the file.
+ */
+void AviOutput::preallocate(int64_t end)
+{
+    if (!m_prealloc || end <= m_allocEnd)
+        return;
+
+    // The first second is too short to tell the rate.
+    const int64_t elapsed = monotonicMs() - m_startMs;
+    int64_t extent = elapsed >= 1000 ? end * 1000 / elapsed * PreallocSeconds : 0;
+    extent = std::min(std::max(extent, PreallocMin), PreallocMax);
+    extent = (extent + int64_t(m_bufferSize) - 1) / int64_t(m_bufferSize) * int64_t(m_bufferSize);
+
+    if (fallocate(m_fd, FALLOC_FL_KEEP_SIZE, m_allocEnd, end + extent - m_allocEnd) < 0) {
+        // Not supported or out of space, the writes report a real problem.
+        m_prealloc = false;
+        return;
+    }
+    m_allocEnd = end + extent;
+}
+
+/**
+ * Keeps the dirty and cached pages of the file bounded. Once a step of written
+ * data is complete it is handed to writeback right away instead of waiting for
+ * the flusher, which writes the whole backlog in one burst. The step before has
+ * had the time of a step to reach the storage, it is waited for and dropped from
+ * the page cache, nothing reads it again.
+ */
+void AviOutput::written(int64_t end)
+{
+    // buffer() returned a free one, only the others can still be in flight.
+    int64_t done = end - int64_t(m_maxInFlight) * int64_t(m_bufferSize);
+    done -= done % WriteBehindStep;
+    if (!m_writeBehind || done <= m_writebackPos)
+        return;
+
+    // A length of 0 would mean up to the end of the file.
+    if ((m_writebackPos > m_droppedPos
+         && sync_file_range(m_fd, m_droppedPos, m_writebackPos - m_droppedPos,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) < 0)
+            || sync_file_range(m_fd, m_writebackPos, done - m_writebackPos, SYNC_FILE_RANGE_WRITE) < 0) {
+        if (errno != EINVAL && errno != ENOSYS && errno != ESPIPE)
+            throwError(errno);
+        m_writeBehind = false;
+        return;
+    }
+    if (m_writebackPos > m_droppedPos)
+        posix_fadvise(m_fd, m_droppedPos, m_writebackPos - m_droppedPos, POSIX_FADV_DONTNEED);
+    m_droppedPos = m_writebackPos;
+    m_writebackPos = done;
+}
+
+void AviOutput::trim(int64_t end)
+{
+    if (m_allocEnd > end && ftruncate(m_fd, end) < 0)
+        throwError(errno);
+    m_allocEnd = 0;
+}
+
+class PwriteOutput : public AviOutput
+{
+public:
+    PwriteOutput(int fd, size_t bufferSize)
+        : AviOutput(fd, bufferSize)
+        , m_buffer(bufferSize)
+    {
+    }
+
+    const char *name() const override { return "pwrite"; }
+
+    char *buffer() override { return &m_buffer[0]; }
+
+    void submit(char *buffer, size_t len, int64_t pos) override
+    {
+        while (len > 0) {
+            const ssize_t written = pwrite(m_fd, buffer, len, pos);
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written < 0)
+                throwError(errno);
+            if (written == 0)
+                throwError(EIO);
+            buffer += written;
+            len -= written;
+            pos += written;
+        }
+    }
+
+    void drain() override {}
+
+private:
+    std::vector<char> m_buffer;
+};
+
+#ifdef HAVE_IO_URING
+
+/**
+ * io_uring through the raw system calls, the SDK has no liburing. Every buffer
+ * is a slot with at most one write in flight, the user data of a request is the
+ * slot index. The buffers are registered with the ring where the locked memory
+ * limit allows it, otherwise plain vectored writes are queued.
+ */
+class UringOutput : public AviOutput
+{
+public:
+    static UringOutput *create(int fd, size_t bufferSize, int buffers);
+    ~UringOutput();
+
+    const char *name() const override { return m_fixed ? "io_uring, registered buffers" : "io_uring"; }
+
+    char *buffer() override;
+    void submit(char *buffer, size_t len, int64_t pos) override;
+    void drain() override;
+
+private:
+    UringOutput(int fd, size_t bufferSize);
+
+    struct Slot {
+        int64_t pos;
+        size_t len;
+        size_t done;
+        struct iovec iov;
+    };
+
+    void queue(int index);
+    void wait();
+    bool reap();
+    void checkError();
+
+    int m_ring = -1;
+    void *m_sqMap = MAP_FAILED;
+    size_t m_sqMapSize = 0;
+    void *m_cqMap = MAP_FAILED;
+    size_t m_cqMapSize = 0;
+    struct io_uring_sqe *m_sqes = static_cast<struct io_uring_sqe *>(MAP_FAILED);
+    size_t m_sqesSize = 0;
+
+    unsigned *m_sqTail = nullptr;
+    unsigned *m_sqMask = nullptr;
+    unsigned *m_sqArray = nullptr;
+    unsigned *m_cqHead = nullptr;
+    unsigned *m_cqTail = nullptr;
+    unsigned *m_cqMask = nullptr;
+    struct io_uring_cqe *m_cqes = nullptr;
+
+    char *m_memory = nullptr;
+    bool m_fixed = false;
+    std::vector<Slot> m_slots;
+    std::vector<int> m_free;
+    int m_inFlight = 0;
+    int m_error = 0;
+};
+
+UringOutput::UringOutput(int fd, size_t bufferSize)
+    : AviOutput(fd, bufferSize)
+{
+}
+
+UringOutput *UringOutput::create(int fd, size_t bufferSize, int buffers)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    const int ring = syscall(__NR_io_uring_setup, buffers, &params);
+    if (ring < 0)
+        return nullptr;
+
+    UringOutput *output = new UringOutput(fd, bufferSize);
+    output->m_ring = ring;
+
+    output->m_sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    output->m_cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    const bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap)
+        output->m_sqMapSize = std::max(output->m_sqMapSize, output->m_cqMapSize);
+    output->m_sqMap = mmap(nullptr, output->m_sqMapSize, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    if (output->m_sqMap == MAP_FAILED) {
+        delete output;
+        return nullptr;
+    }
+    if (!singleMap) {
+        output->m_cqMap = mmap(nullptr, output->m_cqMapSize, PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        if (output->m_cqMap == MAP_FAILED) {
+            delete output;
+            return nullptr;
+        }
+    }
+    output->m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(nullptr, output->m_sqesSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        delete output;
+        return nullptr;
+    }
+    output->m_sqes = static_cast<struct io_uring_sqe *>(sqes);
+
+    char *sq = static_cast<char *>(output->m_sqMap);
+    char *cq = singleMap ? sq : static_cast<char *>(output->m_cqMap);
+    output->m_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    output->m_sqMask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    output->m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    output->m_cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    output->m_cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    output->m_cqMask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    output->m_cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    void *memory = nullptr;
+    if (posix_memalign(&memory, 4096, bufferSize * buffers) != 0) {
+        delete output;
+        return nullptr;
+    }
+    output->m_memory = static_cast<char *>(memory);
+
+    output->m_maxInFlight = buffers - 1;
+    output->m_slots.resize(buffers);
+    std::vector<struct iovec> iovecs(buffers);
+    for (int i = 0; i < buffers; i++) {
+        iovecs[i].iov_base = output->m_memory + i * bufferSize;
+        iovecs[i].iov_len = bufferSize;
+        output->m_free.push_back(buffers - 1 - i);
+    }
+    output->m_fixed = syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS,
+                              iovecs.data(), buffers) == 0;
+
+    return output;
+}
+
+UringOutput::~UringOutput()
+{
+    try {
+        drain();
+    } catch (std::system_error &) {
+    }
+
+    if (m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_sqesSize);
+    if (m_cqMap != MAP_FAILED)
+        munmap(m_cqMap, m_cqMapSize);
+    if (m_sqMap != MAP_FAILED)
+        munmap(m_sqMap, m_sqMapSize);
+    if (m_ring >= 0)
+        close(m_ring);
+    free(m_memory);
+}
+
+char *UringOutput::buffer()
+{
+    while (m_free.empty())
+        wait();
+    checkError();
+
+    const int index = m_free.back();
+    m_free.pop_back();
+    return m_memory + index * m_bufferSize;
+}
+
+void UringOutput::submit(char *buffer, size_t len, int64_t pos)
+{
+    const int index = (buffer - m_memory) / m_bufferSize;
+    checkError();
+
+    if (len == 0) {
+        m_free.push_back(index);
+        return;
+    }
+
+    Slot &slot = m_slots[index];
+    slot.pos = pos;
+    slot.len = len;
+    slot.done = 0;
+    queue(index);
+}
+
+void UringOutput::drain()
+{
+    while (m_inFlight > 0)
+        wait();
+    checkError();
+}
+
+// Queues the part of a slot not written yet and hands it to the kernel.
+void UringOutput::queue(int index)
+{
+    Slot &slot = m_slots[index];
+    const unsigned tail = *m_sqTail;
+    const unsigned entry = tail & *m_sqMask;
+    char *data = m_memory + index * m_bufferSize + slot.done;
+
+    struct io_uring_sqe *sqe = &m_sqes[entry];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = m_fd;
+    sqe->off = slot.pos + slot.done;
+    sqe->user_data = index;
+    if (m_fixed) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->addr = reinterpret_cast<uintptr_t>(data);
+        sqe->len = slot.len - slot.done;
+        sqe->buf_index = index;
+    } else {
+        slot.iov.iov_base = data;
+        slot.iov.iov_len = slot.len - slot.done;
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->addr = reinterpret_cast<uintptr_t>(&slot.iov);
+        sqe->len = 1;
+    }
+    m_sqArray[entry] = entry;
+    __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+    m_inFlight++;
+
+    for (;;) {
+        const int ret = syscall(__NR_io_uring_enter, m_ring, 1, 0, 0, nullptr, 0);
+        if (ret >= 0)
+            break;
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            throwError(errno);
+        if (errno != EINTR)
+            wait();
+    }
+}
+
+// Blocks until at least one write completes.
+void UringOutput::wait()
+{
+    while (!reap()) {
+        const int ret = syscall(__NR_io_uring_enter, m_ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret < 0 && errno != EINTR)
+            throwError(errno);
+    }
+}
+
+// Handles the completed writes, returns false if there were none.
+bool UringOutput::reap()
+{
+    unsigned head = *m_cqHead;
+    const unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    std::vector<int> partial;
+    if (head == tail)
+        return false;
+
+    for (; head != tail; head++) {
+        const struct io_uring_cqe &cqe = m_cqes[head & *m_cqMask];
+        const int index = cqe.user_data;
+        Slot &slot = m_slots[index];
+        m_inFlight--;
+
+        if (cqe.res < 0 || (cqe.res == 0 && slot.done < slot.len)) {
+            if (!m_error)
+                m_error = cqe.res < 0 ? -cqe.res : EIO;
+            m_free.push_back(index);
+            continue;
+        }
+        slot.done += cqe.res;
+        if (slot.done < slot.len) {
+            partial.push_back(index);
+            continue;
+        }
+        m_free.push_back(index);
+    }
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+
+    // Short writes continue only now, queue() may have to reap again.
+    for (size_t i = 0; i < partial.size(); i++)
+        queue(partial[i]);
+    return true;
+}
+
+void UringOutput::checkError()
+{
+    if (m_error)
+        throwError(m_error);
+}
+
+#endif // HAVE_IO_URING
+
+AviOutput *AviOutput::create(Kind kind, int fd, size_t bufferSize, int buffers)
+{
+#ifdef HAVE_IO_URING
+    if (kind != Pwrite) {
+        if (UringOutput *output = UringOutput::create(fd, bufferSize, buffers))
+            return output;
+    }
+#endif
+    if (kind == Uring)
+        fputs("io_uring is not available, writing with pwrite\n", stderr);
+    return new PwriteOutput(fd, bufferSize);
+}
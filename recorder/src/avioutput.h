@@ -0,0 +1,71 @@
+#ifndef AVIOUTPUT_H
+#define AVIOUTPUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Where the muxers put the bytes of the file. The writer fills one of a fixed set of
+ * preallocated buffers, submits it with its file offset and continues in the
+ * next free one. Submitted buffers come back once the kernel has written them,
+ * so the number of writes in flight is bounded by the number of buffers.
+ *
+ * The io_uring backend queues the writes and returns right away, the encoder
+ * only waits for the storage when every buffer is in flight. The pwrite backend
+ * writes synchronously and is used when io_uring is not available.
+ *
+ * Write errors of queued buffers are reported by a later call. All calls throw
+ * std::system_error on failure. One instance must not be used from several
+ * threads at once.
+ */
+class AviOutput
+{
+public:
+    enum Kind {
+        Auto,   // io_uring if the kernel supports it, pwrite otherwise
+        Uring,
+        Pwrite,
+    };
+
+    // Never returns nullptr, a backend that cannot be set up falls back to pwrite.
+    static AviOutput *create(Kind kind, int fd, size_t bufferSize, int buffers);
+    virtual ~AviOutput();
+
+    virtual const char *name() const = 0;
+    size_t bufferSize() const { return m_bufferSize; }
+
+    // A buffer to fill, waits for a write to complete if none is free.
+    virtual char *buffer() = 0;
+    // Writes @p len bytes of @p buffer at @p pos, the buffer must not be touched until
+    // it is handed out again by buffer().
+    virtual void submit(char *buffer, size_t len, int64_t pos) = 0;
+    // Waits until every submitted buffer is written.
+    virtual void drain() = 0;
+
+    // Preallocation and write-behind for a file written front to back, off by default.
+    void setWriteBehind(bool enable);
+    // Makes sure the file has space up to @p end, call before submitting data up to there.
+    void preallocate(int64_t end);
+    // Call after buffer() returned, with the end of the data submitted so far.
+    void written(int64_t end);
+    // Gives back the space preallocated behind @p end, the final size of the file.
+    void trim(int64_t end);
+
+protected:
+    AviOutput(int fd, size_t bufferSize);
+
+    int m_fd;
+    size_t m_bufferSize;
+    // Buffers that may still be in flight while buffer() hands out another one.
+    int m_maxInFlight = 0;
+
+private:
+    bool m_prealloc = false;
+    bool m_writeBehind = false;
+    int64_t m_allocEnd = 0;
+    int64_t m_writebackPos = 0; // data before this was handed to writeback
+    int64_t m_droppedPos = 0;   // data before this was dropped from the page cache
+    int64_t m_startMs = 0;
+};
+
+#endif // AVIOUTPUT_H
@@ -0,0 +1,295 @@
+#include "changedetector.h"
+
+#include <algorithm>
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#define CHANGEDETECTOR_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define CHANGEDETECTOR_ARM64
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define CHANGEDETECTOR_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+#endif
+
+typedef quint32 (*CrcFunction)(quint32 crc, const uchar *data, int length);
+
+// Reflected CRC32C (Castagnoli) polynomial, the one implemented by SSE4.2 and ARMv8.
+static const quint32 crcPolynomial = 0x82f63b78u;
+
+// entries[k][i] is the CRC of byte i followed by k zero bytes, for slicing by 8.
+struct CrcTable {
+    quint32 entries[8][256];
+
+    CrcTable()
+    {
+        for (quint32 i = 0; i < 256; ++i) {
+            quint32 crc = i;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = (crc >> 1) ^ (crcPolynomial & (0u - (crc & 1u)));
+            entries[0][i] = crc;
+        }
+        for (int k = 1; k < 8; ++k) {
+            for (int i = 0; i < 256; ++i)
+                entries[k][i] = (entries[k - 1][i] >> 8) ^ entries[0][entries[k - 1][i] & 0xffu];
+        }
+    }
+};
+
+// Slicing by 8: eight table lookups per 8 bytes instead of a dependent chain per byte.
+static quint32 crcScalar(quint32 crc, const uchar *data, int length)
+{
+    static const CrcTable table;
+    const quint32 (*t)[256] = table.entries;
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        quint32 low;
+        quint32 high;
+        memcpy(&low, data + i, sizeof(low));
+        memcpy(&high, data + i + 4, sizeof(high));
+        low ^= crc;
+        crc = t[7][low & 0xffu] ^ t[6][(low >> 8) & 0xffu] ^ t[5][(low >> 16) & 0xffu] ^ t[4][low >> 24]
+            ^ t[3][high & 0xffu] ^ t[2][(high >> 8) & 0xffu] ^ t[1][(high >> 16) & 0xffu] ^ t[0][high >> 24];
+    }
+    for (; i < length; ++i)
+        crc = t[0][(crc ^ data[i]) & 0xffu] ^ (crc >> 8);
+    return crc;
+}
+
+#ifdef CHANGEDETECTOR_X86
+__attribute__((target("sse4.2")))
+static quint32 crcSse42(quint32 crc, const uchar *data, int length)
+{
+    int i = 0;
+#if defined(__x86_64__)
+    quint64 crc64 = crc;
+    for (; i + 8 <= length; i += 8) {
+        quint64 value;
+        memcpy(&value, data + i, sizeof(value));
+        crc64 = _mm_crc32_u64(crc64, value);
+    }
+    crc = quint32(crc64);
+#endif
+    for (; i + 4 <= length; i += 4) {
+        quint32 value;
+        memcpy(&value, data + i, sizeof(value));
+        crc = _mm_crc32_u32(crc, value);
+    }
+    for (; i < length; ++i)
+        crc = _mm_crc32_u8(crc, data[i]);
+    return crc;
+}
+#endif
+
+#ifdef CHANGEDETECTOR_ARM64
+__attribute__((target("+crc")))
+static quint32 crcArm64(quint32 crc, const uchar *data, int length)
+{
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t value;
+        memcpy(&value, data + i, sizeof(value));
+        crc = __crc32cd(crc, value);
+    }
+    for (; i < length; ++i)
+        crc = __crc32cb(crc, data[i]);
+    return crc;
+}
+#endif
+
+#ifdef CHANGEDETECTOR_NEON
+// xxHash32 primes.
+static const quint32 Prime1 = 2654435761u;
+static const quint32 Prime2 = 2246822519u;
+static const quint32 Prime3 = 3266489917u;
+static const quint32 Prime4 = 668265263u;
+
+static inline quint32 rotateLeft(quint32 value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+/**
+ * Not a CRC: without CRC instructions a table CRC is the bottleneck of the
+ * pipeline thread, so CPUs with NEON only hash the tiles with four xxHash32
+ * style multiply-accumulate lanes. Only equality between frames matters, and
+ * a process always uses the same kernel.
+ */
+static quint32 hashNeon(quint32 seed, const uchar *data, int length)
+{
+    int i = 0;
+    quint32 hash;
+    if (length >= 16) {
+        const uint32x4_t prime1 = vdupq_n_u32(Prime1);
+        const uint32x4_t prime2 = vdupq_n_u32(Prime2);
+        const quint32 lanes[4] = { seed + Prime1 + Prime2, seed + Prime2, seed, seed - Prime1 };
+        uint32x4_t acc = vld1q_u32(lanes);
+        for (; i + 16 <= length; i += 16) {
+            acc = vmlaq_u32(acc, vreinterpretq_u32_u8(vld1q_u8(data + i)), prime2);
+            acc = vsliq_n_u32(vshrq_n_u32(acc, 19), acc, 13);
+            acc = vmulq_u32(acc, prime1);
+        }
+        hash = rotateLeft(vgetq_lane_u32(acc, 0), 1) + rotateLeft(vgetq_lane_u32(acc, 1), 7)
+             + rotateLeft(vgetq_lane_u32(acc, 2), 12) + rotateLeft(vgetq_lane_u32(acc, 3), 18);
+    } else {
+        hash = seed + Prime4;
+    }
+    hash += quint32(length);
+
+    for (; i + 4 <= length; i += 4) {
+        quint32 value;
+        memcpy(&value, data + i, sizeof(value));
+        hash = rotateLeft(hash + value * Prime3, 17) * Prime4;
+    }
+    for (; i < length; ++i)
+        hash = rotateLeft(hash + data[i] * 374761393u, 11) * Prime1;
+
+    hash ^= hash >> 15;
+    hash *= Prime2;
+    hash ^= hash >> 13;
+    hash *= Prime3;
+    hash ^= hash >> 16;
+    return hash;
+}
+#endif
+
+struct CrcKernel {
+    CrcFunction crc;
+    const char *name;
+};
+
+static CrcKernel selectKernel()
+{
+#ifdef CHANGEDETECTOR_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+        return { crcSse42, "sse4.2" };
+#endif
+#ifdef CHANGEDETECTOR_ARM64
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+        return { crcArm64, "armv8-crc" };
+#endif
+#ifdef CHANGEDETECTOR_NEON
+#if !defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+        return { hashNeon, "neon-hash" };
+#endif
+    return { crcScalar, "scalar" };
+}
+
+static const CrcKernel &kernel()
+{
+    static const CrcKernel selected = selectKernel();
+    return selected;
+}
+
+void ChangeDetector::setup(const QSize &size)
+{
+    m_size = size;
+    m_columns = (size.width() + TileSize - 1) / TileSize;
+    m_rows = (size.height() + TileSize - 1) / TileSize;
+    m_hashes.fill(0, tileCount());
+    m_current.fill(0, tileCount());
+    m_mask.fill(1, tileCount());
+    reset();
+}
+
+void ChangeDetector::reset()
+{
+    m_valid = false;
+    m_changed = tileCount();
+}
+
+/**
+ * Walks the frame once row by row, each row feeds the running hash of every tile
+ * it crosses. A tile row is compared as soon as its last pixel row is hashed, so
+ * the hash tables stay small and hot in cache.
+ */
+int ChangeDetector::update(const uchar *data, qptrdiff stride)
+{
+    const CrcFunction crc = kernel().crc;
+    const int rowBytes = m_size.width() * 4;
+    const int tileBytes = TileSize * 4;
+
+    m_changed = 0;
+    for (int row = 0; row < m_rows; ++row) {
+        quint32 *current = m_current.data() + row * m_columns;
+        std::fill(current, current + m_columns, 0xffffffffu);
+
+        const int yEnd = qMin((row + 1) * TileSize, m_size.height());
+        for (int y = row * TileSize; y < yEnd; ++y) {
+            const uchar *line = data + qptrdiff(y) * stride;
+            for (int column = 0; column < m_columns; ++column) {
+                const int offset = column * tileBytes;
+                current[column] = crc(current[column], line + offset, qMin(tileBytes, rowBytes - offset));
+            }
+        }
+
+        const quint32 *previous = m_hashes.constData() + row * m_columns;
+        uchar *mask = m_mask.data() + row * m_columns;
+        for (int column = 0; column < m_columns; ++column) {
+            const bool changed = !m_valid || current[column] != previous[column];
+            mask[column] = changed;
+            m_changed += changed;
+        }
+    }
+
+    m_hashes.swap(m_current);
+    m_valid = true;
+    return m_changed;
+}
+
+QRect ChangeDetector::changedRect() const
+{
+    int left = m_columns;
+    int top = m_rows;
+    int right = -1;
+    int bottom = -1;
+    for (int row = 0; row < m_rows; ++row) {
+        for (int column = 0; column < m_columns; ++column) {
+            if (!isChanged(column, row))
+                continue;
+            left = qMin(left, column);
+            right = qMax(right, column);
+            top = qMin(top, row);
+            bottom = qMax(bottom, row);
+        }
+    }
+    if (right < 0)
+        return QRect();
+
+    const int x = left * TileSize;
+    const int y = top * TileSize;
+    return QRect(x, y,
+                 qMin((right + 1) * TileSize, m_size.width()) - x,
+                 qMin((bottom + 1) * TileSize, m_size.height()) - y);
+}
+
+QRect ChangeDetector::tileRect(int column, int row) const
+{
+    const int x = column * TileSize;
+    const int y = row * TileSize;
+    return QRect(x, y, qMin<int>(TileSize, m_size.width() - x), qMin<int>(TileSize, m_size.height() - y));
+}
+
+const char *ChangeDetector::implementation()
+{
+    return kernel().name;
+}
@@ -0,0 +1,58 @@
+#ifndef CHANGEDETECTOR_H
+#define CHANGEDETECTOR_H
+
+#include <QRect>
+#include <QSize>
+#include <QVector>
+
+/**
+ * Finds out which parts of a frame changed since the previous one. The frame is
+ * split into TileSize x TileSize tiles, every tile is hashed with CRC32C (or a
+ * NEON multiply-accumulate hash where the CPU has no CRC instructions) and the
+ * hashes are compared against the table kept from the previous frame.
+ *
+ * The changed-tile mask stays valid until the next update(), so later stages can
+ * restrict their work to the tiles that actually changed.
+ */
+class ChangeDetector
+{
+public:
+    enum { TileSize = 64 };
+
+    void setup(const QSize &size);
+    // Forgets the previous frame, the next update() reports every tile as changed.
+    void reset();
+
+    // Hashes a RGBA8888 frame of the setup() size. @p stride may be negative to walk
+    // a Y-inverted buffer bottom-up, tiles are always in output orientation.
+    // Returns the number of changed tiles.
+    int update(const uchar *data, qptrdiff stride);
+
+    QSize size() const { return m_size; }
+    int columns() const { return m_columns; }
+    int rows() const { return m_rows; }
+    int tileCount() const { return m_columns * m_rows; }
+
+    bool isUnchanged() const { return m_changed == 0; }
+    int changedCount() const { return m_changed; }
+    bool isChanged(int column, int row) const { return m_mask.at(row * m_columns + column); }
+    // One byte per tile in row-major order, non-zero if the tile changed.
+    const QVector<uchar> &changedMask() const { return m_mask; }
+    // Bounding rectangle of all changed tiles in pixels, clipped to the frame.
+    QRect changedRect() const;
+    QRect tileRect(int column, int row) const;
+
+    static const char *implementation();
+
+private:
+    QSize m_size;
+    int m_columns = 0;
+    int m_rows = 0;
+    int m_changed = 0;
+    bool m_valid = false;
+    QVector<quint32> m_hashes;
+    QVector<quint32> m_current;
+    QVector<uchar> m_mask;
+};
+
+#endif // CHANGEDETECTOR_H
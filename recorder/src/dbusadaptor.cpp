@@ -1,11 +1,14 @@
 #include "dbusadaptor.h"
+#include "QAviWriter.h"
 
 #include <QCoreApplication>
 #include <QDebug>
 #include <QDBusConnection>
 #include <QDBusError>
 #include <QDBusMetaType>
+#include <QFileInfo>
 #include <QLoggingCategory>
+#include <QThread>
 
 static const QString s_dbusObject = QStringLiteral("/org/coderus/screenrecorder");
 static const QString s_dbusService = QStringLiteral("org.coderus.screenrecorder");
@@ -13,17 +16,53 @@ static const QString s_dbusInterface = QStringLiteral("org.coderus.screenrecorde
 
 Q_LOGGING_CATEGORY(logadaptor, "screenrecorder.adaptor", QtDebugMsg)
 
+/**
+ * Repairs one file off the main thread, recovery maps and scans all of it and
+ * rewrites the index.
+ */
+class RecoverThread : public QThread
+{
+public:
+    RecoverThread(const QString &fileName, const QString &canonicalName, QObject *parent)
+        : QThread(parent)
+        , m_fileName(fileName)
+        , m_canonicalName(canonicalName)
+    {
+    }
+
+    QString fileName() const { return m_fileName; }
+    QString canonicalName() const { return m_canonicalName; }
+    // Valid once finished.
+    bool succeeded() const { return m_ok; }
+
+protected:
+    void run() override
+    {
+        m_ok = Recorder::recover(m_fileName);
+    }
+
+private:
+    QString m_fileName;
+    QString m_canonicalName;
+    bool m_ok = false;
+};
+
 DBusAdaptor::DBusAdaptor(QObject *parent)
     : QDBusAbstractAdaptor(parent)
 {
     setAutoRelaySignals(true);
 
     connect(Recorder::instance(), &Recorder::statusChanged, this, &DBusAdaptor::StateChanged);
+    connect(Recorder::instance(), &Recorder::saveProgress, this, &DBusAdaptor::Progress);
+    connect(Recorder::instance(), &Recorder::recordingFinished, this, &DBusAdaptor::RecordingFinished);
+    connect(Recorder::instance(), &Recorder::segmentFinished, this, &DBusAdaptor::SegmentFinished);
 }
 
 DBusAdaptor::~DBusAdaptor()
 {
     unregisterService();
+    for (RecoverThread *thread : m_recoveries)
+        thread->wait();
 }
 
 int DBusAdaptor::GetState() const
@@ -108,6 +147,172 @@ void DBusAdaptor::SetSmooth(bool smooth)
     qCDebug(logadaptor) << Q_FUNC_INFO << smooth;
 }
 
+int DBusAdaptor::GetEncoders() const
+{
+    return Recorder::instance()->m_options.encoders;
+}
+
+void DBusAdaptor::SetEncoders(int encoders)
+{
+    Recorder::instance()->m_options.encoders = encoders;
+    qCDebug(logadaptor) << Q_FUNC_INFO << encoders;
+}
+
+int DBusAdaptor::GetStripes() const
+{
+    return Recorder::instance()->m_options.stripes;
+}
+
+void DBusAdaptor::SetStripes(int stripes)
+{
+    Recorder::instance()->m_options.stripes = stripes;
+    qCDebug(logadaptor) << Q_FUNC_INFO << stripes;
+}
+
+int DBusAdaptor::GetMinQuality() const
+{
+    return Recorder::instance()->m_options.minQuality;
+}
+
+void DBusAdaptor::SetMinQuality(int quality)
+{
+    Recorder::instance()->m_options.minQuality = quality;
+    qCDebug(logadaptor) << Q_FUNC_INFO << quality;
+}
+
+int DBusAdaptor::GetMinFps() const
+{
+    return Recorder::instance()->m_options.minFps;
+}
+
+void DBusAdaptor::SetMinFps(int fps)
+{
+    Recorder::instance()->m_options.minFps = fps;
+    qCDebug(logadaptor) << Q_FUNC_INFO << fps;
+}
+
+int DBusAdaptor::GetMaxQueueMb() const
+{
+    return Recorder::instance()->m_options.maxQueueMb;
+}
+
+void DBusAdaptor::SetMaxQueueMb(int megabytes)
+{
+    Recorder::instance()->m_options.maxQueueMb = megabytes;
+    qCDebug(logadaptor) << Q_FUNC_INFO << megabytes;
+}
+
+bool DBusAdaptor::GetPrefault() const
+{
+    return Recorder::instance()->m_options.prefault;
+}
+
+void DBusAdaptor::SetPrefault(bool prefault)
+{
+    Recorder::instance()->m_options.prefault = prefault;
+    qCDebug(logadaptor) << Q_FUNC_INFO << prefault;
+}
+
+QString DBusAdaptor::GetOverflow() const
+{
+    return Recorder::overflowName(Recorder::instance()->m_options.overflow);
+}
+
+void DBusAdaptor::SetOverflow(const QString &overflow)
+{
+    bool ok = false;
+    const Recorder::Overflow policy = Recorder::overflowFromName(overflow, &ok);
+    if (!ok) {
+        qCWarning(logadaptor) << Q_FUNC_INFO << "Unknown overflow policy" << overflow;
+        return;
+    }
+    Recorder::instance()->m_options.overflow = policy;
+    qCDebug(logadaptor) << Q_FUNC_INFO << overflow;
+}
+
+int DBusAdaptor::GetCheckpoint() const
+{
+    return Recorder::instance()->m_options.checkpoint;
+}
+
+void DBusAdaptor::SetCheckpoint(int seconds)
+{
+    Recorder::instance()->m_options.checkpoint = seconds;
+    qCDebug(logadaptor) << Q_FUNC_INFO << seconds;
+}
+
+int DBusAdaptor::GetSegmentSeconds() const
+{
+    return Recorder::instance()->m_options.segmentSeconds;
+}
+
+void DBusAdaptor::SetSegmentSeconds(int seconds)
+{
+    Recorder::instance()->m_options.segmentSeconds = seconds;
+    qCDebug(logadaptor) << Q_FUNC_INFO << seconds;
+}
+
+int DBusAdaptor::GetSegmentMb() const
+{
+    return Recorder::instance()->m_options.segmentMb;
+}
+
+void DBusAdaptor::SetSegmentMb(int megabytes)
+{
+    Recorder::instance()->m_options.segmentMb = megabytes;
+    qCDebug(logadaptor) << Q_FUNC_INFO << megabytes;
+}
+
+QString DBusAdaptor::GetContainer() const
+{
+    return Recorder::containerName(Recorder::instance()->m_options.container);
+}
+
+void DBusAdaptor::SetContainer(const QString &container)
+{
+    bool ok = false;
+    const Recorder::Container format = Recorder::containerFromName(container, &ok);
+    if (!ok) {
+        qCWarning(logadaptor) << Q_FUNC_INFO << "Unknown container" << container;
+        return;
+    }
+    Recorder::instance()->m_options.container = format;
+    qCDebug(logadaptor) << Q_FUNC_INFO << container;
+}
+
+QString DBusAdaptor::GetAudio() const
+{
+    return Recorder::instance()->m_options.audio;
+}
+
+void DBusAdaptor::SetAudio(const QString &audio)
+{
+    Recorder::instance()->m_options.audio = audio;
+    qCDebug(logadaptor) << Q_FUNC_INFO << audio;
+}
+
+bool DBusAdaptor::GetSpool() const
+{
+    return Recorder::instance()->m_options.spool;
+}
+
+void DBusAdaptor::SetSpool(bool spool)
+{
+    Recorder::instance()->m_options.spool = spool;
+    qCDebug(logadaptor) << Q_FUNC_INFO << spool;
+}
+
+QVariantMap DBusAdaptor::GetOverflowStats() const
+{
+    const Recorder::OverflowStats stats = Recorder::instance()->overflowStats();
+    QVariantMap result;
+    result.insert(QStringLiteral("blocked"), stats.blocked);
+    result.insert(QStringLiteral("droppedOldest"), stats.droppedOldest);
+    result.insert(QStringLiteral("droppedNewest"), stats.droppedNewest);
+    result.insert(QStringLiteral("degraded"), stats.degraded);
+    return result;
+}
+
 bool DBusAdaptor::registerService()
 {
     QDBusConnection bus = QDBusConnection::sessionBus();
@@ -152,6 +357,38 @@ void DBusAdaptor::Start()
 
 void DBusAdaptor::Stop()
 {
-    const QString filename = Recorder::instance()->stop();
-    emit RecordingFinished(filename);
+    // RecordingFinished follows once the file is complete.
+    if (!Recorder::instance()->stop())
+        emit RecordingFinished(QString());
+}
+
+bool DBusAdaptor::Recover(const QString &fileName)
+{
+    qCDebug(logadaptor) << Q_FUNC_INFO << fileName;
+    const QString canonicalName = QFileInfo(fileName).canonicalFilePath();
+    if (canonicalName.isEmpty()) {
+        qCWarning(logadaptor) << Q_FUNC_INFO << "No such file" << fileName;
+        return false;
+    }
+    // Also covers segments opened ahead or still being finalized, whatever path they are named by.
+    if (Recorder::instance()->m_avi->isWriting(canonicalName)) {
+        qCWarning(logadaptor) << Q_FUNC_INFO << "Still writing" << fileName;
+        return false;
+    }
+    for (RecoverThread *thread : m_recoveries) {
+        if (thread->canonicalName() == canonicalName) {
+            qCWarning(logadaptor) << Q_FUNC_INFO << "Already recovering" << fileName;
+            return false;
+        }
+    }
+
+    RecoverThread *thread = new RecoverThread(fileName, canonicalName, this);
+    m_recoveries.append(thread);
+    connect(thread, &QThread::finished, this, [this, thread] {
+        m_recoveries.removeOne(thread);
+        emit RecoverFinished(thread->fileName(), thread->succeeded());
+        thread->deleteLater();
+    });
+    thread->start();
+    return true;
 }
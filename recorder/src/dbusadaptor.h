@@ -2,8 +2,11 @@
 #define DBUSADAPTOR_H
 
 #include <QDBusAbstractAdaptor>
+#include <QVariantMap>
 #include "recorder.h"
 
+class RecoverThread;
+
 class DBusAdaptor : public QDBusAbstractAdaptor
 {
     Q_OBJECT
@@ -23,11 +26,28 @@ public:
     Q_PROPERTY(double Scale READ GetScale WRITE SetScale FINAL)
     Q_PROPERTY(int Quality READ GetQuality WRITE SetQuality FINAL)
     Q_PROPERTY(bool Smooth READ GetSmooth WRITE SetSmooth FINAL)
+    Q_PROPERTY(int Encoders READ GetEncoders WRITE SetEncoders FINAL)
+    Q_PROPERTY(int Stripes READ GetStripes WRITE SetStripes FINAL)
+    Q_PROPERTY(int MinQuality READ GetMinQuality WRITE SetMinQuality FINAL)
+    Q_PROPERTY(int MinFps READ GetMinFps WRITE SetMinFps FINAL)
+    Q_PROPERTY(int MaxQueueMb READ GetMaxQueueMb WRITE SetMaxQueueMb FINAL)
+    Q_PROPERTY(bool Prefault READ GetPrefault WRITE SetPrefault FINAL)
+    Q_PROPERTY(QString Overflow READ GetOverflow WRITE SetOverflow FINAL)
+    Q_PROPERTY(int Checkpoint READ GetCheckpoint WRITE SetCheckpoint FINAL)
+    Q_PROPERTY(int SegmentSeconds READ GetSegmentSeconds WRITE SetSegmentSeconds FINAL)
+    Q_PROPERTY(int SegmentMb READ GetSegmentMb WRITE SetSegmentMb FINAL)
+    Q_PROPERTY(QString Container READ GetContainer WRITE SetContainer FINAL)
+    Q_PROPERTY(QString Audio READ GetAudio WRITE SetAudio FINAL)
+    Q_PROPERTY(bool Spool READ GetSpool WRITE SetSpool FINAL)
 
 public slots:
     Q_NOREPLY void Quit();
     void Start();
     Q_NOREPLY void Stop();
+    // Starts repairing an interrupted recording in the background, RecoverFinished
+    // follows. Returns false if the file is missing, still written to or
+    // already being recovered.
+    bool Recover(const QString &fileName);
 
     int GetState() const;
 
@@ -52,10 +72,57 @@ public slots:
     bool GetSmooth() const;
     void SetSmooth(bool smooth);
 
+    int GetEncoders() const;
+    void SetEncoders(int encoders);
+
+    int GetStripes() const;
+    void SetStripes(int stripes);
+
+    int GetMinQuality() const;
+    void SetMinQuality(int quality);
+
+    int GetMinFps() const;
+    void SetMinFps(int fps);
+
+    int GetMaxQueueMb() const;
+    void SetMaxQueueMb(int megabytes);
+
+    bool GetPrefault() const;
+    void SetPrefault(bool prefault);
+
+    QString GetOverflow() const;
+    void SetOverflow(const QString &overflow);
+
+    int GetCheckpoint() const;
+    void SetCheckpoint(int seconds);
+
+    int GetSegmentSeconds() const;
+    void SetSegmentSeconds(int seconds);
+
+    int GetSegmentMb() const;
+    void SetSegmentMb(int megabytes);
+
+    QString GetContainer() const;
+    void SetContainer(const QString &container);
+
+    QString GetAudio() const;
+    void SetAudio(const QString &audio);
+
+    bool GetSpool() const;
+    void SetSpool(bool spool);
+
+    // Keys blocked, droppedOldest, droppedNewest and degraded.
+    QVariantMap GetOverflowStats() const;
+
 signals:
     void StateChanged(int state);
     void RecordingFinished(const QString &fileName);
+    void SegmentFinished(const QString &fileName);
+    void RecoverFinished(const QString &fileName, bool ok);
+    void Progress(int framesRemaining, qint64 bytesWritten);
 
+private:
+    QList<RecoverThread *> m_recoveries;
 };
 
 #endif // DBUSADAPTOR_H
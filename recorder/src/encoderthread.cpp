@@ -0,0 +1,687 @@
+#include "encoderthread.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <QElapsedTimer>
+#include <QLoggingCategory>
+
+#include "wayland-lipstick-recorder-client-protocol.h"
+
+#include "QAviWriter.h"
+#include "eventfd.h"
+#include "pixelconvert.h"
+#include "shmpool.h"
+#include "spoolfile.h"
+
+Q_LOGGING_CATEGORY(logencoder, "screenrecorder.encoder", QtDebugMsg)
+
+FrameHandle::FrameHandle(EncoderThread *owner, Buffer *buffer)
+    : m_owner(owner)
+    , m_buffer(buffer)
+    , m_image(buffer->image)
+{
+    m_buffer->refs.store(1);
+}
+
+FrameHandle::FrameHandle(const FrameHandle &other)
+    : m_owner(other.m_owner)
+    , m_buffer(other.m_buffer)
+    , m_image(other.m_image)
+{
+    ref();
+}
+
+FrameHandle &FrameHandle::operator=(const FrameHandle &other)
+{
+    if (this != &other) {
+        reset();
+        m_owner = other.m_owner;
+        m_buffer = other.m_buffer;
+        m_image = other.m_image;
+        ref();
+    }
+    return *this;
+}
+
+FrameHandle::~FrameHandle()
+{
+    reset();
+}
+
+void FrameHandle::setImage(const QImage &image)
+{
+    EncoderThread *owner = m_owner;
+    reset();
+    m_owner = owner;
+    m_image = image;
+}
+
+void FrameHandle::reset()
+{
+    if (m_buffer && !m_buffer->refs.deref())
+        m_owner->release(m_buffer->index);
+    m_buffer = nullptr;
+    m_image = QImage();
+}
+
+void FrameHandle::ref()
+{
+    if (m_buffer)
+        m_buffer->refs.ref();
+}
+
+QImage &ScratchImages::acquire(const QSize &size, QImage::Format format)
+{
+    for (QImage &image : m_images) {
+        if (image.size() == size && image.format() == format && image.isDetached())
+            return image;
+    }
+    m_next = (m_next + 1) % 2;
+    m_images[m_next] = QImage(size, format);
+    return m_images[m_next];
+}
+
+void ReorderBuffer::reset(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    m_slots.reset(new EncodedFrame[size]);
+    m_mask = size - 1;
+}
+
+EncoderWorker::EncoderWorker(EncoderThread *pipeline, size_t capacity)
+    : m_pipeline(pipeline)
+    , m_jobs(capacity)
+    , m_wakeFd(eventfd(0, EFD_CLOEXEC))
+{
+    if (m_wakeFd < 0)
+        qFatal("Failed to create encoder worker eventfd.");
+}
+
+EncoderWorker::~EncoderWorker()
+{
+    requestStop();
+    wait();
+
+    close(m_wakeFd);
+}
+
+bool EncoderWorker::post(const EncodeJob &job)
+{
+    if (!m_jobs.push(job))
+        return false;
+    signalEventFd(m_wakeFd);
+    return true;
+}
+
+void EncoderWorker::requestStop()
+{
+    m_stop.store(true, std::memory_order_release);
+    signalEventFd(m_wakeFd);
+}
+
+void EncoderWorker::run()
+{
+    forever {
+        EncodeJob job;
+        while (m_jobs.pop(job))
+            m_pipeline->encode(job, this);
+
+        if (m_stop.load(std::memory_order_acquire) && m_jobs.isEmpty())
+            break;
+
+        drainEventFd(m_wakeFd);
+    }
+}
+
+EncoderThread::EncoderThread(QAviWriter *avi, QObject *parent)
+    : QThread(parent)
+    , m_avi(avi)
+    , m_wakeFd(eventfd(0, EFD_CLOEXEC))
+    , m_releasedFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+    if (m_wakeFd < 0 || m_releasedFd < 0)
+        qFatal("Failed to create encoder eventfd.");
+
+    qCDebug(logencoder) << "Pixel conversion:" << PixelConvert::implementation();
+    qCDebug(logencoder) << "Change detection:" << ChangeDetector::implementation();
+    qCDebug(logencoder) << "JPEG colour conversion:" << PixelConvert::yuv420Implementation();
+    qCDebug(logencoder) << "JPEG encoder:" << JpegEncoder::implementation();
+}
+
+EncoderThread::~EncoderThread()
+{
+    requestStop();
+    wait();
+
+    qDeleteAll(m_workers);
+    close(m_wakeFd);
+    close(m_releasedFd);
+}
+
+/**
+ * Hands the capture buffers to the encoder and marks all of them free.
+ * Must be called while the thread is not running.
+ */
+void EncoderThread::setBuffers(const QList<Buffer *> &buffers)
+{
+    m_buffers = buffers;
+    m_stop.store(false, std::memory_order_release);
+    m_changes.setup(buffers.isEmpty() ? QSize() : buffers.first()->image.size());
+    m_duplicates = 0;
+    m_encodedAny = false;
+    m_owedRepeats = 0;
+    m_trailingRepeats.store(0, std::memory_order_relaxed);
+    m_spoolFailed = false;
+    m_droppedOldest.store(0, std::memory_order_relaxed);
+    m_submittedFrames.store(0, std::memory_order_relaxed);
+    m_writtenFrames.store(0, std::memory_order_relaxed);
+
+    // Every buffer is referenced at most once by a queued Frame or Release,
+    // the remaining slots take Repeat descriptors.
+    m_frames.reset(size_t(buffers.size()) * 2);
+    m_free.reset(size_t(buffers.size()));
+    for (const Buffer *buffer : buffers)
+        m_free.push(buffer->index);
+
+    // The same bound holds for frames in flight between dispatch and muxing.
+    m_reorder.reset(m_frames.capacity());
+    m_sequence = 0;
+    m_muxed = 0;
+}
+
+/**
+ * Must be called after setBuffers(), the scaler coefficients depend on the buffer
+ * size and the worker queues on the buffer count.
+ */
+void EncoderThread::setSettings(const Settings &settings)
+{
+    m_settings = settings;
+    m_quality.store(settings.quality, std::memory_order_relaxed);
+
+    const QSize source = m_buffers.isEmpty() ? QSize() : m_buffers.first()->image.size();
+    m_scaler.setup(source, m_settings.scale != 1.0f ? m_settings.size : source, m_settings.smooth);
+    qCDebug(logencoder) << "Scaling" << source << "to" << m_settings.size << "using" << Scaler::filterName(m_scaler.filter());
+
+    const int count = qBound(1, settings.encoders > 0 ? settings.encoders : QThread::idealThreadCount(), 16);
+    const QSize encoded = m_scaler.filter() == Scaler::None ? source : m_scaler.destinationSize();
+
+    // Large frames are split into stripes so all workers help with a single frame,
+    // by default one stripe per megapixel but never more stripes than workers.
+    int stripes = settings.stripes;
+    if (stripes <= 0)
+        stripes = qBound(1, (encoded.width() * encoded.height() + (1 << 20) - 1) >> 20, count);
+
+    qDeleteAll(m_workers);
+    m_workers.clear();
+    m_nextWorker = 0;
+    m_stripes = 1;
+    for (int i = 0; i < count; ++i) {
+        // Every frame in the reorder window may have all of its stripes queued on one worker.
+        EncoderWorker *worker = new EncoderWorker(this, m_reorder.capacity() * size_t(stripes));
+        if (worker->m_jpeg.open(encoded, m_settings.quality, stripes))
+            m_stripes = worker->m_jpeg.stripeCount();
+        else if (i == 0)
+            qCWarning(logencoder) << "Stripe JPEG encoder does not support" << encoded << "- using the image plugin.";
+        m_workers.append(worker);
+    }
+    qCDebug(logencoder) << "Encoder workers:" << count << "stripes per frame:" << m_stripes;
+}
+
+/**
+ * Pops a free buffer index in O(1), or returns -1 if every buffer is in flight.
+ */
+int EncoderThread::acquireBuffer()
+{
+    int buffer = -1;
+    if (m_free.pop(buffer))
+        return buffer;
+    return -1;
+}
+
+void EncoderThread::setQuality(int quality)
+{
+    m_quality.store(qBound(1, quality, 100), std::memory_order_relaxed);
+}
+
+EncoderThread::Load EncoderThread::load() const
+{
+    return {
+        int(m_frames.size()),
+        int(m_free.size()),
+        m_encodedFrames.load(std::memory_order_relaxed),
+        m_encodeNanos.load(std::memory_order_relaxed),
+    };
+}
+
+int EncoderThread::backlog() const
+{
+    return int(m_submittedFrames.load(std::memory_order_relaxed) - m_writtenFrames.load(std::memory_order_relaxed));
+}
+
+bool EncoderThread::submit(const FrameDescriptor &frame)
+{
+    if (frame.type == FrameDescriptor::Repeat && m_frames.size() >= size_t(m_buffers.size())) {
+        // Keep room for descriptors that hold a buffer, a skipped repeat is harmless.
+        return false;
+    }
+    // Counted before the push, so the backlog never goes negative.
+    const quint64 counted = frame.type == FrameDescriptor::Release ? 0 : 1;
+    m_submittedFrames.fetch_add(counted, std::memory_order_relaxed);
+    if (!m_frames.push(frame)) {
+        m_submittedFrames.fetch_sub(counted, std::memory_order_relaxed);
+        qCWarning(logencoder) << "Frame queue overflow.";
+        return false;
+    }
+    signalEventFd(m_wakeFd);
+    return true;
+}
+
+void EncoderThread::setStarving(bool starving)
+{
+    m_starving.store(starving, std::memory_order_release);
+    if (starving && m_dropOldest.load(std::memory_order_relaxed))
+        signalEventFd(m_wakeFd);
+}
+
+void EncoderThread::setDropOldest(bool drop)
+{
+    m_dropOldest.store(drop, std::memory_order_relaxed);
+}
+
+void EncoderThread::setSpool(SpoolWriter *spool)
+{
+    m_spool = spool;
+}
+
+void EncoderThread::appendRepeats(int count)
+{
+    m_submittedFrames.fetch_add(quint64(count), std::memory_order_relaxed);
+    m_trailingRepeats.fetch_add(count, std::memory_order_relaxed);
+}
+
+void EncoderThread::requestStop()
+{
+    m_stop.store(true, std::memory_order_release);
+    signalEventFd(m_wakeFd);
+}
+
+void EncoderThread::clearReleased()
+{
+    drainEventFd(m_releasedFd);
+}
+
+/**
+ * Pipeline and muxer loop. Descriptors are dispatched to the workers round-robin
+ * as long as the reorder window has room, finished frames are written strictly in
+ * sequence order, so this thread stays the only user of the AVI writer.
+ *
+ * When the oldest frames may be dropped the window only covers two frames per
+ * worker, the backlog stays in the queue where it can still be dropped.
+ */
+void EncoderThread::run()
+{
+    if (m_spool) {
+        runSpool();
+        return;
+    }
+
+    startWorkers();
+
+    const bool dropping = m_dropOldest.load(std::memory_order_relaxed);
+    const quint64 window = dropping ? qMin<quint64>(m_reorder.capacity(), quint64(m_workers.size()) * 2)
+                                    : m_reorder.capacity();
+
+    forever {
+        if (dropping && m_starving.load(std::memory_order_acquire) && m_free.isEmpty())
+            dropOldest();
+
+        // Muxing frees window room, so dispatch again until it makes no progress.
+        do {
+            FrameDescriptor frame;
+            while (m_sequence - m_muxed < window) {
+                if (m_owedRepeats > 0) {
+                    --m_owedRepeats;
+                    frame.type = FrameDescriptor::Repeat;
+                } else if (!m_frames.pop(frame)) {
+                    break;
+                }
+                process(frame);
+            }
+        } while (collect());
+
+        if (m_stop.load(std::memory_order_acquire) && m_frames.isEmpty()) {
+            // Everything submitted before the stop request is visible now.
+            const int trailing = m_trailingRepeats.exchange(0, std::memory_order_relaxed);
+            if (trailing > 0) {
+                m_owedRepeats += trailing;
+                continue;
+            }
+            if (m_owedRepeats == 0 && m_muxed == m_sequence)
+                break;
+        }
+
+        drainEventFd(m_wakeFd);
+    }
+
+    stopWorkers();
+    qCDebug(logencoder) << "Frames skipped as unchanged:" << m_duplicates;
+}
+
+void EncoderThread::process(const FrameDescriptor &frame)
+{
+    switch (frame.type) {
+    case FrameDescriptor::Release:
+        release(frame.buffer);
+        return;
+    case FrameDescriptor::Repeat: {
+        EncodedFrame &slot = reserve();
+        slot.repeat = true;
+        slot.state.store(EncodedFrame::Encoded, std::memory_order_release);
+        return;
+    }
+    case FrameDescriptor::Frame:
+        break;
+    }
+
+    Buffer *buf = m_buffers.at(frame.buffer);
+    FrameHandle handle(this, buf);
+    const bool flip = frame.transform == LIPSTICK_RECORDER_TRANSFORM_Y_INVERTED;
+    qptrdiff srcStride = 0;
+    const uchar *src = topRow(buf, flip, &srcStride);
+
+    // The compositor also repaints when nothing visible changed, such frames
+    // are added as a copy of the previous payload instead of being encoded again.
+    const bool unchanged = m_changes.update(src, srcStride) == 0 && m_encodedAny;
+
+    const quint64 sequence = m_sequence;
+    EncodedFrame &slot = reserve();
+    if (unchanged) {
+        ++m_duplicates;
+        slot.repeat = true;
+        slot.state.store(EncodedFrame::Encoded, std::memory_order_release);
+        return;
+    }
+
+    // The slot keeps the buffer out of the free list until the worker is done reading it.
+    slot.repeat = false;
+    slot.failed.store(false, std::memory_order_relaxed);
+    slot.frame = handle;
+    slot.converting.store(m_stripes, std::memory_order_relaxed);
+    slot.encoding.store(m_stripes, std::memory_order_relaxed);
+    if (m_stripes > 1 && slot.stripes.size() != m_stripes)
+        slot.stripes.resize(m_stripes);
+    slot.state.store(EncodedFrame::Queued, std::memory_order_relaxed);
+    m_encodedAny = true;
+
+    EncodeJob job;
+    job.sequence = sequence;
+    job.buffer = frame.buffer;
+    job.quality = m_quality.load(std::memory_order_relaxed);
+    job.flip = flip;
+    for (job.stripe = 0; job.stripe < m_stripes; ++job.stripe) {
+        if (!m_workers.at(m_nextWorker)->post(job))
+            qFatal("Encoder worker queue overflow.");
+        m_nextWorker = (m_nextWorker + 1) % m_workers.size();
+    }
+}
+
+/**
+ * Spooling loop, the workers stay idle. Frames are appended in submission order
+ * and give their buffer back right away, so nothing waits for the encoding.
+ */
+void EncoderThread::runSpool()
+{
+    forever {
+        FrameDescriptor frame;
+        while (m_frames.pop(frame))
+            spool(frame);
+
+        if (m_stop.load(std::memory_order_acquire) && m_frames.isEmpty()) {
+            FrameDescriptor repeat;
+            repeat.type = FrameDescriptor::Repeat;
+            for (int trailing = m_trailingRepeats.exchange(0, std::memory_order_relaxed); trailing > 0; --trailing)
+                spool(repeat);
+            break;
+        }
+
+        drainEventFd(m_wakeFd);
+    }
+
+    qCDebug(logencoder) << "Frames spooled:" << m_spool->records() << "skipped as unchanged:" << m_duplicates;
+}
+
+void EncoderThread::spool(const FrameDescriptor &frame)
+{
+    bool ok = true;
+    switch (frame.type) {
+    case FrameDescriptor::Release:
+        release(frame.buffer);
+        return;
+    case FrameDescriptor::Repeat:
+        ok = m_spool->addRepeat();
+        break;
+    case FrameDescriptor::Frame: {
+        // Unchanged frames become repeats here already, which spares the
+        // compression and the disk.
+        const Buffer *buf = m_buffers.at(frame.buffer);
+        const bool flip = frame.transform == LIPSTICK_RECORDER_TRANSFORM_Y_INVERTED;
+        qptrdiff srcStride = 0;
+        const uchar *src = topRow(buf, flip, &srcStride);
+        if (m_changes.update(src, srcStride) == 0 && m_encodedAny) {
+            ++m_duplicates;
+            ok = m_spool->addRepeat();
+        } else {
+            ok = m_spool->addFrame(buf->data, size_t(buf->stride) * size_t(buf->image.height()),
+                                   frame.timestamp, frame.transform);
+            m_encodedAny = true;
+        }
+        release(frame.buffer);
+        break;
+    }
+    }
+
+    if (!ok && !m_spoolFailed)
+        qCWarning(logencoder) << "Spooling failed, frames are lost.";
+    m_spoolFailed = m_spoolFailed || !ok;
+    m_writtenFrames.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Takes the oldest frame still waiting for the window out of the queue and
+ * returns its buffer. A repeat takes its place, which keeps the timing in full mode.
+ */
+void EncoderThread::dropOldest()
+{
+    FrameDescriptor frame;
+    while (m_frames.pop(frame)) {
+        switch (frame.type) {
+        case FrameDescriptor::Release:
+            release(frame.buffer);
+            break;
+        case FrameDescriptor::Repeat:
+            ++m_owedRepeats;
+            break;
+        case FrameDescriptor::Frame:
+            ++m_owedRepeats;
+            m_droppedOldest.fetch_add(1, std::memory_order_relaxed);
+            release(frame.buffer);
+            return;
+        }
+    }
+}
+
+EncodedFrame &EncoderThread::reserve()
+{
+    return m_reorder.at(m_sequence++);
+}
+
+/**
+ * Returns the buffers of converted frames to the free list right away, then
+ * writes out every finished frame at the head of the reorder window. Returns
+ * whether anything was written.
+ */
+bool EncoderThread::collect()
+{
+    const quint64 muxed = m_muxed;
+    for (quint64 sequence = m_muxed; sequence != m_sequence; ++sequence) {
+        EncodedFrame &slot = m_reorder.at(sequence);
+        if (slot.state.load(std::memory_order_acquire) >= EncodedFrame::Converted)
+            slot.frame.reset();
+    }
+
+    while (m_muxed != m_sequence) {
+        EncodedFrame &slot = m_reorder.at(m_muxed);
+        if (slot.state.load(std::memory_order_acquire) != EncodedFrame::Encoded)
+            break;
+
+        if (slot.repeat)
+            m_avi->repeatFrame();
+        else
+            m_avi->addEncodedFrame(slot.payload);
+
+        // The payload keeps its capacity for the next frame using this slot.
+        slot.state.store(EncodedFrame::Empty, std::memory_order_relaxed);
+        ++m_muxed;
+    }
+    m_writtenFrames.fetch_add(m_muxed - muxed, std::memory_order_relaxed);
+    return m_muxed != muxed;
+}
+
+void EncoderThread::release(int buffer)
+{
+    m_free.push(buffer);
+    if (m_starving.load(std::memory_order_acquire))
+        signalEventFd(m_releasedFd);
+}
+
+void EncoderThread::startWorkers()
+{
+    for (EncoderWorker *worker : m_workers)
+        worker->start();
+}
+
+void EncoderThread::stopWorkers()
+{
+    for (EncoderWorker *worker : m_workers)
+        worker->requestStop();
+    for (EncoderWorker *worker : m_workers)
+        worker->wait();
+}
+
+/**
+ * Runs on a worker thread. Converts the rows of one stripe to YCbCr, flipping
+ * and downscaling them on the way if needed, then compresses them.
+ */
+void EncoderThread::encode(const EncodeJob &job, EncoderWorker *worker)
+{
+    EncodedFrame &slot = m_reorder.at(job.sequence);
+    const Buffer *buf = m_buffers.at(job.buffer);
+    JpegEncoder &jpeg = worker->m_jpeg;
+    QElapsedTimer timer;
+    timer.start();
+
+    if (!jpeg.isOpen()) {
+        // Sizes the stripe encoder cannot handle go through the image plugin whole.
+        QImage image;
+        if (m_scaler.filter() == Scaler::None) {
+            const QSize size = buf->image.size();
+            QImage &target = worker->m_converted.acquire(size, QImage::Format_RGB32);
+            PixelConvert::rgbaToRgb32(buf->data, buf->stride, target.bits(), target.bytesPerLine(),
+                                      size.width(), size.height(), job.flip);
+            image = target;
+        } else {
+            qptrdiff srcStride = 0;
+            const uchar *src = topRow(buf, job.flip, &srcStride);
+            QImage &target = worker->m_scaled.acquire(m_scaler.destinationSize(), QImage::Format_RGB32);
+            m_scaler.scale(src, srcStride, target.bits(), target.bytesPerLine());
+            image = target;
+        }
+        slot.state.store(EncodedFrame::Converted, std::memory_order_release);
+        wake();
+
+        slot.payload = QAviWriter::encodeFrame(image, "JPG", job.quality);
+        slot.repeat = slot.payload.isEmpty();
+        m_encodeNanos.fetch_add(quint64(timer.nsecsElapsed()), std::memory_order_relaxed);
+        finishFrame(slot);
+        return;
+    }
+
+    // Every stripe of a frame carries the same quality, the header comes with the first one.
+    jpeg.setQuality(job.quality);
+
+    // Frames are converted straight into the encoder's YCbCr planes, a 2x reduction
+    // is folded into that pass. Other scale factors go through the scaler first.
+    qptrdiff srcStride = 0;
+    const uchar *src = topRow(buf, job.flip, &srcStride);
+    const int top = jpeg.stripeTop(job.stripe);
+    if (m_scaler.filter() == Scaler::None) {
+        jpeg.loadStripe(src + top * srcStride, srcStride, job.stripe, JpegEncoder::Rgba8888);
+    } else if (m_scaler.filter() == Scaler::Box && m_scaler.factor() == 2) {
+        jpeg.loadStripe(src + top * 2 * srcStride, srcStride, job.stripe, JpegEncoder::Rgba8888Half);
+    } else {
+        // The scaler output rows are addressed in frame coordinates, the stripe fills its part of them.
+        QImage &target = worker->m_scaled.acquire(m_scaler.destinationSize(), QImage::Format_RGB32);
+        m_scaler.scale(src, srcStride, target.bits(), target.bytesPerLine(), top, top + jpeg.stripeHeight(job.stripe));
+        jpeg.loadStripe(target.constScanLine(top), target.bytesPerLine(), job.stripe, JpegEncoder::Rgb32);
+    }
+    if (slot.converting.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        slot.state.store(EncodedFrame::Converted, std::memory_order_release);
+        wake();
+    }
+
+    const int stripes = jpeg.stripeCount();
+    if (!jpeg.encodeStripe(job.stripe, stripes > 1 ? &slot.stripes[job.stripe] : &slot.payload))
+        slot.failed.store(true, std::memory_order_relaxed);
+    m_encodeNanos.fetch_add(quint64(timer.nsecsElapsed()), std::memory_order_relaxed);
+    finishStripe(slot, stripes);
+}
+
+/**
+ * The worker completing the last stripe of a frame joins the stripe outputs into
+ * the payload, they already carry the header and the restart markers. A frame
+ * with a stripe that failed is written as a repeat of the previous one, which
+ * keeps its slot in the timeline.
+ */
+void EncoderThread::finishStripe(EncodedFrame &slot, int stripes)
+{
+    if (slot.encoding.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    if (slot.failed.load(std::memory_order_relaxed)) {
+        qCWarning(logencoder) << "JPEG encoding failed, repeating the previous frame.";
+        slot.repeat = true;
+    } else if (stripes > 1) {
+        int size = 0;
+        for (const QByteArray &part : slot.stripes)
+            size += part.size();
+        slot.payload.resize(size);
+        char *out = slot.payload.data();
+        for (const QByteArray &part : slot.stripes) {
+            memcpy(out, part.constData(), size_t(part.size()));
+            out += part.size();
+        }
+    }
+    finishFrame(slot);
+}
+
+void EncoderThread::finishFrame(EncodedFrame &slot)
+{
+    m_encodedFrames.fetch_add(1, std::memory_order_relaxed);
+    slot.state.store(EncodedFrame::Encoded, std::memory_order_release);
+    wake();
+}
+
+void EncoderThread::wake()
+{
+    signalEventFd(m_wakeFd);
+}
+
+const uchar *EncoderThread::topRow(const Buffer *buf, bool flip, qptrdiff *stride)
+{
+    *stride = flip ? -qptrdiff(buf->stride) : qptrdiff(buf->stride);
+    return flip ? buf->data + qptrdiff(buf->image.height() - 1) * buf->stride : buf->data;
+}
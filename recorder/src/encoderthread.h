@@ -0,0 +1,276 @@
+#ifndef ENCODERTHREAD_H
+#define ENCODERTHREAD_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QList>
+#include <QSize>
+#include <QThread>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+
+#include "changedetector.h"
+#include "jpegencoder.h"
+#include "scaler.h"
+#include "spscring.h"
+
+class Buffer;
+class EncoderThread;
+class QAviWriter;
+class SpoolWriter;
+
+struct FrameDescriptor
+{
+    enum Type {
+        Frame,   // encode the buffer, then return it to the free list
+        Repeat,  // add the previous frame again, used by full mode
+        Release, // return the buffer to the free list without encoding
+    };
+
+    Type type = Frame;
+    int buffer = -1;
+    uint32_t timestamp = 0;
+    int transform = 0;
+};
+
+/**
+ * Reference-counted read-only view of a capture buffer. The buffer goes back to
+ * the free list when the last handle referencing it is destroyed, so encoding
+ * can read the shm memory directly instead of a copy.
+ */
+class FrameHandle
+{
+public:
+    FrameHandle() = default;
+    FrameHandle(EncoderThread *owner, Buffer *buffer);
+    FrameHandle(const FrameHandle &other);
+    FrameHandle &operator=(const FrameHandle &other);
+    ~FrameHandle();
+
+    const QImage &image() const { return m_image; }
+    // Replaces the view with an image that no longer needs the buffer and drops the reference.
+    void setImage(const QImage &image);
+
+    bool isNull() const { return m_image.isNull(); }
+    void reset();
+
+private:
+    void ref();
+
+    EncoderThread *m_owner = nullptr;
+    Buffer *m_buffer = nullptr;
+    QImage m_image;
+};
+
+/**
+ * Two reusable output images. A slot is handed out again only once nobody else
+ * references it anymore, so writing into it never triggers a detach copy.
+ */
+class ScratchImages
+{
+public:
+    QImage &acquire(const QSize &size, QImage::Format format);
+
+private:
+    QImage m_images[2];
+    int m_next = 0;
+};
+
+struct EncodeJob
+{
+    quint64 sequence = 0;
+    int buffer = -1;
+    int stripe = 0;
+    int quality = 0;
+    bool flip = false;
+};
+
+/**
+ * One frame on its way through the encoder workers. The pipeline thread owns the
+ * slot while it is Empty, a worker fills it in after it was Queued and the muxer
+ * takes it back once it is Encoded.
+ */
+struct EncodedFrame
+{
+    enum State {
+        Empty,
+        Queued,    // handed to a worker
+        Converted, // the worker no longer reads the capture buffer
+        Encoded,   // payload is ready to be written
+    };
+
+    std::atomic<int> state{Empty};
+    // Stripes still to be converted and encoded, the worker finishing the last
+    // one advances the state.
+    std::atomic<int> converting{0};
+    std::atomic<int> encoding{0};
+    std::atomic<bool> failed{false}; // a stripe could not be compressed
+    bool repeat = false;
+    FrameHandle frame; // only touched by the pipeline thread
+    QByteArray payload;
+    QVector<QByteArray> stripes; // per stripe output when a frame is split
+};
+
+/**
+ * Fixed window of EncodedFrame slots keyed by frame sequence number, so workers
+ * may finish in any order while the muxer still writes in capture order.
+ */
+class ReorderBuffer
+{
+public:
+    void reset(size_t capacity);
+    size_t capacity() const { return m_mask + 1; }
+    EncodedFrame &at(quint64 sequence) { return m_slots[sequence & m_mask]; }
+
+private:
+    std::unique_ptr<EncodedFrame[]> m_slots;
+    size_t m_mask = 0;
+};
+
+/**
+ * Converts, scales and JPEG-compresses the frames the pipeline thread hands to it.
+ */
+class EncoderWorker : public QThread
+{
+public:
+    EncoderWorker(EncoderThread *pipeline, size_t capacity);
+    virtual ~EncoderWorker();
+
+    // Pipeline thread only.
+    bool post(const EncodeJob &job);
+    void requestStop();
+
+protected:
+    void run() override;
+
+private:
+    EncoderThread *m_pipeline;
+    SpscRing<EncodeJob> m_jobs;
+    int m_wakeFd = -1;
+    std::atomic<bool> m_stop{false};
+    ScratchImages m_converted;
+    ScratchImages m_scaled;
+    JpegEncoder m_jpeg;
+
+    friend class EncoderThread;
+};
+
+class EncoderThread : public QThread
+{
+public:
+    struct Settings {
+        QSize size;
+        double scale;
+        bool smooth;
+        int quality;
+        int encoders; // worker threads, 0 picks one per core
+        int stripes;  // restart interval stripes per frame, 0 picks by frame size
+    };
+
+    // Counters sampled by the load controller.
+    struct Load {
+        int queued;          // descriptors waiting for the pipeline thread
+        int freeBuffers;
+        quint64 frames;      // frames compressed so far
+        quint64 encodeNanos; // worker time spent on them
+    };
+
+    explicit EncoderThread(QAviWriter *avi, QObject *parent = nullptr);
+    virtual ~EncoderThread();
+
+    void setBuffers(const QList<Buffer *> &buffers);
+    void setSettings(const Settings &settings);
+
+    // May be called while running, applies from the next dispatched frame on.
+    void setQuality(int quality);
+    // While the producer starves, turn the oldest queued frame into a repeat of the
+    // previous one so its buffer can take a new capture. Set before start().
+    void setDropOldest(bool drop);
+    // Appends the frames to @p spool instead of encoding them, nullptr to encode.
+    // Set before start().
+    void setSpool(SpoolWriter *spool);
+    quint64 droppedOldest() const { return m_droppedOldest.load(std::memory_order_relaxed); }
+    int workerCount() const { return m_workers.size(); }
+    // Capture thread only, like acquireBuffer().
+    Load load() const;
+    // Frames and repeats submitted but not written yet.
+    int backlog() const;
+
+    // Producer side, capture thread only.
+    int acquireBuffer();
+    bool submit(const FrameDescriptor &frame);
+    void setStarving(bool starving);
+    // Repeats that did not fit the queue when capture ended, written after
+    // everything queued. Call before requestStop().
+    void appendRepeats(int count);
+    void requestStop();
+
+    // Becomes readable whenever a buffer is released while the producer is starving.
+    int releasedFd() const { return m_releasedFd; }
+    void clearReleased();
+
+protected:
+    void run() override;
+
+private:
+    void process(const FrameDescriptor &frame);
+    void runSpool();
+    void spool(const FrameDescriptor &frame);
+    void dropOldest();
+    EncodedFrame &reserve();
+    bool collect();
+    void release(int buffer);
+
+    void startWorkers();
+    void stopWorkers();
+
+    // Worker threads, reads only what setBuffers() and setSettings() prepared.
+    void encode(const EncodeJob &job, EncoderWorker *worker);
+    void finishStripe(EncodedFrame &slot, int stripes);
+    void finishFrame(EncodedFrame &slot);
+    void wake();
+
+    static const uchar *topRow(const Buffer *buf, bool flip, qptrdiff *stride);
+
+    QAviWriter *m_avi;
+    SpoolWriter *m_spool = nullptr;
+    bool m_spoolFailed = false;
+    QList<Buffer *> m_buffers;
+    Settings m_settings;
+    std::atomic<int> m_quality{0};
+    std::atomic<quint64> m_encodedFrames{0};
+    std::atomic<quint64> m_submittedFrames{0};
+    std::atomic<quint64> m_writtenFrames{0};
+    std::atomic<quint64> m_encodeNanos{0};
+
+    SpscRing<FrameDescriptor> m_frames;
+    SpscRing<int> m_free;
+
+    int m_wakeFd = -1;
+    int m_releasedFd = -1;
+    std::atomic<bool> m_starving{false};
+    std::atomic<bool> m_stop{false};
+    std::atomic<bool> m_dropOldest{false};
+    std::atomic<quint64> m_droppedOldest{0};
+    int m_owedRepeats = 0; // dropped frames whose repeat did not fit the window yet
+    std::atomic<int> m_trailingRepeats{0};
+
+    ChangeDetector m_changes;
+    int m_duplicates = 0;
+    bool m_encodedAny = false;
+    Scaler m_scaler;
+
+    QVector<EncoderWorker *> m_workers;
+    int m_nextWorker = 0;
+    int m_stripes = 1;
+    ReorderBuffer m_reorder;
+    quint64 m_sequence = 0; // next sequence number to dispatch
+    quint64 m_muxed = 0;    // next sequence number to write
+
+    friend class FrameHandle;
+    friend class EncoderWorker;
+};
+
+#endif // ENCODERTHREAD_H
@@ -0,0 +1,25 @@
+#ifndef EVENTFD_H
+#define EVENTFD_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// Wakeups between threads go through eventfds, these retry when interrupted.
+
+inline void signalEventFd(int fd)
+{
+    const uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
+
+// Resets the counter, returns at once if the eventfd is non-blocking and not signalled.
+inline void drainEventFd(int fd)
+{
+    uint64_t value = 0;
+    while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR) {
+    }
+}
+
+#endif // EVENTFD_H
@@ -0,0 +1,210 @@
+#include "framescheduler.h"
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <QLoggingCategory>
+#include <QSocketNotifier>
+
+Q_LOGGING_CATEGORY(logscheduler, "screenrecorder.scheduler", QtDebugMsg)
+
+static const qint64 NanosPerSecond = 1000000000;
+static const qint64 NanosPerMilli = 1000000;
+
+FrameScheduler::FrameScheduler(EncoderThread *encoder, QObject *parent)
+    : QObject(parent)
+    , m_encoder(encoder)
+    , m_timerFd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+{
+    if (m_timerFd < 0)
+        qFatal("Failed to create the frame timer: %s", strerror(errno));
+
+    m_notifier = new QSocketNotifier(m_timerFd, QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, &FrameScheduler::timeout);
+}
+
+FrameScheduler::~FrameScheduler()
+{
+    close(m_timerFd);
+}
+
+void FrameScheduler::start(int fps, bool fullMode)
+{
+    disarm();
+    m_fps = qMax(fps, 1);
+    m_divider = 1;
+    m_fullMode = fullMode;
+    m_started = false;
+    m_hasPending = false;
+    m_nextSlot = 0;
+    m_owedRepeats = 0;
+    m_encoded = 0;
+    m_repeated = 0;
+    m_dropped = 0;
+}
+
+void FrameScheduler::stop()
+{
+    disarm();
+    if (m_hasPending)
+        emitPending();
+    // The encoder writes what the queue still had no room for after the rest.
+    if (m_owedRepeats > 0) {
+        m_encoder->appendRepeats(m_owedRepeats);
+        m_repeated += quint64(m_owedRepeats);
+        m_owedRepeats = 0;
+    }
+    m_started = false;
+
+    qCDebug(logscheduler) << "Frames encoded:" << m_encoded
+                          << "repeated:" << m_repeated
+                          << "dropped:" << m_dropped;
+}
+
+void FrameScheduler::addFrame(const FrameDescriptor &frame)
+{
+    const qint64 now = monotonicNow();
+    if (!m_started) {
+        m_started = true;
+        m_lastTimestamp = frame.timestamp;
+        m_elapsed = 0;
+        m_originTime = now;
+    } else {
+        // Timestamps are 32 bit milliseconds with an unspecified base, only their
+        // differences matter. Accumulating them keeps working after a wrap.
+        m_elapsed += int32_t(frame.timestamp - m_lastTimestamp);
+        m_lastTimestamp = frame.timestamp;
+        // The smallest delivery delay seen so far maps compositor time to our clock.
+        m_originTime = qMin(m_originTime, now - m_elapsed * NanosPerMilli);
+    }
+
+    const qint64 slot = qMax<qint64>(m_elapsed, 0) * m_fps / 1000;
+
+    if (m_hasPending) {
+        if (slot <= m_pendingEnd) {
+            // A newer frame of the same group replaces the pending one.
+            FrameDescriptor release;
+            release.type = FrameDescriptor::Release;
+            release.buffer = m_pending.buffer;
+            m_encoder->submit(release);
+            ++m_dropped;
+            m_pending = frame;
+            return;
+        }
+        emitPending();
+    }
+
+    // The slot of a late frame was already written, it is shown in the next one.
+    const qint64 group = slot / m_divider * m_divider;
+    m_pending = frame;
+    m_pendingSlot = qMax(group, m_nextSlot);
+    m_pendingEnd = qMax(group + m_divider - 1, m_pendingSlot);
+    m_hasPending = true;
+    arm(m_pendingEnd);
+}
+
+void FrameScheduler::setDivider(int divider)
+{
+    m_divider = qMax(divider, 1);
+}
+
+void FrameScheduler::timeout()
+{
+    uint64_t expirations = 0;
+    while (read(m_timerFd, &expirations, sizeof(expirations)) < 0 && errno == EINTR) {
+    }
+    if (!m_started)
+        return;
+
+    const qint64 current = slotAt(monotonicNow());
+    if (m_hasPending && m_pendingEnd < current)
+        emitPending();
+    if (m_fullMode)
+        repeatUntil(current);
+
+    if (m_hasPending)
+        arm(m_pendingEnd);
+    else if (m_fullMode)
+        arm(m_nextSlot);
+    else
+        disarm();
+}
+
+void FrameScheduler::emitPending()
+{
+    if (m_fullMode)
+        repeatUntil(m_pendingSlot);
+
+    // The queue has room for every buffer once and as many repeats, a frame
+    // always fits. Failing here would lose its buffer for the rest of the recording.
+    if (!m_encoder->submit(m_pending))
+        qFatal("Frame queue overflow, the buffer of a frame would be lost.");
+    ++m_encoded;
+    m_hasPending = false;
+    m_nextSlot = m_pendingSlot + 1;
+}
+
+void FrameScheduler::repeatUntil(qint64 slot)
+{
+    if (m_nextSlot < slot) {
+        m_owedRepeats += int(slot - m_nextSlot);
+        m_nextSlot = slot;
+    }
+    submitOwed();
+}
+
+/**
+ * Submits the repeats owed for slots that already passed. A full queue refuses
+ * them, they stay owed and are retried on the next tick, so every slot still
+ * ends up in the file and the video keeps its length against the audio.
+ */
+void FrameScheduler::submitOwed()
+{
+    FrameDescriptor repeat;
+    repeat.type = FrameDescriptor::Repeat;
+    while (m_owedRepeats > 0 && m_encoder->submit(repeat)) {
+        --m_owedRepeats;
+        ++m_repeated;
+    }
+}
+
+void FrameScheduler::arm(qint64 slot)
+{
+    const qint64 deadline = slotEnd(slot);
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = deadline / NanosPerSecond;
+    spec.it_value.tv_nsec = deadline % NanosPerSecond;
+    if (timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0)
+        qCWarning(logscheduler) << "Failed to arm the frame timer:" << strerror(errno);
+}
+
+void FrameScheduler::disarm()
+{
+    itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    timerfd_settime(m_timerFd, 0, &spec, nullptr);
+}
+
+qint64 FrameScheduler::slotAt(qint64 monotonic) const
+{
+    if (monotonic < m_originTime)
+        return 0;
+    return (monotonic - m_originTime) * m_fps / NanosPerSecond;
+}
+
+// First instant of the next slot, so the timer fires once the slot is complete.
+qint64 FrameScheduler::slotEnd(qint64 slot) const
+{
+    return m_originTime + ((slot + 1) * NanosPerSecond + m_fps - 1) / m_fps;
+}
+
+qint64 FrameScheduler::monotonicNow()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return qint64(ts.tv_sec) * NanosPerSecond + ts.tv_nsec;
+}
@@ -0,0 +1,84 @@
+#ifndef FRAMESCHEDULER_H
+#define FRAMESCHEDULER_H
+
+#include <QObject>
+
+#include "encoderthread.h"
+
+class QSocketNotifier;
+
+/**
+ * Maps captured frames onto the fixed output frame grid. Slot k covers the
+ * compositor time [origin + k / fps, origin + (k + 1) / fps), origin being the
+ * timestamp of the first frame. The newest frame of a slot is encoded once the
+ * slot is over, older frames of the same slot are dropped without encoding.
+ *
+ * Slot ends are absolute CLOCK_MONOTONIC deadlines of a timerfd, computed from
+ * the slot index, so the grid does not drift however long the recording is. In
+ * full mode a slot that ends without any frame repeats the previous one, which
+ * keeps the video in real time.
+ *
+ * With a divider of n the slots are grouped by n, only the newest frame of a
+ * group is encoded and the other slots of the group repeat it. This lowers the
+ * encoded frame rate without changing the rate of the file.
+ */
+class FrameScheduler : public QObject
+{
+public:
+    explicit FrameScheduler(EncoderThread *encoder, QObject *parent = nullptr);
+    virtual ~FrameScheduler();
+
+    void start(int fps, bool fullMode);
+    // Hands the pending frame to the encoder and stops the timer.
+    void stop();
+
+    // Takes over the buffer of a captured frame, its timestamp is in compositor milliseconds.
+    void addFrame(const FrameDescriptor &frame);
+
+    void setDivider(int divider);
+    int divider() const { return m_divider; }
+
+    // CLOCK_MONOTONIC nanoseconds of the first frame's timestamp, 0 before it.
+    qint64 originTime() const { return m_started ? m_originTime : 0; }
+
+    quint64 encodedCount() const { return m_encoded; }
+    quint64 repeatedCount() const { return m_repeated; }
+    quint64 droppedCount() const { return m_dropped; }
+
+private:
+    void timeout();
+    void emitPending();
+    void repeatUntil(qint64 slot);
+    void submitOwed();
+    void arm(qint64 slot);
+    void disarm();
+
+    qint64 slotAt(qint64 monotonic) const;
+    qint64 slotEnd(qint64 slot) const;
+    static qint64 monotonicNow();
+
+    EncoderThread *m_encoder;
+    int m_timerFd = -1;
+    QSocketNotifier *m_notifier = nullptr;
+
+    int m_fps = 1;
+    int m_divider = 1;
+    bool m_fullMode = false;
+    bool m_started = false;
+    uint32_t m_lastTimestamp = 0;
+    qint64 m_elapsed = 0;      // compositor milliseconds since the first frame
+    qint64 m_originTime = 0;   // CLOCK_MONOTONIC nanoseconds of the first frame's timestamp
+    qint64 m_nextSlot = 0;     // slot the next output frame belongs to
+    int m_owedRepeats = 0;     // slots passed whose repeat the queue had no room for yet
+
+    bool m_hasPending = false;
+    FrameDescriptor m_pending;
+    qint64 m_pendingSlot = 0;  // slot the pending frame is written to
+    qint64 m_pendingEnd = 0;   // last slot of its group, the frame is written once it is over
+
+    quint64 m_encoded = 0;
+    quint64 m_repeated = 0;
+    quint64 m_dropped = 0;
+};
+
+#endif // FRAMESCHEDULER_H
@@ -37,16 +37,131 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+/* chunk offsets in the file go past 2 GB in OpenDML mode */
+#define _FILE_OFFSET_BITS 64
+
 #include "gwavi.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <iostream>
 #include <system_error>
 
 #define ZEROIZE(x) {memset(&x, 0, sizeof(x));}
 
+/* flags kept in the upper bits of the sizes stored in offsets */
+#define INDEX_AUDIO 0x80000000u
+#define INDEX_REPEAT 0x40000000u
+#define INDEX_SIZE 0x3fffffffu
+
+/* index entries per chunk, a chunk is never reallocated once started */
+#define INDEX_CHUNK_ENTRIES 16384
+
+/*
+ * Size of one RIFF list. Once the next chunk and its index would not fit any
+ * more the writer switches to OpenDML and continues in a RIFF AVIX list.
+ */
+#ifndef AVI_RIFF_LIMIT
+#define AVI_RIFF_LIMIT (1024 * 1024 * 1024)
+#endif
+
+/* super index entries reserved in the header, one per RIFF list */
+#define SUPER_INDEX_ENTRIES 256
+#define SUPER_INDEX_SIZE (24 + 16 * SUPER_INDEX_ENTRIES)
+/* LIST odml with a dmlh chunk */
+#define ODML_LIST_SIZE (4 + 8 + 248)
+/* ix## chunk header, not counting the entries */
+#define FIELD_INDEX_SIZE (8 + 24)
+
+/* headers, chunk prefixes and frames are staged in these and written in batches */
+#define OUT_BUFFER_SIZE (1024 * 1024)
+#define OUT_BUFFERS 4
+
 using namespace std;
 
+/* Recover() maps the file in windows, 32-bit processes cannot map it whole */
+#define MAP_WINDOW (64 * 1024 * 1024)
+
+struct avi_map_t {
+    int fd;
+    int64_t size;
+    unsigned char *data;
+    int64_t pos;
+    size_t len;
+
+    avi_map_t() : fd(-1), size(0), data(NULL), pos(0), len(0) {}
+    ~avi_map_t()
+    {
+    if (data)
+        munmap(data, len);
+    }
+};
+
+/* returns len bytes at pos, which must be inside the file */
+static const unsigned char *map_at(struct avi_map_t *map, int64_t pos, size_t len)
+{
+    if (!map->data || pos < map->pos || pos + (int64_t) len > map->pos + (int64_t) map->len) {
+    int64_t page = sysconf(_SC_PAGESIZE);
+    void *data;
+
+    if (map->data)
+        munmap(map->data, map->len);
+    map->data = NULL;
+    map->pos = pos - pos % page;
+    map->len = MAP_WINDOW;
+    if ((int64_t) map->len < pos - map->pos + (int64_t) len)
+        map->len = pos - map->pos + len;
+    if ((int64_t) map->len > map->size - map->pos)
+        map->len = map->size - map->pos;
+
+    data = mmap(NULL, map->len, PROT_READ, MAP_SHARED, map->fd, map->pos);
+    if (data == MAP_FAILED)
+        throw system_error(errno, generic_category());
+    madvise(data, map->len, MADV_SEQUENTIAL);
+    map->data = (unsigned char *) data;
+    }
+
+    return map->data + (pos - map->pos);
+}
+
+static unsigned int read_int(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24);
+}
+
+static unsigned int read_short(const unsigned char *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+/* a complete JPEG starts with SOI and ends with EOI, followed by the padding */
+static bool valid_jpeg(struct avi_map_t *map, int64_t pos, unsigned int size)
+{
+    const unsigned char *p;
+    int i;
+
+    if (size < 8)
+    return false;
+    p = map_at(map, pos, 2);
+    if (p[0] != 0xff || p[1] != 0xd8)
+    return false;
+
+    p = map_at(map, pos + size - 5, 5);
+    for (i = 3; i >= 0; i--) {
+    if (p[i] == 0xff && p[i + 1] == 0xd9)
+        return true;
+    if (p[i + 1] != 0)
+        return false;
+    }
+    return false;
+}
+
 /**
  * @param filename This is the name of the AVI file which will be generated by
  * this library.
@@ -59,24 +174,14 @@ using namespace std;
  * @param audio This parameter is optionnal. It is used for the audio track. If
  * you do not want to add an audio track to your AVI file, simply pass NULL for
  * this argument.
+ * @param output_kind How the file is written, see AviOutput.
  *
  */
 GWAVI::GWAVI(const char *filename, unsigned width, unsigned height, unsigned bpp, const char *fourcc, unsigned fps,
-    gwavi_audio_t *audio)
+    gwavi_audio_t *audio, AviOutput::Kind output_kind)
 {
-    ZEROIZE(avi_header);
-    ZEROIZE(stream_header_v);
-    ZEROIZE(stream_format_v);
-    ZEROIZE(stream_header_a);
-    ZEROIZE(stream_format_a);
-    marker = 0;
-    offsets_ptr = 0;
-    offsets_len = 0;
-    offsets_start = 0;
-    offsets = NULL;
-    offset_count = 0;
-
-    outFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+    init();
+    file_name = filename;
 
     try {
     if (check_fourcc(fourcc) != 0)
@@ -85,10 +190,16 @@ GWAVI::GWAVI(const char *filename, unsigned width, unsigned height, unsigned bpp
     if (fps < 1)
         throw 1;
 
-    outFile.open(filename, ios_base::out | ios_base::trunc | ios_base::binary);
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0)
+        throw system_error(errno, generic_category(), filename);
+    output = AviOutput::create(output_kind, fd, OUT_BUFFER_SIZE, OUT_BUFFERS);
+    out_buf = output->buffer();
+    output->setWriteBehind(true);
 
     /* set avi header */
-    avi_header.time_delay = 1000000 / fps;
+    /* microseconds per frame, informational: players use the stream rate/scale */
+    avi_header.time_delay = (1000000 + fps / 2) / fps;
     avi_header.data_rate = width * height * bpp / 8;
     avi_header.flags = 0x10;
 
@@ -158,30 +269,35 @@ GWAVI::GWAVI(const char *filename, unsigned width, unsigned height, unsigned bpp
 
     write_chars_bin("LIST", 4);
 
-    marker = outFile.tellp();
+    marker = tell();
 
     write_int(0);
     write_chars_bin("movi", 4);
 
-    offsets_len = 1024;
-    offsets = new unsigned int[offsets_len];
-    offsets_ptr = 0;
-
     } catch (...) {
-    if (outFile.is_open()) {
-        outFile.close();
-    }
+    delete output;
+    if (fd >= 0)
+        close(fd);
     throw;
     }
 }
 
-GWAVI::~GWAVI()
+/* for Recover(), which takes the state from an existing file */
+GWAVI::GWAVI()
 {
-    if (outFile.is_open()) {
-    outFile.close();
-    }
+    init();
+}
 
-    delete[] offsets;
+GWAVI::~GWAVI()
+{
+    /* waits for queued writes */
+    delete output;
+    if (fd >= 0)
+    close(fd);
+    if (sidecar_fd >= 0)
+    close(sidecar_fd);
+
+    free_index();
 }
 
 /**
@@ -196,8 +312,6 @@ GWAVI::~GWAVI()
 int GWAVI::AddVideoFrame(const char *buffer, size_t len)
 {
     int ret = 0;
-    size_t maxi_pad; /* if your frame is raggin, give it some paddin' */
-    size_t t;
 
     if (!buffer) {
     fputs("gwavi and/or buffer argument cannot be NULL", stderr);
@@ -206,36 +320,44 @@ int GWAVI::AddVideoFrame(const char *buffer, size_t len)
     if (len < 256)
     fprintf(stderr, "WARNING: specified buffer len seems rather small: %d. Are you sure about this?\n", (int) len);
     try {
-    offset_count++;
-    stream_header_v.data_length++;
+    last_video_len = write_chunk("00dc", buffer, len);
 
-    maxi_pad = len % 4;
-    if (maxi_pad > 0)
-        maxi_pad = 4 - maxi_pad;
+    stream_header_v.data_length++;
+    add_index_entry(last_video_len);
 
-    if (offset_count >= offsets_len) {
-        offsets_len += 1024;
-        delete[] offsets;
-        offsets = new unsigned int[offsets_len];
+    } catch (std::system_error& e) {
+    std::cerr << e.code().message() << "\n";
+    ret = -1;
     }
 
-    offsets[offsets_ptr++] = (unsigned int) (len + maxi_pad);
-
-    write_chars_bin("00dc", 4);
-
-    write_int((unsigned int) (len + maxi_pad));
-
-    outFile.write(buffer, len);
+    return ret;
+}
 
-    for (t = 0; t < maxi_pad; t++)
-        outFile.write("\0", 1);
+/**
+ * This function adds a video frame identical to the previous one. Nothing is
+ * written to the movi list, the index entry points at the chunk of the previous
+ * video frame instead, so players show it for one more frame duration.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVI::AddRepeatedVideoFrame()
+{
+    if (!last_video_len) {
+    fputs("there is no previous video frame to repeat", stderr);
+    return -1;
+    }
 
+    try {
+    check_segment(0);
     } catch (std::system_error& e) {
     std::cerr << e.code().message() << "\n";
-    ret = -1;
+    return -1;
     }
 
-    return ret;
+    add_index_entry(last_video_len | INDEX_REPEAT);
+    stream_header_v.data_length++;
+
+    return 0;
 }
 
 /**
@@ -247,40 +369,21 @@ int GWAVI::AddVideoFrame(const char *buffer, size_t len)
  *
  * @return 0 on success, -1 on error.
  */
-int GWAVI::AddAudioFrame(unsigned char *buffer, size_t len)
+int GWAVI::AddAudioFrame(const char *buffer, size_t len)
 {
     int ret = 0;
-    size_t maxi_pad; /* in case audio bleeds over the 4 byte boundary  */
-    size_t t;
+    unsigned int padded_len;
 
     if (!buffer) {
     (void) fputs("gwavi and/or buffer argument cannot be NULL", stderr);
     return -1;
     }
     try {
-    offset_count++;
+    padded_len = write_chunk("01wb", buffer, len);
 
-    maxi_pad = len % 4;
-    if (maxi_pad > 0)
-        maxi_pad = 4 - maxi_pad;
+    add_index_entry(padded_len | INDEX_AUDIO);
 
-    if (offset_count >= offsets_len) {
-        offsets_len += 1024;
-        delete[] offsets;
-        offsets = new unsigned int[offsets_len];
-    }
-
-    offsets[offsets_ptr++] = (unsigned int) ((len + maxi_pad) | 0x80000000);
-
-    write_chars_bin("01wb", 4);
-    write_int((unsigned int) (len + maxi_pad));
-
-    outFile.write((char *) buffer, len);
-
-    for (t = 0; t < maxi_pad; t++)
-        outFile.write("\0", 1);
-
-    stream_header_a.data_length += (unsigned int) (len + maxi_pad);
+    stream_header_a.data_length += padded_len;
 
     } catch (std::system_error& e) {
     std::cerr << e.code().message() << "\n";
@@ -302,36 +405,94 @@ int GWAVI::AddAudioFrame(unsigned char *buffer, size_t len)
 int GWAVI::Finalize()
 {
     int ret = 0;
-    long t;
+    int64_t t;
+    unsigned int movi_size;
 
     try {
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
-
-    write_index(offset_count, offsets);
+    if (odml) {
+        if (!end_segment())
+        ret = -1;
+        if (indexed_frames != stream_header_v.data_length || indexed_audio != stream_header_a.data_length)
+        ret = -1;
+        if (ret)
+        fputs("the index does not match the movi list\n", stderr);
+    } else {
+        movi_size = (unsigned int) (tell() - marker - 4);
+        patch_int(marker, movi_size);
+
+        if (!write_index(movi_size)) {
+        fputs("the index does not match the movi list\n", stderr);
+        ret = -1;
+        }
+        patch_int(4, (unsigned int) (tell() - 8));
+        first_riff_frames = stream_header_v.data_length;
+    }
+    flush();
+    output->drain();
 
-    delete[] offsets;
-    offsets = NULL;
+    free_index();
 
-    /* reset some avi header fields */
-    avi_header.number_of_frames = stream_header_v.data_length;
+    /* reset some avi header fields, in OpenDML the avih only covers the first RIFF */
+    avi_header.number_of_frames = first_riff_frames;
 
-    t = outFile.tellp();
-    outFile.seekp(12, ios_base::beg);
+    /* the header keeps its size, stage it again in place of the old one */
+    t = tell();
+    out_pos = 12;
     write_avi_header_chunk();
-    outFile.seekp(t, ios_base::beg);
+    flush();
+    output->drain();
+    out_pos = t;
 
-    t = outFile.tellp();
-    outFile.seekp(4, ios_base::beg);
-    write_int((unsigned int) (t - 8));
-    outFile.seekp(t, ios_base::beg);
+    output->trim(t);
 
     if (stream_format_v.palette) // TODO check
         delete[] stream_format_v.palette;
 
-    outFile.close();
+    delete output;
+    output = NULL;
+    if (close(fd) < 0) {
+        fd = -1;
+        throw system_error(errno, generic_category());
+    }
+    fd = -1;
+
+    /* an inconsistent file keeps the entries logged for Recover() */
+    if (!ret)
+        remove_sidecar();
+    } catch (std::system_error& e) {
+    std::cerr << e.code().message() << "\n";
+    ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * This function makes what was added so far survive a crash. It waits for the
+ * queued writes, patches the RIFF and movi sizes to the current end of the file,
+ * appends the index entries added since the last checkpoint to a sidecar file
+ * and syncs both. Only the data added since the last checkpoint is written, so
+ * the cost depends on how often it is called, not on the length of the file.
+ *
+ * After a crash, Recover() rebuilds the index of the file. The sidecar
+ * restores the repeated frames, which have no chunk to find.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int GWAVI::Checkpoint()
+{
+    int ret = 0;
+
+    try {
+    flush();
+    output->drain();
+    log_index();
+
+    patch_int(marker, (unsigned int) (tell() - marker - 4));
+    patch_int(riff_start + 4, (unsigned int) (tell() - riff_start - 8));
+
+    if (fdatasync(fd) < 0 || fdatasync(sidecar_fd) < 0)
+        throw system_error(errno, generic_category());
     } catch (std::system_error& e) {
     std::cerr << e.code().message() << "\n";
     ret = -1;
@@ -340,6 +501,327 @@ int GWAVI::Finalize()
     return ret;
 }
 
+/**
+ * This function finishes a file that was not finalized, because the recorder
+ * was killed or the device went down. The movi lists are scanned for complete
+ * chunks, a truncated or damaged last chunk and anything after it is cut off.
+ * The index is rebuilt from the chunks found and from the sidecar file written
+ * by Checkpoint(), then the file is finalized in place.
+ *
+ * @param filename File written by GWAVI.
+ * @param output_kind How the index and header are written, see AviOutput.
+ *
+ * @return 0 on success, 1 if the file is complete already, -1 on error.
+ */
+int GWAVI::Recover(const char *filename, AviOutput::Kind output_kind)
+{
+    GWAVI avi;
+
+    return avi.recover(filename, output_kind);
+}
+
+/**
+ * Fills the headers from the hdrl list of the file.
+ *
+ * @return the offset of the first movi list, -1 if the file was not written by
+ * GWAVI.
+ */
+int64_t GWAVI::read_header(struct avi_map_t *map)
+{
+    const unsigned char *p;
+    int64_t pos, end, hdrl_end;
+
+    if (map->size < 24)
+    return -1;
+    p = map_at(map, 0, 24);
+    if (memcmp(p, "RIFF", 4) || memcmp(p + 8, "AVI LIST", 8) || memcmp(p + 20, "hdrl", 4))
+    return -1;
+    hdrl_end = 20 + (int64_t) read_int(p + 16);
+    if (hdrl_end + 12 > map->size)
+    return -1;
+
+    for (pos = 24; pos + 8 <= hdrl_end; pos = end) {
+    p = map_at(map, pos, 12);
+    end = pos + 8 + read_int(p + 4);
+    if (end > hdrl_end)
+        return -1;
+
+    if (!memcmp(p, "avih", 4) && end - pos >= 8 + 56) {
+        p = map_at(map, pos + 8, 56);
+        avi_header.time_delay = read_int(p);
+        avi_header.data_rate = read_int(p + 4);
+        avi_header.reserved = read_int(p + 8);
+        avi_header.flags = read_int(p + 12);
+        avi_header.number_of_frames = read_int(p + 16);
+        avi_header.initial_frames = read_int(p + 20);
+        avi_header.data_streams = read_int(p + 24);
+        avi_header.buffer_size = read_int(p + 28);
+        avi_header.width = read_int(p + 32);
+        avi_header.height = read_int(p + 36);
+        avi_header.time_scale = read_int(p + 40);
+        avi_header.playback_data_rate = read_int(p + 44);
+        avi_header.starting_time = read_int(p + 48);
+        avi_header.data_length = read_int(p + 52);
+    } else if (!memcmp(p, "LIST", 4) && !memcmp(p + 8, "strl", 4)) {
+        struct gwavi_stream_header_t *header = NULL;
+        int64_t item, item_end;
+
+        for (item = pos + 12; item + 8 <= end; item = item_end) {
+        p = map_at(map, item, 8);
+        item_end = item + 8 + read_int(p + 4);
+        if (item_end > end)
+            return -1;
+
+        if (!memcmp(p, "strh", 4) && item_end - item >= 8 + 56) {
+            p = map_at(map, item + 8, 56);
+            header = !memcmp(p, "auds", 4) ? &stream_header_a : &stream_header_v;
+            memcpy(header->data_type, p, 4);
+            memcpy(header->codec, p + 4, 4);
+            header->flags = read_int(p + 8);
+            header->priority = read_int(p + 12);
+            header->initial_frames = read_int(p + 16);
+            header->time_scale = read_int(p + 20);
+            header->data_rate = read_int(p + 24);
+            header->start_time = read_int(p + 28);
+            header->data_length = read_int(p + 32);
+            header->buffer_size = read_int(p + 36);
+            header->video_quality = read_int(p + 40);
+            header->sample_size = read_int(p + 44);
+        } else if (!memcmp(p, "strf", 4) && header == &stream_header_v && item_end - item >= 8 + 40) {
+            p = map_at(map, item + 8, 40);
+            stream_format_v.header_size = read_int(p);
+            stream_format_v.width = read_int(p + 4);
+            stream_format_v.height = read_int(p + 8);
+            stream_format_v.num_planes = read_short(p + 12);
+            stream_format_v.bits_per_pixel = read_short(p + 14);
+            stream_format_v.compression_type = read_int(p + 16);
+            stream_format_v.image_size = read_int(p + 20);
+            stream_format_v.x_pels_per_meter = read_int(p + 24);
+            stream_format_v.y_pels_per_meter = read_int(p + 28);
+            stream_format_v.colors_used = read_int(p + 32);
+            stream_format_v.colors_important = read_int(p + 36);
+            if (stream_format_v.colors_used)
+            return -1;
+        } else if (!memcmp(p, "strf", 4) && header == &stream_header_a && item_end - item >= 8 + 18) {
+            p = map_at(map, item + 8, 18);
+            stream_format_a.format_type = read_short(p);
+            stream_format_a.channels = read_short(p + 2);
+            stream_format_a.sample_rate = read_int(p + 4);
+            stream_format_a.bytes_per_second = read_int(p + 8);
+            stream_format_a.block_align = read_short(p + 12);
+            stream_format_a.bits_per_sample = read_short(p + 14);
+            stream_format_a.size = read_short(p + 16);
+        }
+        }
+    }
+    }
+
+    p = map_at(map, hdrl_end, 12);
+    if (memcmp(p, "LIST", 4) || memcmp(p + 8, "movi", 4) || !stream_header_v.data_type[0])
+    return -1;
+
+    return hdrl_end;
+}
+
+/* adds an entry found by Recover() and counts it in the stream headers */
+void GWAVI::add_recovered_entry(unsigned int entry)
+{
+    add_index_entry(entry);
+
+    if (entry & INDEX_AUDIO) {
+    stream_header_a.data_length += entry & INDEX_SIZE;
+    } else {
+    stream_header_v.data_length++;
+    if (!(entry & INDEX_REPEAT))
+        last_video_len = entry & INDEX_SIZE;
+    }
+}
+
+int GWAVI::recover(const char *filename, AviOutput::Kind output_kind)
+{
+    struct avi_map_t map;
+    struct stat st;
+    std::vector<unsigned int> sidecar;
+    std::vector<unsigned int> scanned; /* chunks of the last segment */
+    std::vector<struct gwavi_super_index_entry_t> segment_ix[2];
+    unsigned int segment_entries[2] = { 0, 0 };
+    unsigned int segment_audio = 0;
+    size_t logged_before = 0; /* sidecar entries of the complete segments */
+    int64_t movi, pos, data_end, header_end;
+    int64_t scan_last_video = 0;
+    bool mjpeg;
+
+    file_name = filename;
+
+    try {
+    fd = open(filename, O_RDWR | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+        throw system_error(errno, generic_category(), filename);
+    map.fd = fd;
+    map.size = st.st_size;
+
+    movi = read_header(&map);
+    if (movi < 0) {
+        fprintf(stderr, "%s was not written by this recorder\n", filename);
+        return -1;
+    }
+    /* Finalize() sets the frame count last */
+    if (stream_header_v.data_length) {
+        fprintf(stderr, "%s is complete\n", filename);
+        return 1;
+    }
+    header_end = movi;
+    stream_header_a.data_length = 0;
+    mjpeg = !memcmp(stream_header_v.codec, "MJPG", 4);
+
+    /* the header has to come out with the same size to be rewritten in place */
+    output = AviOutput::create(output_kind, fd, OUT_BUFFER_SIZE, OUT_BUFFERS);
+    out_buf = output->buffer();
+    out_pos = 12;
+    write_avi_header_chunk();
+    if (tell() != header_end) {
+        fprintf(stderr, "%s has an unexpected header\n", filename);
+        return -1;
+    }
+    out_len = 0;
+
+    marker = movi + 4;
+    pos = movi + 12;
+    data_end = pos;
+
+    while (pos + 8 <= map.size) {
+        const unsigned char *p = map_at(&map, pos, 8);
+        unsigned int size = read_int(p + 4);
+        int64_t next = pos + 8 + size;
+
+        if (!memcmp(p, "00dc", 4) || !memcmp(p, "01wb", 4)) {
+        bool audio = p[1] == '1';
+        if (next > map.size || size > INDEX_SIZE)
+            break;
+        if (!audio && mjpeg && !valid_jpeg(&map, pos + 8, size))
+            break;
+        if (!audio)
+            scan_last_video = pos;
+        scanned.push_back(size | (audio ? INDEX_AUDIO : 0));
+        pos = data_end = next;
+        } else if (!memcmp(p, "ix00", 4) || !memcmp(p, "ix01", 4)) {
+        /* standard index of a segment that was closed */
+        struct gwavi_super_index_entry_t super;
+        int stream = p[3] - '0';
+        unsigned int count;
+
+        if (next > map.size || size < 24)
+            break;
+        count = read_int(map_at(&map, pos + 12, 4));
+        if (size < 24 + 8 * count)
+            break;
+        super.offset = pos;
+        super.size = size + 8;
+        super.duration = count;
+        if (stream == 1) {
+            unsigned int bytes = 0;
+            for (unsigned int i = 0; i < count; i++)
+            bytes += read_int(map_at(&map, pos + 36 + 8 * i, 4)) & 0x7fffffffu;
+            super.duration = bytes / (stream_format_a.block_align ? stream_format_a.block_align : 1);
+            segment_audio += bytes;
+        }
+        segment_ix[stream].push_back(super);
+        segment_entries[stream] += count;
+        pos = next;
+        } else if (!memcmp(p, "idx1", 4) || !memcmp(p, "JUNK", 4)) {
+        if (next > map.size)
+            break;
+        pos = next;
+        } else if (!memcmp(p, "RIFF", 4) && pos + 24 <= map.size) {
+        /* the previous segment is complete, its indexes are taken as they are */
+        p = map_at(&map, pos, 24);
+        if (memcmp(p + 8, "AVIXLIST", 8) || memcmp(p + 20, "movi", 4) || segment_ix[0].empty())
+            break;
+        for (int stream = 0; stream < 2; stream++) {
+            super_index[stream].insert(super_index[stream].end(), segment_ix[stream].begin(),
+            segment_ix[stream].end());
+            segment_ix[stream].clear();
+        }
+        stream_header_v.data_length += segment_entries[0];
+        stream_header_a.data_length += segment_audio;
+        indexed_frames += segment_entries[0];
+        indexed_audio += segment_audio;
+        logged_before += segment_entries[0] + segment_entries[1];
+        if (segment == 0)
+            first_riff_frames = segment_entries[0];
+        segment_entries[0] = segment_entries[1] = 0;
+        segment_audio = 0;
+        last_video_pos = scan_last_video;
+        scanned.clear();
+
+        odml = true;
+        segment++;
+        riff_start = pos;
+        marker = pos + 16;
+        pos = data_end = pos + 24;
+        } else {
+        break;
+        }
+    }
+
+    /* the sidecar holds the repeated frames up to the last checkpoint */
+    {
+        std::string name = file_name + ".index";
+        int sidecar_in = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (sidecar_in >= 0) {
+        std::vector<unsigned char> bytes;
+        unsigned char buffer[65536];
+        ssize_t n;
+        while ((n = read(sidecar_in, buffer, sizeof(buffer))) > 0)
+            bytes.insert(bytes.end(), buffer, buffer + n);
+        close(sidecar_in);
+        /* entries before the first logged one are never needed, they are in closed segments */
+        if (bytes.size() >= 4 && read_int(&bytes[0]) <= logged_before) {
+            logged_before -= read_int(&bytes[0]);
+            for (size_t i = 4; i + 4 <= bytes.size(); i += 4)
+            sidecar.push_back(read_int(&bytes[i]));
+        }
+        }
+    }
+
+    {
+        size_t chunk = 0;
+        bool have_video = last_video_pos != 0;
+
+        for (size_t i = logged_before; i < sidecar.size(); i++) {
+        if (sidecar[i] & INDEX_REPEAT) {
+            if (!have_video)
+            break;
+            add_recovered_entry(sidecar[i]);
+            continue;
+        }
+        if (chunk >= scanned.size() || scanned[chunk] != sidecar[i])
+            break;
+        if (!(scanned[chunk] & INDEX_AUDIO))
+            have_video = true;
+        add_recovered_entry(scanned[chunk++]);
+        }
+        for (; chunk < scanned.size(); chunk++)
+        add_recovered_entry(scanned[chunk]);
+    }
+
+    /* drop anything after the last complete chunk, a stale index included */
+    if (ftruncate(fd, data_end) < 0)
+        throw system_error(errno, generic_category(), filename);
+    out_pos = data_end;
+
+    fprintf(stderr, "%s: recovered %u frames in %d segments\n", filename, stream_header_v.data_length, segment + 1);
+    } catch (std::system_error& e) {
+    std::cerr << e.code().message() << "\n";
+    return -1;
+    }
+
+    if (Finalize() != 0)
+    return -1;
+    unlink((file_name + ".index").c_str());
+    return 0;
+}
+
 /**
  * This function allows you to reset the framerate. In a standard use case, you
  * should not need to call it. However, if you need to, you can call it to reset
@@ -353,8 +835,11 @@ int GWAVI::Finalize()
  */
 void GWAVI::SetFramerate(unsigned int fps)
 {
+    if (fps < 1)
+        return;
+    stream_header_v.time_scale = 1;
     stream_header_v.data_rate = fps;
-    avi_header.time_delay = (10000000 / fps);
+    avi_header.time_delay = (1000000 + fps / 2) / fps;
 }
 
 /**
@@ -407,12 +892,32 @@ void GWAVI::SetVideoFrameSize(unsigned int width, unsigned int height)
 
 }
 
+/**
+ * This function allows long recordings to keep a constant amount of memory for
+ * the index. Full index chunks are then moved to an unlinked temporary file in
+ * the directory of the AVI file and read back by Finalize().
+ *
+ * @param enable Whether full index chunks may leave memory.
+ */
+void GWAVI::SetIndexSpill(bool enable)
+{
+    index_spill = enable;
+}
+
+/**
+ * @return the name of the output backend writing the file.
+ */
+const char *GWAVI::OutputName() const
+{
+    return output ? output->name() : "";
+}
+
 void GWAVI::write_avi_header(struct gwavi_header_t *avi_header)
 {
-    long marker, t;
+    int64_t marker;
 
     write_chars_bin("avih", 4);
-    marker = outFile.tellp();
+    marker = tell();
     write_int(0);
 
     write_int(avi_header->time_delay);
@@ -432,18 +937,15 @@ void GWAVI::write_avi_header(struct gwavi_header_t *avi_header)
     write_int(avi_header->starting_time);
     write_int(avi_header->data_length);
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    patch_int(marker, (unsigned int) (tell() - marker - 4));
 }
 
 void GWAVI::write_stream_header(struct gwavi_stream_header_t *stream_header)
 {
-    long marker, t;
+    int64_t marker;
 
     write_chars_bin("strh", 4);
-    marker = outFile.tellp();
+    marker = tell();
     write_int(0);
 
     write_chars_bin(stream_header->data_type, 4);
@@ -461,19 +963,16 @@ void GWAVI::write_stream_header(struct gwavi_stream_header_t *stream_header)
     write_int(0);
     write_int(0);
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    patch_int(marker, (unsigned int) (tell() - marker - 4));
 }
 
 void GWAVI::write_stream_format_v(struct gwavi_stream_format_v_t *stream_format_v)
 {
-    long marker, t;
+    int64_t marker;
     unsigned int i;
 
     write_chars_bin("strf", 4);
-    marker = outFile.tellp();
+    marker = tell();
     write_int(0);
     write_int(stream_format_v->header_size);
     write_int(stream_format_v->width);
@@ -489,28 +988,24 @@ void GWAVI::write_stream_format_v(struct gwavi_stream_format_v_t *stream_format_
 
     if (stream_format_v->colors_used != 0) {
     for (i = 0; i < stream_format_v->colors_used; i++) {
-        unsigned char c = stream_format_v->palette[i] & 255;
-        outFile.write((char *) &c, 1);
-        c = (stream_format_v->palette[i] >> 8) & 255;
-        outFile.write((char *) &c, 1);
-        c = (stream_format_v->palette[i] >> 16) & 255;
-        outFile.write((char *) &c, 1);
-        outFile.write("\0", 1);
+        unsigned char c[4];
+        c[0] = stream_format_v->palette[i] & 255;
+        c[1] = (stream_format_v->palette[i] >> 8) & 255;
+        c[2] = (stream_format_v->palette[i] >> 16) & 255;
+        c[3] = 0;
+        put(c, 4);
     }
     }
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    patch_int(marker, (unsigned int) (tell() - marker - 4));
 }
 
 void GWAVI::write_stream_format_a(struct gwavi_stream_format_a_t *stream_format_a)
 {
-    long marker, t;
+    int64_t marker;
 
     write_chars_bin("strf", 4);
-    marker = outFile.tellp();
+    marker = tell();
     write_int(0);
     write_short(stream_format_a->format_type);
     write_short(stream_format_a->channels);
@@ -520,87 +1015,525 @@ void GWAVI::write_stream_format_a(struct gwavi_stream_format_a_t *stream_format_
     write_short(stream_format_a->bits_per_sample);
     write_short(stream_format_a->size);
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    patch_int(marker, (unsigned int) (tell() - marker - 4));
 }
 
 void GWAVI::write_avi_header_chunk()
 {
-    long marker, t;
-    long sub_marker;
+    int64_t marker;
+    int64_t sub_marker;
+    struct gwavi_stream_header_t audio_header;
 
     write_chars_bin("LIST", 4);
-    marker = outFile.tellp();
+    marker = tell();
     write_int(0);
     write_chars_bin("hdrl", 4);
     write_avi_header(&avi_header);
 
     write_chars_bin("LIST", 4);
-    sub_marker = outFile.tellp();
+    sub_marker = tell();
     write_int(0);
     write_chars_bin("strl", 4);
     write_stream_header(&stream_header_v);
     write_stream_format_v(&stream_format_v);
+    write_super_index(0);
 
-    t = outFile.tellp();
-
-    outFile.seekp(sub_marker, ios_base::beg);
-    write_int((unsigned int) (t - sub_marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    patch_int(sub_marker, (unsigned int) (tell() - sub_marker - 4));
 
     if (avi_header.data_streams == 2) {
     write_chars_bin("LIST", 4);
-    sub_marker = outFile.tellp();
+    sub_marker = tell();
     write_int(0);
     write_chars_bin("strl", 4);
-    write_stream_header(&stream_header_a);
+    /* the audio length is kept in bytes, the header counts samples */
+    audio_header = stream_header_a;
+    if (stream_format_a.block_align)
+        audio_header.data_length /= stream_format_a.block_align;
+    write_stream_header(&audio_header);
     write_stream_format_a(&stream_format_a);
+    write_super_index(1);
 
-    t = outFile.tellp();
-    outFile.seekp(sub_marker, ios_base::beg);
-    write_int((unsigned int) (t - sub_marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    patch_int(sub_marker, (unsigned int) (tell() - sub_marker - 4));
     }
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    write_odml_header();
+
+    patch_int(marker, (unsigned int) (tell() - marker - 4));
 }
 
-void GWAVI::write_index(int count, unsigned int *offsets)
+void GWAVI::init()
 {
-    long marker, t;
-    unsigned int offset = 4;
+    ZEROIZE(avi_header);
+    ZEROIZE(stream_header_v);
+    ZEROIZE(stream_format_v);
+    ZEROIZE(stream_header_a);
+    ZEROIZE(stream_format_a);
+    fd = -1;
+    output = NULL;
+    out_buf = NULL;
+    out_len = 0;
+    out_pos = 0;
+    marker = 0;
+    offset_count = 0;
+    index_spill = false;
+    index_fd = -1;
+    sidecar_fd = -1;
+    sidecar_pos = 0;
+    logged_count = 0;
+    closed_entries = 0;
+    last_video_len = 0;
+    odml = false;
+    segment = 0;
+    riff_start = 0;
+    last_video_pos = 0;
+    first_riff_frames = 0;
+    indexed_frames = 0;
+    indexed_audio = 0;
+}
+
+/**
+ * Appends the entries of the current segment that are not logged yet to the
+ * sidecar file, in the format of the index entries. The sidecar starts with the
+ * number of entries before the first one it holds, the rest follow in order.
+ */
+void GWAVI::log_index()
+{
+    std::vector<unsigned int> scratch(INDEX_CHUNK_ENTRIES);
+    std::vector<unsigned char> bytes;
+    struct iovec iov;
+
+    if (sidecar_fd < 0) {
+    std::string name = file_name + ".index";
+    unsigned char first[4];
+
+    sidecar_fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (sidecar_fd < 0)
+        throw system_error(errno, generic_category(), name);
+
+    first[0] = closed_entries;
+    first[1] = closed_entries >> 8;
+    first[2] = closed_entries >> 16;
+    first[3] = closed_entries >> 24;
+    iov.iov_base = first;
+    iov.iov_len = 4;
+    write_iov(sidecar_fd, &iov, 1, 0);
+    sidecar_pos = 4;
+    }
+
+    while (logged_count < offset_count) {
+    size_t chunk = logged_count / INDEX_CHUNK_ENTRIES;
+    size_t first = logged_count % INDEX_CHUNK_ENTRIES;
+    size_t count = INDEX_CHUNK_ENTRIES - first;
+    const unsigned int *entries = load_index_chunk(chunk, &scratch[0]);
+
+    if (count > (size_t) (offset_count - logged_count))
+        count = offset_count - logged_count;
+    bytes.resize(count * 4);
+    for (size_t i = 0; i < count; i++) {
+        unsigned int n = entries[first + i];
+        bytes[i * 4] = n;
+        bytes[i * 4 + 1] = n >> 8;
+        bytes[i * 4 + 2] = n >> 16;
+        bytes[i * 4 + 3] = n >> 24;
+    }
+
+    iov.iov_base = &bytes[0];
+    iov.iov_len = bytes.size();
+    write_iov(sidecar_fd, &iov, 1, sidecar_pos);
+    sidecar_pos += bytes.size();
+    logged_count += count;
+    }
+}
+
+void GWAVI::remove_sidecar()
+{
+    if (sidecar_fd < 0)
+    return;
+
+    close(sidecar_fd);
+    sidecar_fd = -1;
+    unlink((file_name + ".index").c_str());
+}
+
+/**
+ * Appends an entry to the index. Full chunks stay where they are, so growing
+ * never copies the entries recorded so far. With spilling enabled a full chunk
+ * moves to a temporary file and its memory is reused for the next one.
+ */
+void GWAVI::add_index_entry(unsigned int entry)
+{
+    size_t chunk = offset_count / INDEX_CHUNK_ENTRIES;
+    size_t pos = offset_count % INDEX_CHUNK_ENTRIES;
+
+    if (pos == 0) {
+    unsigned int *entries = NULL;
 
-    if (!offsets)
-    throw 1;
+    if (chunk > 0 && spill_index_chunk(chunk - 1)) {
+        entries = index_chunks[chunk - 1];
+        index_chunks[chunk - 1] = NULL;
+    }
+    if (!entries)
+        entries = new unsigned int[INDEX_CHUNK_ENTRIES];
+    index_chunks.push_back(entries);
+    }
+
+    index_chunks[chunk][pos] = entry;
+    offset_count++;
+}
+
+/**
+ * Writes a full chunk to the spill file, which is created next to the AVI file
+ * and unlinked right away. On any error spilling is turned off and the chunk
+ * stays in memory.
+ *
+ * @return true if the memory of the chunk may be reused.
+ */
+bool GWAVI::spill_index_chunk(size_t chunk)
+{
+    struct iovec iov;
+
+    if (!index_spill)
+    return false;
+
+    try {
+    if (index_fd < 0) {
+        std::string name = file_name + ".index-XXXXXX";
+        index_fd = mkstemp(&name[0]);
+        if (index_fd < 0)
+        throw system_error(errno, generic_category(), name);
+        unlink(name.c_str());
+    }
+
+    iov.iov_base = index_chunks[chunk];
+    iov.iov_len = INDEX_CHUNK_ENTRIES * sizeof(unsigned int);
+    write_iov(index_fd, &iov, 1, (int64_t) (chunk * iov.iov_len));
+    } catch (std::system_error& e) {
+    std::cerr << "keeping the index in memory: " << e.what() << "\n";
+    index_spill = false;
+    return false;
+    }
+
+    return true;
+}
+
+/* returns the entries of a chunk, reading spilled ones into scratch */
+const unsigned int *GWAVI::load_index_chunk(size_t chunk, unsigned int *scratch)
+{
+    size_t len = INDEX_CHUNK_ENTRIES * sizeof(unsigned int);
+    size_t done = 0;
+
+    if (index_chunks[chunk])
+    return index_chunks[chunk];
+
+    while (done < len) {
+    ssize_t n = pread(index_fd, (char *) scratch + done, len - done, (off_t) (chunk * len + done));
+    if (n < 0 && errno == EINTR)
+        continue;
+    if (n < 0)
+        throw system_error(errno, generic_category());
+    if (n == 0)
+        throw system_error(EIO, generic_category(), "short index spill file");
+    done += n;
+    }
+
+    return scratch;
+}
+
+/* forgets the entries, a spill file is kept for the next segment */
+void GWAVI::clear_index()
+{
+    for (size_t i = 0; i < index_chunks.size(); i++)
+    delete[] index_chunks[i];
+    index_chunks.clear();
+    offset_count = 0;
+    logged_count = 0;
+}
+
+void GWAVI::free_index()
+{
+    clear_index();
+
+    if (index_fd >= 0) {
+    close(index_fd);
+    index_fd = -1;
+    }
+}
+
+/**
+ * Writes the idx1 chunk and checks it against what went into the movi list:
+ * the chunks add up to movi_size, every repeat follows a video frame and the
+ * frame and audio totals match the stream headers.
+ *
+ * @return false if the index is inconsistent, it is written anyway.
+ */
+bool GWAVI::write_index(unsigned int movi_size)
+{
+    int64_t marker;
+    int t = 0;
+    unsigned int offset = 4;
+    unsigned int video_offset = 0;
+    unsigned int video_frames = 0;
+    unsigned int audio_bytes = 0;
+    bool ok = true;
+    std::vector<unsigned int> scratch(INDEX_CHUNK_ENTRIES);
 
     write_chars_bin("idx1", 4);
-    marker = outFile.tellp();
+    marker = tell();
     write_int(0);
 
-    for (t = 0; t < count; t++) {
-    if ((offsets[t] & 0x80000000) == 0)
+    for (size_t chunk = 0; chunk < index_chunks.size(); chunk++) {
+    const unsigned int *entries = load_index_chunk(chunk, &scratch[0]);
+
+    for (size_t i = 0; i < INDEX_CHUNK_ENTRIES && t < offset_count; i++, t++) {
+        unsigned int size = entries[i] & INDEX_SIZE;
+
+        if (entries[i] & INDEX_REPEAT) {
+        /* no chunk of its own, reuse the one of the previous video frame */
+        if (!video_offset)
+            ok = false;
+        write_chars("00dc");
+        write_int(0x10);
+        write_int(video_offset);
+        write_int(size);
+        video_frames++;
+        continue;
+        }
+
+        if ((entries[i] & INDEX_AUDIO) == 0) {
         write_chars("00dc");
-    else {
+        video_offset = offset;
+        video_frames++;
+        } else {
         write_chars("01wb");
-        offsets[t] &= 0x7fffffff;
+        audio_bytes += size;
+        }
+        write_int(0x10);
+        write_int(offset);
+        write_int(size);
+
+        offset = offset + size + 8;
+    }
+    }
+
+    patch_int(marker, (unsigned int) (tell() - marker - 4));
+
+    if (offset != movi_size || video_frames != stream_header_v.data_length
+        || audio_bytes != stream_header_a.data_length)
+    ok = false;
+
+    return ok;
+}
+
+/**
+ * Writes the indx chunk of a stream, or a JUNK chunk of the same size as long
+ * as the file is a plain AVI, so the header never changes its size.
+ */
+void GWAVI::write_super_index(int stream)
+{
+    const std::vector<struct gwavi_super_index_entry_t> &entries = super_index[stream];
+    static const char zeros[16] = { 0 };
+    unsigned char types[2] = { 0, 0 }; /* bIndexSubType, bIndexType AVI_INDEX_OF_INDEXES */
+    size_t i;
+
+    if (!odml) {
+    write_chars_bin("JUNK", 4);
+    write_int(SUPER_INDEX_SIZE);
+    for (i = 0; i < SUPER_INDEX_SIZE / 16; i++)
+        put(zeros, 16);
+    put(zeros, SUPER_INDEX_SIZE % 16);
+    return;
+    }
+
+    write_chars_bin("indx", 4);
+    write_int(SUPER_INDEX_SIZE);
+    write_short(4); /* wLongsPerEntry */
+    put(types, 2);
+    write_int((unsigned int) entries.size());
+    write_chars_bin(stream ? "01wb" : "00dc", 4);
+    put(zeros, 12);
+
+    for (i = 0; i < SUPER_INDEX_ENTRIES; i++) {
+    if (i < entries.size()) {
+        write_int64(entries[i].offset);
+        write_int(entries[i].size);
+        write_int(entries[i].duration);
+    } else {
+        put(zeros, 16);
+    }
+    }
+}
+
+/* the dmlh chunk holds the frame count of the whole file */
+void GWAVI::write_odml_header()
+{
+    static const char zeros[ODML_LIST_SIZE] = { 0 };
+
+    if (!odml) {
+    write_chars_bin("JUNK", 4);
+    write_int(ODML_LIST_SIZE);
+    put(zeros, ODML_LIST_SIZE);
+    return;
+    }
+
+    write_chars_bin("LIST", 4);
+    write_int(ODML_LIST_SIZE);
+    write_chars_bin("odml", 4);
+    write_chars_bin("dmlh", 4);
+    write_int(248);
+    write_int(stream_header_v.data_length);
+    put(zeros, 244);
+}
+
+/**
+ * Writes the ix## chunk of a stream for the entries of the current segment and
+ * adds it to the super index. The base offset reaches back to the previous
+ * video chunk, so repeats at the start of a segment can refer to a chunk that
+ * is in the previous RIFF list.
+ *
+ * @param movi_size Size of the movi list so far, before any ix## chunk.
+ *
+ * @return false if the entries do not add up to movi_size.
+ */
+bool GWAVI::write_field_index(int stream, unsigned int movi_size)
+{
+    struct gwavi_super_index_entry_t super;
+    std::vector<unsigned int> scratch(INDEX_CHUNK_ENTRIES);
+    unsigned char types[2] = { 0, 1 }; /* bIndexSubType, bIndexType AVI_INDEX_OF_CHUNKS */
+    int64_t movi_start = marker + 4;
+    int64_t base = movi_start;
+    int64_t video_pos = last_video_pos;
+    int64_t start = tell();
+    unsigned int offset = 4;
+    unsigned int count = 0;
+    unsigned int duration = 0;
+    bool ok = true;
+    int t = 0;
+
+    if (stream == 0 && video_pos)
+    base = video_pos;
+
+    write_chars_bin(stream ? "ix01" : "ix00", 4);
+    write_int(0);
+    write_short(2); /* wLongsPerEntry */
+    put(types, 2);
+    write_int(0);
+    write_chars_bin(stream ? "01wb" : "00dc", 4);
+    write_int64((uint64_t) base);
+    write_int(0);
+
+    for (size_t chunk = 0; chunk < index_chunks.size(); chunk++) {
+    const unsigned int *entries = load_index_chunk(chunk, &scratch[0]);
+
+    for (size_t i = 0; i < INDEX_CHUNK_ENTRIES && t < offset_count; i++, t++) {
+        unsigned int size = entries[i] & INDEX_SIZE;
+        bool audio = (entries[i] & INDEX_AUDIO) != 0;
+
+        if (entries[i] & INDEX_REPEAT) {
+        if (!video_pos)
+            ok = false;
+        if (stream == 0) {
+            write_int((unsigned int) (video_pos + 8 - base));
+            write_int(size);
+            count++;
+            duration++;
+        }
+        continue;
+        }
+
+        if (!audio)
+        video_pos = movi_start + offset;
+        if (audio == (stream == 1)) {
+        write_int((unsigned int) (movi_start + offset + 8 - base));
+        write_int(size);
+        count++;
+        duration += audio ? size / (stream_format_a.block_align ? stream_format_a.block_align : 1) : 1;
+        if (audio)
+            indexed_audio += size;
+        }
+
+        offset = offset + size + 8;
+    }
+    }
+
+    if (offset != movi_size)
+    ok = false;
+
+    patch_int(start + 4, (unsigned int) (tell() - start - 8));
+    patch_int(start + 12, count);
+
+    super.offset = (uint64_t) start;
+    super.size = (unsigned int) (tell() - start);
+    super.duration = duration;
+    if (super_index[stream].size() < SUPER_INDEX_ENTRIES)
+    super_index[stream].push_back(super);
+    else
+    ok = false;
+
+    if (stream == 0) {
+    indexed_frames += duration;
+    last_video_pos = video_pos;
     }
-    write_int(0x10);
-    write_int(offset);
-    write_int(offsets[t]);
 
-    offset = offset + offsets[t] + 8;
+    return ok;
+}
+
+/**
+ * Closes the movi list of the current segment with its ix## chunks. The first
+ * segment also gets the idx1 chunk for players without OpenDML support.
+ *
+ * @return false if an index is inconsistent.
+ */
+bool GWAVI::end_segment()
+{
+    unsigned int movi_size = (unsigned int) (tell() - marker - 4);
+    bool ok = true;
+
+    if (!write_field_index(0, movi_size))
+    ok = false;
+    if (avi_header.data_streams == 2 && !write_field_index(1, movi_size))
+    ok = false;
+    patch_int(marker, (unsigned int) (tell() - marker - 4));
+
+    if (segment == 0) {
+    if (!write_index(movi_size))
+        ok = false;
+    first_riff_frames = stream_header_v.data_length;
     }
+    patch_int(riff_start + 4, (unsigned int) (tell() - riff_start - 8));
 
-    t = outFile.tellp();
-    outFile.seekp(marker, ios_base::beg);
-    write_int((unsigned int) (t - marker - 4));
-    outFile.seekp(t, ios_base::beg);
+    return ok;
+}
 
+/**
+ * Starts a RIFF AVIX list when a chunk of chunk_len bytes and the index entries
+ * of the current segment would not fit into the current RIFF list any more.
+ */
+void GWAVI::check_segment(size_t chunk_len)
+{
+    int64_t index = 2 * FIELD_INDEX_SIZE + 8 * ((int64_t) offset_count + 1);
+
+    if (segment == 0)
+    index += 8 + 16 * ((int64_t) offset_count + 1);
+    if (offset_count == 0 || tell() - riff_start + (int64_t) chunk_len + index <= AVI_RIFF_LIMIT)
+    return;
+
+    odml = true;
+    if (!end_segment())
+    fputs("the index does not match the movi list\n", stderr);
+    if (sidecar_fd >= 0)
+    log_index();
+    closed_entries += offset_count;
+    clear_index();
+
+    segment++;
+    riff_start = tell();
+    write_chars_bin("RIFF", 4);
+    write_int(0);
+    write_chars_bin("AVIX", 4);
+    write_chars_bin("LIST", 4);
+    marker = tell();
+    write_int(0);
+    write_chars_bin("movi", 4);
 }
 
 /**
@@ -670,6 +1603,121 @@ int GWAVI::check_fourcc(const char *fourcc)
     return ret;
 }
 
+/**
+ * Stages a chunk with its prefix and padding. A chunk that does not fit into
+ * the current buffer continues in the next one.
+ *
+ * @return the chunk size as written in its prefix.
+ */
+unsigned int GWAVI::write_chunk(const char *fourcc, const char *data, size_t len)
+{
+    size_t pad = (4 - len % 4) % 4;
+
+    check_segment(8 + len + pad);
+
+    write_chars_bin(fourcc, 4);
+    write_int((unsigned int) (len + pad));
+    put(data, len);
+    put("\0\0\0", pad);
+
+    return (unsigned int) (len + pad);
+}
+
+/* file offset the next staged byte ends up at */
+int64_t GWAVI::tell() const
+{
+    return out_pos + (int64_t) out_len;
+}
+
+/* hands the staged data to the output and continues in a free buffer */
+void GWAVI::flush()
+{
+    if (!out_len)
+    return;
+
+    output->preallocate(tell());
+    output->submit(out_buf, out_len, out_pos);
+    out_pos += out_len;
+    out_len = 0;
+    out_buf = output->buffer();
+    output->written(out_pos);
+}
+
+/* pwritev until everything is out, iov is consumed on the way */
+void GWAVI::write_iov(int fd, struct iovec *iov, int count, int64_t pos)
+{
+    while (count > 0) {
+    ssize_t n = pwritev(fd, iov, count, pos);
+    if (n < 0) {
+        if (errno == EINTR)
+        continue;
+        throw system_error(errno, generic_category());
+    }
+    pos += n;
+    while (count > 0 && (size_t) n >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        count--;
+    }
+    if (count > 0) {
+        iov->iov_base = (char *) iov->iov_base + n;
+        iov->iov_len -= n;
+    }
+    }
+}
+
+/*
+ * Sets a size field, in the staging buffer while it is still there. Bytes that
+ * were submitted already are written once the queued writes are done, so they
+ * cannot be overwritten by an older write.
+ */
+void GWAVI::patch_int(int64_t pos, unsigned int n)
+{
+    unsigned char buffer[4];
+    size_t submitted = 0;
+
+    buffer[0] = n;
+    buffer[1] = n >> 8;
+    buffer[2] = n >> 16;
+    buffer[3] = n >> 24;
+
+    if (pos < out_pos) {
+    struct iovec iov;
+    submitted = out_pos - pos < 4 ? (size_t) (out_pos - pos) : 4;
+    iov.iov_base = buffer;
+    iov.iov_len = submitted;
+    output->drain();
+    write_iov(fd, &iov, 1, pos);
+    }
+    if (submitted < 4)
+    memcpy(out_buf + (pos + submitted - out_pos), buffer + submitted, 4 - submitted);
+}
+
+void GWAVI::put(const void *data, size_t len)
+{
+    const char *p = (const char *) data;
+
+    while (len > 0) {
+    size_t n = output->bufferSize() - out_len;
+    if (n == 0) {
+        flush();
+        continue;
+    }
+    if (n > len)
+        n = len;
+    memcpy(out_buf + out_len, p, n);
+    out_len += n;
+    p += n;
+    len -= n;
+    }
+}
+
+void GWAVI::write_int64(uint64_t n)
+{
+    write_int((unsigned int) n);
+    write_int((unsigned int) (n >> 32));
+}
+
 void GWAVI::write_int(unsigned int n)
 {
     unsigned char buffer[4];
@@ -679,7 +1727,7 @@ void GWAVI::write_int(unsigned int n)
     buffer[2] = n >> 16;
     buffer[3] = n >> 24;
 
-    outFile.write((char *) buffer, 4);
+    put(buffer, 4);
 }
 
 void GWAVI::write_short(unsigned int n)
@@ -689,7 +1737,7 @@ void GWAVI::write_short(unsigned int n)
     buffer[0] = n;
     buffer[1] = n >> 8;
 
-    outFile.write((char *) buffer, 2);
+    put(buffer, 2);
 }
 
 void GWAVI::write_chars(const char *s)
@@ -697,11 +1745,10 @@ void GWAVI::write_chars(const char *s)
     int count = strlen(s);
     if (count > 255)
     count = 255;
-    outFile.write(s, count);
+    put(s, count);
 }
 
 void GWAVI::write_chars_bin(const char *s, int count)
 {
-    outFile.write(s, count);
+    put(s, count);
 }
-
@@ -8,9 +8,18 @@
 #ifndef GWAVI_H_
 #define GWAVI_H_
 
-#include <fstream>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
 
-class GWAVI {
+#include "avioutput.h"
+#include "muxer.h"
+
+struct iovec;
+struct avi_map_t;
+
+class GWAVI : public Muxer {
     struct gwavi_header_t {
         unsigned int time_delay; /* dwMicroSecPerFrame */
         unsigned int data_rate; /* dwMaxBytesPerSec */
@@ -70,6 +79,11 @@ class GWAVI {
         unsigned int bits_per_sample;
         unsigned short size;
     };
+    struct gwavi_super_index_entry_t {
+        uint64_t offset; /* qwOffset of an ix## chunk */
+        unsigned int size; /* dwSize, including the chunk header */
+        unsigned int duration; /* dwDuration */
+    };
 public:
     typedef struct {
         unsigned int channels;
@@ -78,39 +92,91 @@ public:
     } gwavi_audio_t;
 
     GWAVI(const char *filename, unsigned width, unsigned height, unsigned bpp, const char *fourcc, unsigned fps,
-        gwavi_audio_t *audio);
+        gwavi_audio_t *audio, AviOutput::Kind output_kind = AviOutput::Auto);
     virtual ~GWAVI();
 
-    int AddVideoFrame(const char *buffer, size_t len);
-    int AddAudioFrame(unsigned char *buffer, size_t len);
-    int Finalize();
+    int AddVideoFrame(const char *buffer, size_t len) override;
+    int AddRepeatedVideoFrame() override;
+    int AddAudioFrame(const char *buffer, size_t len) override;
+    int Finalize() override;
+    int Checkpoint() override;
+    static int Recover(const char *filename, AviOutput::Kind output_kind = AviOutput::Auto);
     void SetFramerate(unsigned int fps);
     void SetFourccCodec(const char *fourcc);
     void SetVideoFrameSize(unsigned int width, unsigned int height);
+    void SetIndexSpill(bool enable);
+    const char *OutputName() const override;
 
 private:
-    std::ofstream outFile;
+    GWAVI();
+
+    int fd;
+    AviOutput *output;
+    /* buffer being staged, out_pos is the file offset of its first byte */
+    char *out_buf;
+    size_t out_len;
+    int64_t out_pos;
     struct gwavi_header_t avi_header;
     struct gwavi_stream_header_t stream_header_v;
     struct gwavi_stream_format_v_t stream_format_v;
     struct gwavi_stream_header_t stream_header_a;
     struct gwavi_stream_format_a_t stream_format_a;
-    long marker;
-    int offsets_ptr;
-    int offsets_len;
-    long offsets_start;
-    unsigned int *offsets;
+    int64_t marker;
+    std::string file_name;
+    /* index entries in fixed size chunks, NULL for chunks moved to index_fd */
+    std::vector<unsigned int *> index_chunks;
     int offset_count;
+    bool index_spill;
+    int index_fd;
+    /* entries logged by checkpoints, for Recover() */
+    int sidecar_fd;
+    int64_t sidecar_pos;
+    int logged_count;
+    unsigned int closed_entries; /* entries of the segments before the current one */
+    unsigned int last_video_len;
+    /* OpenDML: segment 0 is the RIFF AVI list, the others are RIFF AVIX */
+    bool odml;
+    int segment;
+    int64_t riff_start;
+    int64_t last_video_pos;
+    unsigned int first_riff_frames;
+    unsigned int indexed_frames;
+    unsigned int indexed_audio;
+    std::vector<struct gwavi_super_index_entry_t> super_index[2];
+
+    void init();
+    void log_index();
+    void remove_sidecar();
+    int recover(const char *filename, AviOutput::Kind output_kind);
+    int64_t read_header(struct avi_map_t *map);
+    void add_recovered_entry(unsigned int entry);
 
     void write_avi_header(struct gwavi_header_t *avi_header);
     void write_stream_header(struct gwavi_stream_header_t *stream_header);
     void write_stream_format_v(struct gwavi_stream_format_v_t *stream_format_v);
     void write_stream_format_a(struct gwavi_stream_format_a_t *stream_format_a);
     void write_avi_header_chunk();
-    void write_index(int count, unsigned int *offsets);
+    void write_super_index(int stream);
+    void write_odml_header();
+    bool write_index(unsigned int movi_size);
+    bool write_field_index(int stream, unsigned int movi_size);
+    void check_segment(size_t chunk_len);
+    bool end_segment();
+    void add_index_entry(unsigned int entry);
+    bool spill_index_chunk(size_t chunk);
+    const unsigned int *load_index_chunk(size_t chunk, unsigned int *scratch);
+    void clear_index();
+    void free_index();
     int check_fourcc(const char *fourcc);
+    unsigned int write_chunk(const char *fourcc, const char *data, size_t len);
 
+    int64_t tell() const;
+    void flush();
+    void write_iov(int fd, struct iovec *iov, int count, int64_t pos);
+    void patch_int(int64_t pos, unsigned int n);
+    void put(const void *data, size_t len);
     void write_int(unsigned int n);
+    void write_int64(uint64_t n);
     void write_short(unsigned int n);
     void write_chars(const char *s);
     void write_chars_bin(const char *s, int count);
@@ -0,0 +1,473 @@
+#include "jpegencoder.h"
+#include "pixelconvert.h"
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <jpeglib.h>
+
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(logjpeg, "screenrecorder.jpeg", QtDebugMsg)
+
+static const uchar s_lumaQuant[64] = {
+    16, 11, 10, 16, 24, 40, 51, 61,
+    12, 12, 14, 19, 26, 58, 60, 55,
+    14, 13, 16, 24, 40, 57, 69, 56,
+    14, 17, 22, 29, 51, 87, 80, 62,
+    18, 22, 37, 56, 68, 109, 103, 77,
+    24, 35, 55, 64, 81, 104, 113, 92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103, 99,
+};
+
+static const uchar s_chromaQuant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+// Natural index of the k-th coefficient in zigzag order.
+static const uchar s_zigzag[64] = {
+    0, 1, 8, 16, 9, 2, 3, 10,
+    17, 24, 32, 25, 18, 11, 4, 5,
+    12, 19, 26, 33, 40, 48, 41, 34,
+    27, 20, 13, 6, 7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36,
+    29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46,
+    53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+// Code counts per code length 1..16 and symbols of the Annex K tables.
+static const uchar s_lumaDcBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uchar s_lumaDcValues[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const uchar s_chromaDcBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uchar s_chromaDcValues[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uchar s_lumaAcBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uchar s_lumaAcValues[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+static const uchar s_chromaAcBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uchar s_chromaAcValues[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa,
+};
+
+/**
+ * libjpeg state of one encoder. Every stripe is compressed as an image of its
+ * own, with the tables suppressed and the output going straight into the
+ * QByteArray of the stripe; only the entropy-coded data is kept of it.
+ */
+struct JpegEncoder::Backend
+{
+    Backend();
+    ~Backend();
+
+    static void fail(j_common_ptr cinfo);
+    static void initDestination(j_compress_ptr cinfo);
+    static boolean emptyDestination(j_compress_ptr cinfo);
+    static void termDestination(j_compress_ptr cinfo);
+
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr error;
+    jpeg_destination_mgr destination;
+    jmp_buf failure;
+    bool created = false;
+
+    QByteArray *out = nullptr;
+    int start = 0; // where the output starts in out
+    int end = 0;   // and where it ended
+    JSAMPROW rows[16 + 8 + 8];
+};
+
+JpegEncoder::Backend::Backend()
+{
+    cinfo.err = jpeg_std_error(&error);
+    error.error_exit = fail;
+    cinfo.client_data = this;
+    if (setjmp(failure))
+        return;
+    jpeg_create_compress(&cinfo);
+
+    destination.init_destination = initDestination;
+    destination.empty_output_buffer = emptyDestination;
+    destination.term_destination = termDestination;
+    cinfo.dest = &destination;
+    created = true;
+}
+
+JpegEncoder::Backend::~Backend()
+{
+    if (created)
+        jpeg_destroy_compress(&cinfo);
+}
+
+void JpegEncoder::Backend::fail(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, message);
+    qCWarning(logjpeg) << "libjpeg:" << message;
+    longjmp(static_cast<Backend *>(cinfo->client_data)->failure, 1);
+}
+
+void JpegEncoder::Backend::initDestination(j_compress_ptr cinfo)
+{
+    Backend *backend = static_cast<Backend *>(cinfo->client_data);
+    backend->destination.next_output_byte = reinterpret_cast<JOCTET *>(backend->out->data()) + backend->start;
+    backend->destination.free_in_buffer = size_t(backend->out->size() - backend->start);
+}
+
+// Called with the array full, the output continues in the grown part.
+boolean JpegEncoder::Backend::emptyDestination(j_compress_ptr cinfo)
+{
+    Backend *backend = static_cast<Backend *>(cinfo->client_data);
+    const int used = backend->out->size();
+    backend->out->resize(used + qMax(used / 2, 4096));
+    backend->destination.next_output_byte = reinterpret_cast<JOCTET *>(backend->out->data()) + used;
+    backend->destination.free_in_buffer = size_t(backend->out->size() - used);
+    return TRUE;
+}
+
+void JpegEncoder::Backend::termDestination(j_compress_ptr cinfo)
+{
+    Backend *backend = static_cast<Backend *>(cinfo->client_data);
+    backend->end = int(backend->destination.next_output_byte - reinterpret_cast<JOCTET *>(backend->out->data()));
+}
+
+JpegEncoder::JpegEncoder()
+    : m_backend(new Backend)
+{
+}
+
+JpegEncoder::~JpegEncoder()
+{
+}
+
+/**
+ * Builds the tables and the stream header for @p size and @p quality (1..100,
+ * scaled like the libjpeg quality setting). Must be called again when the size changes.
+ */
+bool JpegEncoder::open(const QSize &size, int quality, int stripes)
+{
+    m_header.clear();
+    if (size.isEmpty() || size.width() > 65535 || size.height() > 65535)
+        return false;
+
+    m_size = size;
+    m_quality = qBound(1, quality, 100);
+    buildQuantTables();
+
+    m_mcuColumns = (size.width() + 15) / 16;
+    m_mcuRows = (size.height() + 15) / 16;
+
+    // The restart interval is a 16 bit count of MCUs.
+    m_stripeMcuRows = (m_mcuRows + qMax(1, stripes) - 1) / qMax(1, stripes);
+    if (m_stripeMcuRows < m_mcuRows)
+        m_stripeMcuRows = qMin(m_stripeMcuRows, 65535 / m_mcuColumns);
+    m_stripeCount = (m_mcuRows + m_stripeMcuRows - 1) / m_stripeMcuRows;
+
+    m_lumaStride = m_mcuColumns * 16;
+    m_chromaStride = m_mcuColumns * 8;
+    m_y.resize(m_lumaStride * m_stripeMcuRows * 16);
+    m_cb.resize(m_chromaStride * m_stripeMcuRows * 8);
+    m_cr.resize(m_chromaStride * m_stripeMcuRows * 8);
+    m_halved.resize(size.width() * 4 * 2);
+
+    if (!configureBackend())
+        return false;
+    buildHeader();
+    return true;
+}
+
+/**
+ * Switches an open encoder to another @p quality. Only the quantization tables and
+ * the header are rebuilt, the buffers of open() are kept.
+ */
+void JpegEncoder::setQuality(int quality)
+{
+    quality = qBound(1, quality, 100);
+    if (!isOpen() || quality == m_quality)
+        return;
+
+    m_quality = quality;
+    buildQuantTables();
+    if (configureBackend())
+        buildHeader();
+    else
+        m_header.clear();
+}
+
+void JpegEncoder::buildQuantTables()
+{
+    uchar natural[2][64];
+    buildQuantTable(s_lumaQuant, m_quality, natural[0]);
+    buildQuantTable(s_chromaQuant, m_quality, natural[1]);
+    for (int table = 0; table < 2; ++table) {
+        for (int k = 0; k < 64; ++k)
+            m_quant[table][k] = natural[table][s_zigzag[k]];
+    }
+}
+
+void JpegEncoder::buildQuantTable(const uchar *base, int quality, uchar *table)
+{
+    const int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (int i = 0; i < 64; ++i)
+        table[i] = uchar(qBound(1, (base[i] * scale + 50) / 100, 255));
+}
+
+/**
+ * Sets libjpeg up for raw 4:2:0 planes of the frame width with the tables of
+ * our header. The default Huffman tables of libjpeg are the Annex K ones the
+ * header carries. No table is written by libjpeg itself.
+ */
+bool JpegEncoder::configureBackend()
+{
+    Backend *backend = m_backend.get();
+    jpeg_compress_struct *cinfo = &backend->cinfo;
+    if (!backend->created || setjmp(backend->failure))
+        return false;
+
+    cinfo->image_width = JDIMENSION(m_size.width());
+    cinfo->image_height = JDIMENSION(stripeHeight(0));
+    cinfo->input_components = 3;
+    cinfo->in_color_space = JCS_YCbCr;
+    jpeg_set_defaults(cinfo);
+    cinfo->raw_data_in = TRUE;
+    cinfo->write_JFIF_header = FALSE;
+    cinfo->comp_info[0].h_samp_factor = 2;
+    cinfo->comp_info[0].v_samp_factor = 2;
+    for (int component = 1; component < 3; ++component) {
+        cinfo->comp_info[component].h_samp_factor = 1;
+        cinfo->comp_info[component].v_samp_factor = 1;
+    }
+
+    for (int table = 0; table < 2; ++table) {
+        unsigned int natural[64];
+        for (int k = 0; k < 64; ++k)
+            natural[s_zigzag[k]] = m_quant[table][k];
+        jpeg_add_quant_table(cinfo, table, natural, 100, TRUE);
+    }
+    jpeg_suppress_tables(cinfo, TRUE);
+    return true;
+}
+
+static void appendMarker(QByteArray &out, uchar marker, int length)
+{
+    out.append(char(0xff));
+    out.append(char(marker));
+    out.append(char(length >> 8));
+    out.append(char(length & 0xff));
+}
+
+static void appendHuffmanTable(QByteArray &out, int tableClass, int id, const uchar *bits, const uchar *values)
+{
+    int count = 0;
+    for (int i = 0; i < 16; ++i)
+        count += bits[i];
+    out.append(char((tableClass << 4) | id));
+    out.append(reinterpret_cast<const char *>(bits), 16);
+    out.append(reinterpret_cast<const char *>(values), count);
+}
+
+void JpegEncoder::buildHeader()
+{
+    m_header.clear();
+
+    // SOI and a JFIF APP0 segment.
+    m_header.append(char(0xff));
+    m_header.append(char(0xd8));
+    appendMarker(m_header, 0xe0, 16);
+    m_header.append("JFIF", 5);
+    const char jfif[] = { 1, 1, 0, 0, 1, 0, 1, 0, 0 };
+    m_header.append(jfif, sizeof(jfif));
+
+    appendMarker(m_header, 0xdb, 2 + 2 * 65);
+    for (int table = 0; table < 2; ++table) {
+        m_header.append(char(table));
+        m_header.append(reinterpret_cast<const char *>(m_quant[table]), 64);
+    }
+
+    appendMarker(m_header, 0xc0, 8 + 3 * 3);
+    m_header.append(char(8));
+    m_header.append(char(m_size.height() >> 8));
+    m_header.append(char(m_size.height() & 0xff));
+    m_header.append(char(m_size.width() >> 8));
+    m_header.append(char(m_size.width() & 0xff));
+    const char components[] = { 3, 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1 };
+    m_header.append(components, sizeof(components));
+
+    appendMarker(m_header, 0xc4, 2 + 4 * 17 + 2 * 12 + 2 * 162);
+    appendHuffmanTable(m_header, 0, 0, s_lumaDcBits, s_lumaDcValues);
+    appendHuffmanTable(m_header, 1, 0, s_lumaAcBits, s_lumaAcValues);
+    appendHuffmanTable(m_header, 0, 1, s_chromaDcBits, s_chromaDcValues);
+    appendHuffmanTable(m_header, 1, 1, s_chromaAcBits, s_chromaAcValues);
+
+    if (m_stripeCount > 1) {
+        const int interval = m_stripeMcuRows * m_mcuColumns;
+        appendMarker(m_header, 0xdd, 4);
+        m_header.append(char(interval >> 8));
+        m_header.append(char(interval & 0xff));
+    }
+
+    appendMarker(m_header, 0xda, 6 + 2 * 3);
+    const char scan[] = { 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+    m_header.append(scan, sizeof(scan));
+}
+
+/**
+ * Converts two rows at a time into the planes, edges are replicated into the
+ * MCU padding.
+ */
+void JpegEncoder::loadStripe(const uchar *bits, qptrdiff bytesPerLine, int stripe, Input input)
+{
+    const int width = m_size.width();
+    const int height = stripeHeight(stripe);
+    const int chromaWidth = (width + 1) / 2;
+    const int chromaRows = (height + 15) / 16 * 8;
+    uchar *halved0 = m_halved.data();
+    uchar *halved1 = halved0 + width * 4;
+
+    for (int y = 0; y < chromaRows; ++y) {
+        const int row0 = qMin(y * 2, height - 1);
+        const int row1 = qMin(y * 2 + 1, height - 1);
+        uchar *y0 = m_y.data() + y * 2 * m_lumaStride;
+        uchar *y1 = y0 + m_lumaStride;
+        uchar *cb = m_cb.data() + y * m_chromaStride;
+        uchar *cr = m_cr.data() + y * m_chromaStride;
+
+        if (input == Rgba8888Half) {
+            PixelConvert::halveRgbaRows(bits + qptrdiff(row0 * 2) * bytesPerLine, bits + qptrdiff(row0 * 2 + 1) * bytesPerLine, halved0, width);
+            PixelConvert::halveRgbaRows(bits + qptrdiff(row1 * 2) * bytesPerLine, bits + qptrdiff(row1 * 2 + 1) * bytesPerLine, halved1, width);
+            PixelConvert::rgbaToYuv420(halved0, halved1, y0, y1, cb, cr, width, false);
+        } else {
+            PixelConvert::rgbaToYuv420(bits + qptrdiff(row0) * bytesPerLine, bits + qptrdiff(row1) * bytesPerLine,
+                                       y0, y1, cb, cr, width, input == Rgb32);
+        }
+
+        memset(y0 + width, y0[width - 1], size_t(m_lumaStride - width));
+        memset(y1 + width, y1[width - 1], size_t(m_lumaStride - width));
+        memset(cb + chromaWidth, cb[chromaWidth - 1], size_t(m_chromaStride - chromaWidth));
+        memset(cr + chromaWidth, cr[chromaWidth - 1], size_t(m_chromaStride - chromaWidth));
+    }
+}
+
+/**
+ * Offset of the entropy-coded data in the JPEG stream at @p data, right behind
+ * its SOS segment, or -1 if there is none within @p size bytes.
+ */
+static int scanDataOffset(const uchar *data, int size)
+{
+    int offset = 2;
+    while (offset + 4 <= size && data[offset] == 0xff) {
+        const uchar marker = data[offset + 1];
+        offset += 2 + ((data[offset + 2] << 8) | data[offset + 3]);
+        if (marker == 0xda)
+            return offset <= size ? offset : -1;
+    }
+    return -1;
+}
+
+int JpegEncoder::encodeStripe(int stripe, QByteArray *out)
+{
+    if (!isOpen() || stripe < 0 || stripe >= m_stripeCount)
+        return 0;
+
+    // The whole capacity is handed to libjpeg, so steady state encoding does not
+    // reallocate. A first guess leaves room for about two bits per pixel.
+    const int header = stripe == 0 ? m_header.size() : 0;
+    out->resize(qMax(out->capacity(), header + m_lumaStride * stripeHeight(stripe) / 4 + 4096));
+    const int end = compressStripe(stripe, out, header);
+
+    // libjpeg framed the data with markers of its own: SOI, SOF and SOS ahead of
+    // it and EOI behind it. Only the data is kept, behind our header.
+    uchar *base = reinterpret_cast<uchar *>(out->data());
+    const int data = end > header ? scanDataOffset(base + header, end - header) : -1;
+    if (data < 0 || end - header - data < 2) {
+        out->clear();
+        return 0;
+    }
+    const int length = end - header - data - 2;
+    memmove(base + header, base + header + data, size_t(length));
+    memcpy(base, m_header.constData(), size_t(header));
+
+    // RSTn cycles through n = 0..7, the last stripe ends the image instead.
+    uchar *marker = base + header + length;
+    marker[0] = 0xff;
+    marker[1] = stripe + 1 < m_stripeCount ? uchar(0xd0 + (stripe & 7)) : 0xd9;
+    out->resize(header + length + 2);
+    return out->size();
+}
+
+/**
+ * Has libjpeg compress the loaded stripe as an image of its own, writing it to
+ * @p out from @p offset on. Every image starts with zeroed DC predictors, as a
+ * restart interval does. Returns the offset behind the written data, 0 if
+ * libjpeg failed.
+ */
+int JpegEncoder::compressStripe(int stripe, QByteArray *out, int offset)
+{
+    Backend *backend = m_backend.get();
+    jpeg_compress_struct *cinfo = &backend->cinfo;
+    backend->out = out;
+    backend->start = offset;
+    backend->end = 0;
+    if (setjmp(backend->failure)) {
+        jpeg_abort_compress(cinfo);
+        return 0;
+    }
+
+    cinfo->image_height = JDIMENSION(stripeHeight(stripe));
+    jpeg_start_compress(cinfo, FALSE);
+
+    // One call per MCU row: 16 luma and 8 rows of each chroma plane.
+    JSAMPARRAY planes[3] = { backend->rows, backend->rows + 16, backend->rows + 24 };
+    const int mcuRows = (stripeHeight(stripe) + 15) / 16;
+    for (int row = 0; row < mcuRows; ++row) {
+        for (int i = 0; i < 16; ++i)
+            planes[0][i] = m_y.data() + (row * 16 + i) * m_lumaStride;
+        for (int i = 0; i < 8; ++i) {
+            planes[1][i] = m_cb.data() + (row * 8 + i) * m_chromaStride;
+            planes[2][i] = m_cr.data() + (row * 8 + i) * m_chromaStride;
+        }
+        jpeg_write_raw_data(cinfo, planes, 16);
+    }
+    jpeg_finish_compress(cinfo);
+    return backend->end;
+}
+
+const char *JpegEncoder::implementation()
+{
+#ifdef LIBJPEG_TURBO_VERSION
+    return "libjpeg-turbo " QT_STRINGIFY(LIBJPEG_TURBO_VERSION);
+#else
+    return "libjpeg";
+#endif
+}
@@ -0,0 +1,97 @@
+#ifndef JPEGENCODER_H
+#define JPEGENCODER_H
+
+#include <QByteArray>
+#include <QSize>
+#include <QVector>
+
+#include <memory>
+
+/**
+ * Baseline JPEG encoder for the MJPEG stream. Quantization tables and the
+ * complete stream header are built once in open(). Per frame, loadStripe()
+ * converts the pixels of a stripe into YCbCr planes and encodeStripe() has
+ * libjpeg compress those planes as raw data, so the SIMD DCT and entropy coder
+ * of libjpeg-turbo do the work without a colour conversion pass of their own.
+ *
+ * Output is YCbCr 4:2:0 with the standard Annex K Huffman tables, the same
+ * layout the Qt image plugin produced. One instance must not be used from
+ * several threads at once, every encoder thread owns its own.
+ *
+ * A frame may be split into horizontal stripes of whole MCU rows, separated by
+ * restart markers. Stripes do not depend on each other, so encoders opened with
+ * the same parameters can compress the stripes of one frame in parallel and
+ * the concatenated outputs form a single valid JPEG.
+ */
+class JpegEncoder
+{
+public:
+    JpegEncoder();
+    ~JpegEncoder();
+
+    // @p stripes is a hint, the count is adjusted to whole MCU rows per stripe.
+    bool open(const QSize &size, int quality, int stripes = 1);
+    bool isOpen() const { return !m_header.isEmpty(); }
+    QSize size() const { return m_size; }
+    int quality() const { return m_quality; }
+    void setQuality(int quality);
+
+    int stripeCount() const { return m_stripeCount; }
+    // First pixel row and row count of @p stripe.
+    int stripeTop(int stripe) const { return stripe * m_stripeMcuRows * 16; }
+    int stripeHeight(int stripe) const { return qMin(m_stripeMcuRows * 16, m_size.height() - stripeTop(stripe)); }
+
+    enum Input {
+        Rgb32,        // QImage::Format_RGB32
+        Rgba8888,     // capture buffer byte order
+        Rgba8888Half, // capture buffer at twice the size, box filtered while converting
+    };
+
+    // Converts the rows of @p stripe straight into the YCbCr planes. @p bits points
+    // at the first row of the stripe in output orientation, @p bytesPerLine may be
+    // negative to walk a Y-inverted buffer bottom-up. Rgba8888Half reads twice as
+    // many rows of twice the width.
+    void loadStripe(const uchar *bits, qptrdiff bytesPerLine, int stripe, Input input);
+
+    // Encodes the stripe loaded last into @p out. The first stripe starts with the
+    // stream header, every other stripe is followed by its restart marker and the
+    // last one by the end of image marker, so the outputs of all stripes only
+    // need to be concatenated in order. The capacity of @p out is kept, so passing
+    // the same array again does not allocate. Returns the number of bytes written,
+    // 0 on failure.
+    int encodeStripe(int stripe, QByteArray *out);
+
+    static const char *implementation();
+
+private:
+    struct Backend;
+
+    static void buildQuantTable(const uchar *base, int quality, uchar *table);
+    void buildQuantTables();
+    void buildHeader();
+    bool configureBackend();
+
+    int compressStripe(int stripe, QByteArray *out, int offset);
+
+    QSize m_size;
+    int m_quality = 0;
+
+    // Quantization tables in zigzag order as written to the stream.
+    uchar m_quant[2][64];
+    QByteArray m_header;
+    std::unique_ptr<Backend> m_backend;
+
+    // YCbCr planes of one stripe, padded to whole MCUs by repeating the last column and row.
+    QVector<uchar> m_y;
+    QVector<uchar> m_cb;
+    QVector<uchar> m_cr;
+    QVector<uchar> m_halved; // two box filtered rows for Rgba8888Half
+    int m_lumaStride = 0;
+    int m_chromaStride = 0;
+    int m_mcuColumns = 0;
+    int m_mcuRows = 0;
+    int m_stripeMcuRows = 0;
+    int m_stripeCount = 0;
+};
+
+#endif // JPEGENCODER_H
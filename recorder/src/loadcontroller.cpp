@@ -0,0 +1,149 @@
+#include "loadcontroller.h"
+
+#include <QLoggingCategory>
+#include <QTimer>
+
+#include "framescheduler.h"
+
+Q_LOGGING_CATEGORY(logcontroller, "screenrecorder.controller", QtDebugMsg)
+
+static const int SampleInterval = 100;   // ms
+static const int SamplesPerAdjustment = 10;
+static const int QualityStep = 10;
+static const int IdleAdjustments = 3;    // headroom needed this long before stepping up
+
+LoadController::LoadController(EncoderThread *encoder, FrameScheduler *scheduler, QObject *parent)
+    : QObject(parent)
+    , m_encoder(encoder)
+    , m_scheduler(scheduler)
+    , m_timer(new QTimer(this))
+{
+    m_timer->setInterval(SampleInterval);
+    connect(m_timer, &QTimer::timeout, this, &LoadController::sample);
+}
+
+void LoadController::start(int quality, int minQuality, int fps, int minFps, int buffers)
+{
+    m_maxQuality = quality;
+    m_minQuality = qBound(1, minQuality, quality);
+    m_quality = quality;
+    m_fps = fps;
+    m_minFps = qBound(1, minFps, fps);
+    m_divider = 1;
+    m_buffers = buffers;
+
+    m_encoder->setQuality(m_quality);
+    m_scheduler->setDivider(m_divider);
+
+    if (m_minQuality == m_maxQuality && m_minFps == m_fps) {
+        qCDebug(logcontroller) << "Load control disabled.";
+        m_timer->stop();
+        return;
+    }
+    qCDebug(logcontroller) << "Load control: quality" << m_minQuality << "to" << m_maxQuality
+                           << "fps" << m_minFps << "to" << m_fps;
+
+    m_samples = 0;
+    m_minFree = m_buffers;
+    m_maxQueued = 0;
+    m_idle = 0;
+    m_last = m_encoder->load();
+    m_clock.start();
+    m_timer->start();
+}
+
+void LoadController::stop()
+{
+    m_timer->stop();
+}
+
+void LoadController::degrade()
+{
+    if (!m_timer->isActive())
+        return;
+
+    m_idle = 0;
+    if (stepDown())
+        qCDebug(logcontroller) << "Capture out of buffers, quality" << m_quality << "fps" << double(m_fps) / m_divider;
+}
+
+void LoadController::sample()
+{
+    const EncoderThread::Load load = m_encoder->load();
+    m_minFree = qMin(m_minFree, load.freeBuffers);
+    m_maxQueued = qMax(m_maxQueued, load.queued);
+
+    if (++m_samples >= SamplesPerAdjustment)
+        adjust();
+}
+
+void LoadController::adjust()
+{
+    const EncoderThread::Load load = m_encoder->load();
+    const quint64 frames = load.frames - m_last.frames;
+    const quint64 nanos = load.encodeNanos - m_last.encodeNanos;
+    const qint64 elapsed = qMax<qint64>(m_clock.restart(), 1) * 1000000;
+    m_last = load;
+
+    // Share of the workers' time spent encoding, and what one frame costs.
+    const double busy = double(nanos) / double(elapsed * qMax(m_encoder->workerCount(), 1));
+    const double frameMs = frames ? double(nanos) / double(frames) / 1e6 : 0.0;
+
+    const bool overloaded = m_minFree < m_buffers / 4 || m_maxQueued > m_buffers / 2 || busy > 0.9;
+    const bool relaxed = m_minFree > m_buffers / 2 && m_maxQueued <= 1 && busy < 0.5;
+
+    bool changed = false;
+    if (overloaded) {
+        m_idle = 0;
+        changed = stepDown();
+    } else if (relaxed) {
+        if (++m_idle >= IdleAdjustments) {
+            m_idle = 0;
+            changed = stepUp();
+        }
+    } else {
+        m_idle = 0;
+    }
+
+    if (changed) {
+        qCDebug(logcontroller) << (overloaded ? "Encoder overloaded," : "Encoder has headroom,")
+                               << "quality" << m_quality << "fps" << double(m_fps) / m_divider
+                               << "- busy" << busy << "ms per frame" << frameMs
+                               << "free buffers" << m_minFree << "queued" << m_maxQueued;
+    }
+
+    m_samples = 0;
+    m_minFree = m_buffers;
+    m_maxQueued = 0;
+}
+
+/**
+ * A softer picture is preferred over a stuttering one, so quality goes first.
+ */
+bool LoadController::stepDown()
+{
+    if (m_quality > m_minQuality) {
+        m_quality = qMax(m_quality - QualityStep, m_minQuality);
+        m_encoder->setQuality(m_quality);
+        return true;
+    }
+    if (m_fps >= m_minFps * (m_divider + 1)) {
+        m_scheduler->setDivider(++m_divider);
+        return true;
+    }
+    return false;
+}
+
+bool LoadController::stepUp()
+{
+    if (m_divider > 1) {
+        m_scheduler->setDivider(--m_divider);
+        return true;
+    }
+    if (m_quality < m_maxQuality) {
+        m_quality = qMin(m_quality + QualityStep, m_maxQuality);
+        m_encoder->setQuality(m_quality);
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,58 @@
+#ifndef LOADCONTROLLER_H
+#define LOADCONTROLLER_H
+
+#include <QElapsedTimer>
+#include <QObject>
+
+#include "encoderthread.h"
+
+class FrameScheduler;
+class QTimer;
+
+/**
+ * Closed loop keeping the encoder ahead of the capture. Every second it looks at
+ * the free capture buffers, the descriptors queued for the encoder and the worker
+ * time spent per frame. An overloaded encoder first gets a lower JPEG quality,
+ * then a lower encoded frame rate; once there is headroom again both go back up
+ * in reverse order. Every change is logged.
+ */
+class LoadController : public QObject
+{
+public:
+    LoadController(EncoderThread *encoder, FrameScheduler *scheduler, QObject *parent = nullptr);
+
+    // Quality and frame rate move between the minimum and the configured value.
+    void start(int quality, int minQuality, int fps, int minFps, int buffers);
+    void stop();
+    // Steps down right away, for when the capture already ran out of buffers.
+    void degrade();
+
+private:
+    void sample();
+    void adjust();
+    bool stepDown();
+    bool stepUp();
+
+    EncoderThread *m_encoder;
+    FrameScheduler *m_scheduler;
+    QTimer *m_timer;
+
+    int m_maxQuality = 0;
+    int m_minQuality = 0;
+    int m_quality = 0;
+    int m_fps = 0;
+    int m_minFps = 0;
+    int m_divider = 1;
+    int m_buffers = 0;
+
+    // Worst values seen since the last adjustment.
+    int m_samples = 0;
+    int m_minFree = 0;
+    int m_maxQueued = 0;
+
+    EncoderThread::Load m_last = {};
+    QElapsedTimer m_clock;
+    int m_idle = 0; // adjustments in a row with headroom
+};
+
+#endif // LOADCONTROLLER_H
@@ -82,6 +82,88 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
             app.translate("main", "quality"));
     parser.addOption(qualityOption);
 
+    QCommandLineOption encodersOption(
+            QStringLiteral("encoders"),
+            app.translate("main", "Amount of threads compressing frames. Default is one per CPU core."),
+            app.translate("main", "encoders"));
+    parser.addOption(encodersOption);
+
+    QCommandLineOption stripesOption(
+            QStringLiteral("stripes"),
+            app.translate("main", "Amount of stripes each frame is split into, so several encoders work on one frame. Default depends on the frame size."),
+            app.translate("main", "stripes"));
+    parser.addOption(stripesOption);
+
+    QCommandLineOption minQualityOption(
+            QStringLiteral("min-quality"),
+            app.translate("main", "Lowest JPEG quality used when the encoder cannot keep up. Default is 60."),
+            app.translate("main", "quality"));
+    parser.addOption(minQualityOption);
+
+    QCommandLineOption minFpsOption(
+            QStringLiteral("min-fps"),
+            app.translate("main", "Lowest framerate encoded when the encoder cannot keep up. Default is 12."),
+            app.translate("main", "framerate"));
+    parser.addOption(minFpsOption);
+
+    QCommandLineOption maxQueueOption(
+            QStringLiteral("max-queue-mb"),
+            app.translate("main", "Memory budget for captured frames waiting to be encoded, limits the amount of buffers. Default is 256, 0 for no limit."),
+            app.translate("main", "megabytes"));
+    parser.addOption(maxQueueOption);
+
+    QCommandLineOption prefaultOption(
+            QStringLiteral("prefault"),
+            app.translate("main", "Fault the capture buffers in on a background thread when recording starts, on huge pages where the kernel allows. Saves page faults during the first frames."));
+    parser.addOption(prefaultOption);
+
+    QCommandLineOption overflowOption(
+            QStringLiteral("overflow"),
+            app.translate("main", "What to do when all buffers are in use: block, drop-oldest, drop-newest or degrade. Default is block."),
+            app.translate("main", "policy"));
+    parser.addOption(overflowOption);
+
+    QCommandLineOption checkpointOption(
+            QStringLiteral("checkpoint"),
+            app.translate("main", "Seconds between checkpoints that keep the file playable if the recorder dies. Default is 10, 0 to disable."),
+            app.translate("main", "seconds"));
+    parser.addOption(checkpointOption);
+
+    QCommandLineOption segmentSecondsOption(
+            QStringLiteral("segment-seconds"),
+            app.translate("main", "Start a new file after this many seconds of video. Default is 0, a single file."),
+            app.translate("main", "seconds"));
+    parser.addOption(segmentSecondsOption);
+
+    QCommandLineOption segmentMbOption(
+            QStringLiteral("segment-mb"),
+            app.translate("main", "Start a new file before one grows past this size. Default is 0, a single file."),
+            app.translate("main", "megabytes"));
+    parser.addOption(segmentMbOption);
+
+    QCommandLineOption containerOption(
+            QStringLiteral("container"),
+            app.translate("main", "File format: avi or mkv. Default is avi."),
+            app.translate("main", "format"));
+    parser.addOption(containerOption);
+
+    QCommandLineOption audioOption(
+            QStringLiteral("audio"),
+            app.translate("main", "Record audio from a source: pulse for the sound the device plays, pulse:<name> for a PulseAudio source, or a WAV file or FIFO. Default is no audio."),
+            app.translate("main", "source"));
+    parser.addOption(audioOption);
+
+    QCommandLineOption spoolOption(
+            QStringLiteral("spool"),
+            app.translate("main", "Store raw compressed frames while recording and encode them after stopping. For devices that cannot encode in real time."));
+    parser.addOption(spoolOption);
+
+    QCommandLineOption recoverOption(
+            QStringLiteral("recover"),
+            app.translate("main", "Repair a recording that was interrupted and exit."),
+            app.translate("main", "file"));
+    parser.addOption(recoverOption);
+
     QCommandLineOption daemonOption(
             {QStringLiteral("d"), QStringLiteral("daemon")},
             app.translate("main", "Daemonize recorder. Will create D-Bus service org.coderus.screenrecorder on system bus."));
@@ -94,6 +176,10 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
 
     parser.process(app);
 
+    if (parser.isSet(recoverOption)) {
+        return Recorder::recover(parser.value(recoverOption)) ? 0 : 1;
+    }
+
     Recorder::Options options = Recorder::readOptions();
     if (parser.isSet(framerateOption)) {
         options.fps = parser.value(framerateOption).toInt();
@@ -108,6 +194,55 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
     if (parser.isSet(qualityOption)) {
         options.quality = parser.value(qualityOption).toInt();
     }
+    if (parser.isSet(encodersOption)) {
+        options.encoders = parser.value(encodersOption).toInt();
+    }
+    if (parser.isSet(stripesOption)) {
+        options.stripes = parser.value(stripesOption).toInt();
+    }
+    if (parser.isSet(minQualityOption)) {
+        options.minQuality = parser.value(minQualityOption).toInt();
+    }
+    if (parser.isSet(minFpsOption)) {
+        options.minFps = parser.value(minFpsOption).toInt();
+    }
+    if (parser.isSet(maxQueueOption)) {
+        options.maxQueueMb = parser.value(maxQueueOption).toInt();
+    }
+    if (parser.isSet(prefaultOption)) {
+        options.prefault = true;
+    }
+    if (parser.isSet(overflowOption)) {
+        bool ok = false;
+        options.overflow = Recorder::overflowFromName(parser.value(overflowOption), &ok);
+        if (!ok) {
+            qCWarning(logmain) << "Unknown overflow policy" << parser.value(overflowOption);
+            parser.showHelp(1);
+        }
+    }
+    if (parser.isSet(checkpointOption)) {
+        options.checkpoint = parser.value(checkpointOption).toInt();
+    }
+    if (parser.isSet(segmentSecondsOption)) {
+        options.segmentSeconds = parser.value(segmentSecondsOption).toInt();
+    }
+    if (parser.isSet(segmentMbOption)) {
+        options.segmentMb = parser.value(segmentMbOption).toInt();
+    }
+    if (parser.isSet(containerOption)) {
+        bool ok = false;
+        options.container = Recorder::containerFromName(parser.value(containerOption), &ok);
+        if (!ok) {
+            qCWarning(logmain) << "Unknown container" << parser.value(containerOption);
+            parser.showHelp(1);
+        }
+    }
+    if (parser.isSet(audioOption)) {
+        options.audio = parser.value(audioOption);
+    }
+    if (parser.isSet(spoolOption)) {
+        options.spool = true;
+    }
     options.smooth = parser.isSet(fullOption);
     options.fullMode = parser.isSet(fullOption);
     options.daemonize = parser.isSet(daemonOption);
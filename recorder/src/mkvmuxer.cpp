@@ -0,0 +1,494 @@
+// Offsets go past 2 GB in long recordings, also on 32-bit targets.
+#define _FILE_OFFSET_BITS 64
+
+#include "mkvmuxer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include <system_error>
+
+// Same staging as GWAVI.
+static const size_t BufferSize = 1024 * 1024;
+static const int Buffers = 4;
+
+// A cluster is written once it covers this much time or data.
+static const uint64_t ClusterMillis = 1000;
+static const size_t ClusterBytes = 8 * 1024 * 1024;
+
+// Element IDs, with their length marker bits as they appear in the file.
+enum : uint32_t {
+    IdEbml = 0x1A45DFA3,
+    IdEbmlVersion = 0x4286,
+    IdEbmlReadVersion = 0x42F7,
+    IdEbmlMaxIdLength = 0x42F2,
+    IdEbmlMaxSizeLength = 0x42F3,
+    IdDocType = 0x4282,
+    IdDocTypeVersion = 0x4287,
+    IdDocTypeReadVersion = 0x4285,
+    IdSegment = 0x18538067,
+    IdSeekHead = 0x114D9B74,
+    IdSeek = 0x4DBB,
+    IdSeekId = 0x53AB,
+    IdSeekPosition = 0x53AC,
+    IdInfo = 0x1549A966,
+    IdTimestampScale = 0x2AD7B1,
+    IdMuxingApp = 0x4D80,
+    IdWritingApp = 0x5741,
+    IdDuration = 0x4489,
+    IdTracks = 0x1654AE6B,
+    IdTrackEntry = 0xAE,
+    IdTrackNumber = 0xD7,
+    IdTrackUid = 0x73C5,
+    IdTrackType = 0x83,
+    IdFlagLacing = 0x9C,
+    IdCodecId = 0x86,
+    IdCodecPrivate = 0x63A2,
+    IdDefaultDuration = 0x23E383,
+    IdVideo = 0xE0,
+    IdPixelWidth = 0xB0,
+    IdPixelHeight = 0xBA,
+    IdAudio = 0xE1,
+    IdSamplingFrequency = 0xB5,
+    IdChannels = 0x9F,
+    IdBitDepth = 0x6264,
+    IdCluster = 0x1F43B675,
+    IdTimestamp = 0xE7,
+    IdSimpleBlock = 0xA3,
+    IdCues = 0x1C53BB6B,
+    IdCuePoint = 0xBB,
+    IdCueTime = 0xB3,
+    IdCueTrackPositions = 0xB7,
+    IdCueTrack = 0xF7,
+    IdCueClusterPosition = 0xF1,
+    IdVoid = 0xEC,
+};
+
+static void appendId(std::string &out, uint32_t id)
+{
+    const int length = id >= 0x1000000 ? 4 : id >= 0x10000 ? 3 : id >= 0x100 ? 2 : 1;
+    for (int i = length - 1; i >= 0; i--)
+        out += char(id >> (8 * i));
+}
+
+// An element size, in the shortest form unless @p length is given.
+static void appendSize(std::string &out, uint64_t size, int length = 0)
+{
+    // A length with all value bits set means unknown.
+    if (!length) {
+        length = 1;
+        while (length < 8 && size >= (uint64_t(1) << (7 * length)) - 1)
+            length++;
+    }
+    const uint64_t value = size | (uint64_t(1) << (7 * length));
+    for (int i = length - 1; i >= 0; i--)
+        out += char(value >> (8 * i));
+}
+
+static void appendElement(std::string &out, uint32_t id, const std::string &data)
+{
+    appendId(out, id);
+    appendSize(out, data.size());
+    out += data;
+}
+
+static void appendUInt(std::string &out, uint32_t id, uint64_t value, int length = 0)
+{
+    if (!length) {
+        length = 1;
+        while (length < 8 && value >> (8 * length))
+            length++;
+    }
+    appendId(out, id);
+    appendSize(out, length);
+    for (int i = length - 1; i >= 0; i--)
+        out += char(value >> (8 * i));
+}
+
+static void appendFloat(std::string &out, uint32_t id, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    appendId(out, id);
+    appendSize(out, 8);
+    for (int i = 7; i >= 0; i--)
+        out += char(bits >> (8 * i));
+}
+
+// Space to be overwritten later, @p total bytes including the element header.
+static void appendVoid(std::string &out, size_t total)
+{
+    appendId(out, IdVoid);
+    appendSize(out, total - 2);
+    out.append(total - 2, '\0');
+}
+
+// The position always takes 8 bytes, so a seek entry has the same size whatever it points to.
+static void appendSeek(std::string &out, uint32_t id, uint64_t position)
+{
+    std::string target;
+    appendId(target, id);
+    std::string seek;
+    appendElement(seek, IdSeekId, target);
+    appendUInt(seek, IdSeekPosition, position, 8);
+    appendElement(out, IdSeek, seek);
+}
+
+static void appendLittleEndian(std::string &out, uint32_t value, int length)
+{
+    for (int i = 0; i < length; i++)
+        out += char(value >> (8 * i));
+}
+
+MkvMuxer::MkvMuxer(const char *fileName, unsigned width, unsigned height, const char *fourcc, unsigned fps,
+                   const AudioFormat &audio, AviOutput::Kind outputKind)
+    : m_fps(fps ? fps : 1)
+    , m_audio(audio)
+{
+    m_fd = open(fileName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (m_fd < 0)
+        throw std::system_error(errno, std::generic_category(), fileName);
+
+    try {
+        m_output = AviOutput::create(outputKind, m_fd, BufferSize, Buffers);
+        m_buffer = m_output->buffer();
+        m_output->setWriteBehind(true);
+        writeHeader(width, height, fourcc);
+    } catch (...) {
+        delete m_output;
+        close(m_fd);
+        throw;
+    }
+}
+
+MkvMuxer::~MkvMuxer()
+{
+    // Waits for queued writes.
+    delete m_output;
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+/**
+ * Writes the EBML header and the start of the segment. The fields Finalize()
+ * fills in are reserved with Void elements of their size: the duration in the
+ * segment info and the seek entry of the cues in the seek head.
+ */
+void MkvMuxer::writeHeader(unsigned width, unsigned height, const char *fourcc)
+{
+    std::string ebml;
+    appendUInt(ebml, IdEbmlVersion, 1);
+    appendUInt(ebml, IdEbmlReadVersion, 1);
+    appendUInt(ebml, IdEbmlMaxIdLength, 4);
+    appendUInt(ebml, IdEbmlMaxSizeLength, 8);
+    appendElement(ebml, IdDocType, "matroska");
+    appendUInt(ebml, IdDocTypeVersion, 4);
+    appendUInt(ebml, IdDocTypeReadVersion, 2);
+
+    std::string header;
+    appendElement(header, IdEbml, ebml);
+    appendId(header, IdSegment);
+    appendSize(header, (uint64_t(1) << 56) - 1, 8); // unknown until Finalize()
+    m_segmentStart = header.size();
+
+    std::string info;
+    appendUInt(info, IdTimestampScale, 1000000); // timestamps in milliseconds
+    appendElement(info, IdMuxingApp, "screenrecorder");
+    appendElement(info, IdWritingApp, "screenrecorder");
+    const size_t durationOffset = info.size();
+    std::string duration;
+    appendFloat(duration, IdDuration, 0);
+    appendVoid(info, duration.size());
+
+    std::string entry;
+    appendUInt(entry, IdTrackNumber, 1);
+    appendUInt(entry, IdTrackUid, 1);
+    appendUInt(entry, IdTrackType, 1); // video
+    appendUInt(entry, IdFlagLacing, 0);
+    if (!memcmp(fourcc, "MJPG", 4)) {
+        appendElement(entry, IdCodecId, "V_MJPEG");
+    } else {
+        // BITMAPINFOHEADER, as in the strf chunk of an AVI.
+        std::string bitmap;
+        appendLittleEndian(bitmap, 40, 4);
+        appendLittleEndian(bitmap, width, 4);
+        appendLittleEndian(bitmap, height, 4);
+        appendLittleEndian(bitmap, 1, 2);
+        appendLittleEndian(bitmap, 24, 2);
+        bitmap.append(fourcc, 4);
+        appendLittleEndian(bitmap, width * height * 3, 4);
+        bitmap.append(16, '\0');
+        appendElement(entry, IdCodecId, "V_MS/VFW/FOURCC");
+        appendElement(entry, IdCodecPrivate, bitmap);
+    }
+    appendUInt(entry, IdDefaultDuration, 1000000000 / m_fps);
+    std::string video;
+    appendUInt(video, IdPixelWidth, width);
+    appendUInt(video, IdPixelHeight, height);
+    appendElement(entry, IdVideo, video);
+
+    std::string trackList;
+    appendElement(trackList, IdTrackEntry, entry);
+
+    if (m_audio.channels) {
+        std::string audio;
+        appendFloat(audio, IdSamplingFrequency, m_audio.sampleRate);
+        appendUInt(audio, IdChannels, m_audio.channels);
+        appendUInt(audio, IdBitDepth, m_audio.bits);
+        std::string track;
+        appendUInt(track, IdTrackNumber, 2);
+        appendUInt(track, IdTrackUid, 2);
+        appendUInt(track, IdTrackType, 2); // audio
+        appendUInt(track, IdFlagLacing, 0);
+        appendElement(track, IdCodecId, "A_PCM/INT/LIT");
+        appendElement(track, IdAudio, audio);
+        appendElement(trackList, IdTrackEntry, track);
+    }
+    std::string tracks;
+    appendElement(tracks, IdTracks, trackList);
+    std::string infoElement;
+    appendElement(infoElement, IdInfo, info);
+
+    // Seek entries have a fixed size, the first pass only measures the seek head.
+    std::string cuesSeek;
+    appendSeek(cuesSeek, IdCues, 0);
+    std::string seekHead;
+    for (int pass = 0; pass < 2; pass++) {
+        const uint64_t infoPos = seekHead.size();
+        std::string seeks;
+        appendSeek(seeks, IdInfo, infoPos);
+        appendSeek(seeks, IdTracks, infoPos + infoElement.size());
+        m_cuesSeekPos = seeks.size();
+        appendVoid(seeks, cuesSeek.size());
+        seekHead.clear();
+        appendElement(seekHead, IdSeekHead, seeks);
+        m_cuesSeekPos += m_segmentStart + seekHead.size() - seeks.size();
+    }
+    m_durationPos = m_segmentStart + seekHead.size() + infoElement.size() - info.size() + durationOffset;
+
+    put(header);
+    put(seekHead);
+    put(infoElement);
+    put(tracks);
+}
+
+uint64_t MkvMuxer::timestamp(uint64_t frame) const
+{
+    return frame * 1000 / m_fps;
+}
+
+/**
+ * Adds a block to the open cluster, after closing it if it is complete. Audio
+ * blocks are added once their samples are over, so they may start a little
+ * before the cluster, which the signed relative time allows.
+ */
+void MkvMuxer::addBlock(unsigned track, uint64_t time, const char *data, size_t len)
+{
+    if (!m_cluster.empty() && (time >= m_clusterTime + ClusterMillis || m_cluster.size() + len > ClusterBytes))
+        closeCluster();
+    if (m_cluster.empty()) {
+        m_clusterTime = time;
+        appendUInt(m_cluster, IdTimestamp, time);
+    }
+
+    // Track number, the time relative to the cluster and the keyframe flag.
+    const int16_t relative = int16_t(std::max<int64_t>(int64_t(time - m_clusterTime), INT16_MIN));
+    appendId(m_cluster, IdSimpleBlock);
+    appendSize(m_cluster, len + 4);
+    m_cluster += char(0x80 | track);
+    m_cluster += char(uint16_t(relative) >> 8);
+    m_cluster += char(relative);
+    m_cluster += char(0x80);
+    m_cluster.append(data, len);
+}
+
+int MkvMuxer::AddVideoFrame(const char *buffer, size_t len)
+{
+    try {
+        addBlock(1, timestamp(m_frames), buffer, len);
+    } catch (std::system_error &e) {
+        std::cerr << e.code().message() << "\n";
+        return -1;
+    }
+
+    m_frames++;
+    m_hasFrame = true;
+    return 0;
+}
+
+int MkvMuxer::AddRepeatedVideoFrame()
+{
+    if (!m_hasFrame) {
+        std::cerr << "there is no previous video frame to repeat\n";
+        return -1;
+    }
+
+    m_frames++;
+    return 0;
+}
+
+int MkvMuxer::AddAudioFrame(const char *buffer, size_t len)
+{
+    if (!m_audio.channels) {
+        std::cerr << "there is no audio track\n";
+        return -1;
+    }
+
+    try {
+        addBlock(2, m_audioSamples * 1000 / m_audio.sampleRate, buffer, len);
+    } catch (std::system_error &e) {
+        std::cerr << e.code().message() << "\n";
+        return -1;
+    }
+
+    m_audioSamples += len / m_audio.blockAlign();
+    return 0;
+}
+
+// Writes out the open cluster, it is never touched again.
+void MkvMuxer::closeCluster()
+{
+    if (m_cluster.empty())
+        return;
+
+    m_cues.push_back({ m_clusterTime, uint64_t(tell() - m_segmentStart) });
+    std::string header;
+    appendId(header, IdCluster);
+    appendSize(header, m_cluster.size());
+    put(header);
+    put(m_cluster);
+    m_cluster.clear();
+}
+
+int MkvMuxer::Checkpoint()
+{
+    try {
+        closeCluster();
+        flush();
+        m_output->drain();
+        if (fdatasync(m_fd) < 0)
+            throw std::system_error(errno, std::generic_category());
+    } catch (std::system_error &e) {
+        std::cerr << e.code().message() << "\n";
+        return -1;
+    }
+    return 0;
+}
+
+int MkvMuxer::Finalize()
+{
+    int ret = 0;
+
+    try {
+        closeCluster();
+
+        const int64_t cuesPos = tell();
+        if (!m_cues.empty()) {
+            std::string cues;
+            for (const CuePoint &cue : m_cues) {
+                std::string positions;
+                appendUInt(positions, IdCueTrack, 1);
+                appendUInt(positions, IdCueClusterPosition, cue.position);
+                std::string point;
+                appendUInt(point, IdCueTime, cue.time);
+                appendElement(point, IdCueTrackPositions, positions);
+                appendElement(cues, IdCuePoint, point);
+            }
+            std::string element;
+            appendElement(element, IdCues, cues);
+            put(element);
+        }
+        const int64_t end = tell();
+        flush();
+        m_output->drain();
+
+        std::string field;
+        appendSize(field, end - m_segmentStart, 8);
+        patch(m_segmentStart - 8, field);
+        field.clear();
+        appendFloat(field, IdDuration, m_frames * 1000.0 / m_fps);
+        patch(m_durationPos, field);
+        if (!m_cues.empty()) {
+            field.clear();
+            appendSeek(field, IdCues, cuesPos - m_segmentStart);
+            patch(m_cuesSeekPos, field);
+        }
+
+        m_output->trim(end);
+        delete m_output;
+        m_output = nullptr;
+        const int fd = m_fd;
+        m_fd = -1;
+        if (close(fd) < 0)
+            throw std::system_error(errno, std::generic_category());
+    } catch (std::system_error &e) {
+        std::cerr << e.code().message() << "\n";
+        ret = -1;
+    }
+
+    return ret;
+}
+
+const char *MkvMuxer::OutputName() const
+{
+    return m_output ? m_output->name() : "";
+}
+
+// File offset the next staged byte ends up at.
+int64_t MkvMuxer::tell() const
+{
+    return m_position + int64_t(m_length);
+}
+
+void MkvMuxer::put(const void *data, size_t len)
+{
+    const char *p = static_cast<const char *>(data);
+
+    while (len > 0) {
+        size_t n = m_output->bufferSize() - m_length;
+        if (n == 0) {
+            flush();
+            continue;
+        }
+        n = std::min(n, len);
+        memcpy(m_buffer + m_length, p, n);
+        m_length += n;
+        p += n;
+        len -= n;
+    }
+}
+
+void MkvMuxer::flush()
+{
+    if (!m_length)
+        return;
+
+    m_output->preallocate(tell());
+    m_output->submit(m_buffer, m_length, m_position);
+    m_position += m_length;
+    m_length = 0;
+    m_buffer = m_output->buffer();
+    m_output->written(m_position);
+}
+
+// Overwrites a field of the header, once every queued write is done.
+void MkvMuxer::patch(int64_t pos, const std::string &data)
+{
+    const char *p = data.data();
+    size_t len = data.size();
+
+    while (len > 0) {
+        const ssize_t written = pwrite(m_fd, p, len, pos);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            throw std::system_error(written < 0 ? errno : EIO, std::generic_category());
+        p += written;
+        len -= written;
+        pos += written;
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef MKVMUXER_H
+#define MKVMUXER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "avioutput.h"
+#include "muxer.h"
+
+/**
+ * Writes a Matroska file with one video track front to back. Frames are
+ * collected into clusters of up to a second, a cluster is written whole once
+ * it is complete, so every cluster in the file is self-contained and a file cut
+ * off at any point plays up to its last complete cluster. The segment is
+ * written with an unknown size and no index until Finalize().
+ *
+ * Repeated frames take no space: a frame stays on screen until the timestamp
+ * of the next one. Audio goes to a second track as PCM blocks, timed by the
+ * number of samples before them.
+ *
+ * Finalize() appends the cues, one per cluster, and patches three fixed-size
+ * fields in the header: the segment size, the duration and the position of the
+ * cues. It does not depend on the number of frames.
+ */
+class MkvMuxer : public Muxer
+{
+public:
+    // Throws std::system_error if the file cannot be created. MJPG frames are
+    // stored as V_MJPEG, other FourCCs in VfW compatibility mode.
+    MkvMuxer(const char *fileName, unsigned width, unsigned height, const char *fourcc, unsigned fps,
+             const AudioFormat &audio = AudioFormat(), AviOutput::Kind outputKind = AviOutput::Auto);
+    virtual ~MkvMuxer();
+
+    int AddVideoFrame(const char *buffer, size_t len) override;
+    int AddRepeatedVideoFrame() override;
+    int AddAudioFrame(const char *buffer, size_t len) override;
+    int Checkpoint() override;
+    int Finalize() override;
+    const char *OutputName() const override;
+
+private:
+    struct CuePoint {
+        uint64_t time;
+        uint64_t position; // of the cluster, relative to the segment data
+    };
+
+    void writeHeader(unsigned width, unsigned height, const char *fourcc);
+    void addBlock(unsigned track, uint64_t time, const char *data, size_t len);
+    void closeCluster();
+    uint64_t timestamp(uint64_t frame) const;
+
+    int64_t tell() const;
+    void put(const void *data, size_t len);
+    void put(const std::string &data) { put(data.data(), data.size()); }
+    void flush();
+    void patch(int64_t pos, const std::string &data);
+
+    int m_fd = -1;
+    AviOutput *m_output = nullptr;
+    char *m_buffer = nullptr;
+    size_t m_length = 0;
+    int64_t m_position = 0; // file offset of m_buffer
+
+    unsigned m_fps;
+    uint64_t m_frames = 0; // repeats included
+    bool m_hasFrame = false;
+    AudioFormat m_audio;
+    uint64_t m_audioSamples = 0;
+
+    int64_t m_segmentStart = 0; // offset of the segment data
+    int64_t m_durationPos = 0;
+    int64_t m_cuesSeekPos = 0;
+
+    std::string m_cluster; // blocks of the open cluster
+    uint64_t m_clusterTime = 0;
+    std::vector<CuePoint> m_cues;
+};
+
+#endif // MKVMUXER_H
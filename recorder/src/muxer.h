@@ -0,0 +1,40 @@
+#ifndef MUXER_H
+#define MUXER_H
+
+#include <stddef.h>
+
+// Interleaved little-endian integer PCM, unsigned for 8 bits and signed otherwise.
+struct AudioFormat
+{
+    unsigned channels = 0; // 0 for no audio track
+    unsigned bits = 16;
+    unsigned sampleRate = 0;
+
+    unsigned blockAlign() const { return channels * (bits / 8); }
+};
+
+/**
+ * A container format QAviWriter writes the encoded frames to. The calls follow
+ * GWAVI, the first one, and return 0 on success and -1 on error. Frames are
+ * added by one thread at a time.
+ */
+class Muxer
+{
+public:
+    virtual ~Muxer() {}
+
+    virtual int AddVideoFrame(const char *buffer, size_t len) = 0;
+    // Shows the previous frame for one more frame, fails if there is none yet.
+    virtual int AddRepeatedVideoFrame() = 0;
+    // Appends whole sample frames to the audio track, whose time is the number
+    // of samples written so far.
+    virtual int AddAudioFrame(const char *buffer, size_t len) = 0;
+    // Makes the frames added so far survive a crash.
+    virtual int Checkpoint() = 0;
+    // Completes the file and closes it, it is closed even if this fails.
+    virtual int Finalize() = 0;
+    // Name of the output backend, see AviOutput.
+    virtual const char *OutputName() const = 0;
+};
+
+#endif // MUXER_H
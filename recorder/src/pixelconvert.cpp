@@ -0,0 +1,459 @@
+#include "pixelconvert.h"
+
+#include <string.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#define PIXELCONVERT_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PIXELCONVERT_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+#endif
+
+namespace PixelConvert {
+
+void rgbaToRgb32RowScalar(const quint32 *src, quint32 *dst, int width)
+{
+    for (int x = 0; x < width; ++x) {
+        const quint32 p = src[x];
+        dst[x] = 0xff000000u | ((p & 0xffu) << 16) | (p & 0xff00u) | ((p >> 16) & 0xffu);
+    }
+}
+
+#ifdef PIXELCONVERT_X86
+__attribute__((target("sse2")))
+static void rowSse2(const quint32 *src, quint32 *dst, int width)
+{
+    const __m128i maskLow = _mm_set1_epi32(0x000000ff);
+    const __m128i maskGreen = _mm_set1_epi32(0x0000ff00);
+    const __m128i alpha = _mm_set1_epi32(int(0xff000000u));
+
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+        const __m128i r = _mm_slli_epi32(_mm_and_si128(v, maskLow), 16);
+        const __m128i g = _mm_and_si128(v, maskGreen);
+        const __m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), maskLow);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, alpha)));
+    }
+    rgbaToRgb32RowScalar(src + x, dst + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void rowAvx2(const quint32 *src, quint32 *dst, int width)
+{
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                             2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    const __m256i alpha = _mm256_set1_epi32(int(0xff000000u));
+
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x), _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha));
+    }
+    rgbaToRgb32RowScalar(src + x, dst + x, width - x);
+}
+#endif
+
+#ifdef PIXELCONVERT_NEON
+static void rowNeon(const quint32 *src, quint32 *dst, int width)
+{
+    const uint8x16_t alpha = vdupq_n_u8(0xff);
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const uint8x16x4_t in = vld4q_u8(reinterpret_cast<const uint8_t *>(src + x));
+        uint8x16x4_t out;
+        out.val[0] = in.val[2];
+        out.val[1] = in.val[1];
+        out.val[2] = in.val[0];
+        out.val[3] = alpha;
+        vst4q_u8(reinterpret_cast<uint8_t *>(dst + x), out);
+    }
+    rgbaToRgb32RowScalar(src + x, dst + x, width - x);
+}
+#endif
+
+RowFunction rgbaToRgb32RowSse2()
+{
+#ifdef PIXELCONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        return rowSse2;
+#endif
+    return nullptr;
+}
+
+RowFunction rgbaToRgb32RowAvx2()
+{
+#ifdef PIXELCONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return rowAvx2;
+#endif
+    return nullptr;
+}
+
+RowFunction rgbaToRgb32RowNeon()
+{
+#ifdef PIXELCONVERT_NEON
+#if !defined(__aarch64__)
+    if (!(getauxval(AT_HWCAP) & HWCAP_NEON))
+        return nullptr;
+#endif
+    return rowNeon;
+#else
+    return nullptr;
+#endif
+}
+
+struct Kernel {
+    RowFunction row;
+    const char *name;
+};
+
+static Kernel selectKernel()
+{
+    if (RowFunction row = rgbaToRgb32RowAvx2())
+        return { row, "avx2" };
+    if (RowFunction row = rgbaToRgb32RowSse2())
+        return { row, "sse2" };
+    if (RowFunction row = rgbaToRgb32RowNeon())
+        return { row, "neon" };
+    return { rgbaToRgb32RowScalar, "scalar" };
+}
+
+static const Kernel &kernel()
+{
+    static const Kernel selected = selectKernel();
+    return selected;
+}
+
+void rgbaToRgb32(const uchar *src, int srcStride, uchar *dst, int dstStride, int width, int height, bool flip)
+{
+    const RowFunction row = kernel().row;
+    for (int y = 0; y < height; ++y) {
+        const uchar *srcRow = src + qptrdiff(flip ? height - 1 - y : y) * srcStride;
+        row(reinterpret_cast<const quint32 *>(srcRow), reinterpret_cast<quint32 *>(dst + qptrdiff(y) * dstStride), width);
+    }
+}
+
+const char *implementation()
+{
+    return kernel().name;
+}
+
+// JFIF RGB to YCbCr in 16 bit fixed point. Chroma takes the sum of four pixels,
+// so its constants carry two extra bits of scale.
+enum {
+    YR = 19595, YG = 38470, YB = 7471,
+    CbR = 11059, CbG = 21709, CrG = 27439, CrB = 5329,
+    ChromaOffset = (128 << 18) + (1 << 17) - 1, // -1 keeps pure red and blue at 255
+};
+
+void rgbaToYuv420Scalar(const uchar *row0, const uchar *row1, uchar *y0, uchar *y1,
+                        uchar *cb, uchar *cr, int width, bool bgra)
+{
+    const int ri = bgra ? 2 : 0;
+    const int bi = bgra ? 0 : 2;
+    const int pairs = width / 2;
+    const int chromaWidth = (width + 1) / 2;
+
+    for (int x = 0; x < chromaWidth; ++x) {
+        const int x0 = x * 2;
+        const int x1 = x < pairs ? x0 + 1 : x0;
+        const uchar *p00 = row0 + x0 * 4;
+        const uchar *p01 = row0 + x1 * 4;
+        const uchar *p10 = row1 + x0 * 4;
+        const uchar *p11 = row1 + x1 * 4;
+
+        y0[x0] = uchar((YR * p00[ri] + YG * p00[1] + YB * p00[bi] + 32768) >> 16);
+        y1[x0] = uchar((YR * p10[ri] + YG * p10[1] + YB * p10[bi] + 32768) >> 16);
+        if (x1 != x0) {
+            y0[x1] = uchar((YR * p01[ri] + YG * p01[1] + YB * p01[bi] + 32768) >> 16);
+            y1[x1] = uchar((YR * p11[ri] + YG * p11[1] + YB * p11[bi] + 32768) >> 16);
+        }
+
+        const int r = p00[ri] + p01[ri] + p10[ri] + p11[ri];
+        const int g = p00[1] + p01[1] + p10[1] + p11[1];
+        const int b = p00[bi] + p01[bi] + p10[bi] + p11[bi];
+        cb[x] = uchar((-CbR * r - CbG * g + 32768 * b + ChromaOffset) >> 18);
+        cr[x] = uchar((32768 * r - CrG * g - CrB * b + ChromaOffset) >> 18);
+    }
+}
+
+void halveRgbaRowsScalar(const uchar *row0, const uchar *row1, uchar *dst, int width)
+{
+    for (int x = 0; x < width * 4; ++x) {
+        const int i = (x & ~3) * 2 + (x & 3);
+        dst[x] = uchar((row0[i] + row0[i + 4] + row1[i] + row1[i + 4] + 2) >> 2);
+    }
+}
+
+#ifdef PIXELCONVERT_X86
+// Splits four pixels into 16 bit channel pairs, (R, B) and (G, A) per 32 bit
+// lane, so pmaddwd can weigh two channels at once.
+__attribute__((target("sse2"), always_inline))
+static inline void splitSse2(__m128i pixels, bool bgra, __m128i *rb, __m128i *ga)
+{
+    const __m128i lowBytes = _mm_set1_epi32(0x00ff00ff);
+    *rb = _mm_and_si128(pixels, lowBytes);
+    *ga = _mm_and_si128(_mm_srli_epi32(pixels, 8), lowBytes);
+    if (bgra)
+        *rb = _mm_shufflehi_epi16(_mm_shufflelo_epi16(*rb, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline __m128i lumaSse2(__m128i rb, __m128i ga)
+{
+    // YG does not fit a signed 16 bit factor, pmaddwd takes YG - 65536 and the
+    // missing G << 16 is added separately.
+    const __m128i factorsRb = _mm_set1_epi32(YB << 16 | YR);
+    const __m128i factorsGa = _mm_set1_epi32(YG);
+    const __m128i rounding = _mm_set1_epi32(32768);
+    __m128i sum = _mm_add_epi32(_mm_madd_epi16(rb, factorsRb), _mm_madd_epi16(ga, factorsGa));
+    sum = _mm_add_epi32(sum, _mm_add_epi32(_mm_slli_epi32(ga, 16), rounding));
+    return _mm_srli_epi32(sum, 16);
+}
+
+// Adds horizontally adjacent 32 bit lanes of @p a and @p b, two pixels per result lane.
+__attribute__((target("sse2"), always_inline))
+static inline __m128i pairSumSse2(__m128i a, __m128i b)
+{
+    const __m128 fa = _mm_castsi128_ps(a);
+    const __m128 fb = _mm_castsi128_ps(b);
+    return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(2, 0, 2, 0))),
+                         _mm_castps_si128(_mm_shuffle_ps(fa, fb, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+__attribute__((target("sse2")))
+static void yuv420Sse2(const uchar *row0, const uchar *row1, uchar *y0, uchar *y1,
+                       uchar *cb, uchar *cr, int width, bool bgra)
+{
+    const __m128i factorsCbRb = _mm_set1_epi32(0xffff & -CbR);
+    const __m128i factorsCbGa = _mm_set1_epi32(0xffff & -CbG);
+    const __m128i factorsCrRb = _mm_set1_epi32(int(quint32(0xffff & -CrB) << 16));
+    const __m128i factorsCrGa = _mm_set1_epi32(0xffff & -CrG);
+    const __m128i lowWord = _mm_set1_epi32(0xffff);
+    const __m128i offset = _mm_set1_epi32(ChromaOffset);
+
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i rb[4], ga[4];
+        splitSse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x * 4)), bgra, &rb[0], &ga[0]);
+        splitSse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x * 4 + 16)), bgra, &rb[1], &ga[1]);
+        splitSse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x * 4)), bgra, &rb[2], &ga[2]);
+        splitSse2(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x * 4 + 16)), bgra, &rb[3], &ga[3]);
+
+        const __m128i luma0 = _mm_packs_epi32(lumaSse2(rb[0], ga[0]), lumaSse2(rb[1], ga[1]));
+        const __m128i luma1 = _mm_packs_epi32(lumaSse2(rb[2], ga[2]), lumaSse2(rb[3], ga[3]));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(y0 + x), _mm_packus_epi16(luma0, luma0));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(y1 + x), _mm_packus_epi16(luma1, luma1));
+
+        // Channel sums of 2x2 pixels, at most 1020 so the pairs stay intact.
+        const __m128i rbSum = pairSumSse2(_mm_add_epi32(rb[0], rb[2]), _mm_add_epi32(rb[1], rb[3]));
+        const __m128i gaSum = pairSumSse2(_mm_add_epi32(ga[0], ga[2]), _mm_add_epi32(ga[1], ga[3]));
+        const __m128i r15 = _mm_slli_epi32(_mm_and_si128(rbSum, lowWord), 15);
+        const __m128i b15 = _mm_slli_epi32(_mm_srli_epi32(rbSum, 16), 15);
+
+        __m128i blue = _mm_add_epi32(_mm_madd_epi16(rbSum, factorsCbRb), _mm_madd_epi16(gaSum, factorsCbGa));
+        blue = _mm_srai_epi32(_mm_add_epi32(blue, _mm_add_epi32(b15, offset)), 18);
+        __m128i red = _mm_add_epi32(_mm_madd_epi16(rbSum, factorsCrRb), _mm_madd_epi16(gaSum, factorsCrGa));
+        red = _mm_srai_epi32(_mm_add_epi32(red, _mm_add_epi32(r15, offset)), 18);
+
+        const __m128i chroma = _mm_packus_epi16(_mm_packs_epi32(blue, red), _mm_setzero_si128());
+        const int cbBytes = _mm_cvtsi128_si32(chroma);
+        const int crBytes = _mm_cvtsi128_si32(_mm_srli_si128(chroma, 4));
+        memcpy(cb + x / 2, &cbBytes, 4);
+        memcpy(cr + x / 2, &crBytes, 4);
+    }
+    rgbaToYuv420Scalar(row0 + x * 4, row1 + x * 4, y0 + x, y1 + x, cb + x / 2, cr + x / 2, width - x, bgra);
+}
+
+__attribute__((target("sse2")))
+static void halveSse2(const uchar *row0, const uchar *row1, uchar *dst, int width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi16(2);
+
+    int x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i halves[2];
+        for (int i = 0; i < 2; ++i) {
+            // Two source pixels per output pixel and row, channels widened to 16 bit.
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row0 + x * 8 + i * 16));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row1 + x * 8 + i * 16));
+            const __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+            const __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+            const __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(low, high), _mm_unpackhi_epi64(low, high));
+            halves[i] = _mm_srli_epi16(_mm_add_epi16(sum, rounding), 2);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x * 4), _mm_packus_epi16(halves[0], halves[1]));
+    }
+    halveRgbaRowsScalar(row0 + x * 8, row1 + x * 8, dst + x * 4, width - x);
+}
+#endif
+
+#ifdef PIXELCONVERT_NEON
+static inline uint8x8_t lumaNeon(uint16x8_t r, uint16x8_t g, uint16x8_t b)
+{
+    const uint32x4_t rounding = vdupq_n_u32(32768);
+    uint32x4_t low = vmull_n_u16(vget_low_u16(r), YR);
+    low = vmlal_n_u16(low, vget_low_u16(g), YG);
+    low = vmlal_n_u16(low, vget_low_u16(b), YB);
+    uint32x4_t high = vmull_n_u16(vget_high_u16(r), YR);
+    high = vmlal_n_u16(high, vget_high_u16(g), YG);
+    high = vmlal_n_u16(high, vget_high_u16(b), YB);
+    return vmovn_u16(vcombine_u16(vaddhn_u32(low, rounding), vaddhn_u32(high, rounding)));
+}
+
+// Computes (32768 * plus - f1 * minus1 - f2 * minus2 + offset) >> 18 for eight
+// 2x2 sums. Intermediates may wrap, the final value is always in 0..255.
+static inline uint8x8_t chromaNeon(uint16x8_t plus, uint16x8_t minus1, quint16 f1, uint16x8_t minus2, quint16 f2)
+{
+    const uint32x4_t offset = vdupq_n_u32(ChromaOffset);
+    uint32x4_t low = vmlal_n_u16(offset, vget_low_u16(plus), 32768);
+    low = vmlsl_n_u16(low, vget_low_u16(minus1), f1);
+    low = vmlsl_n_u16(low, vget_low_u16(minus2), f2);
+    uint32x4_t high = vmlal_n_u16(offset, vget_high_u16(plus), 32768);
+    high = vmlsl_n_u16(high, vget_high_u16(minus1), f1);
+    high = vmlsl_n_u16(high, vget_high_u16(minus2), f2);
+    return vmovn_u16(vcombine_u16(vmovn_u32(vshrq_n_u32(low, 18)), vmovn_u32(vshrq_n_u32(high, 18))));
+}
+
+static void yuv420Neon(const uchar *row0, const uchar *row1, uchar *y0, uchar *y1,
+                       uchar *cb, uchar *cr, int width, bool bgra)
+{
+    const int ri = bgra ? 2 : 0;
+    const int bi = bgra ? 0 : 2;
+
+    int x = 0;
+    for (; x + 16 <= width; x += 16) {
+        const uint8x16x4_t a = vld4q_u8(row0 + x * 4);
+        const uint8x16x4_t b = vld4q_u8(row1 + x * 4);
+
+        vst1_u8(y0 + x, lumaNeon(vmovl_u8(vget_low_u8(a.val[ri])), vmovl_u8(vget_low_u8(a.val[1])), vmovl_u8(vget_low_u8(a.val[bi]))));
+        vst1_u8(y0 + x + 8, lumaNeon(vmovl_u8(vget_high_u8(a.val[ri])), vmovl_u8(vget_high_u8(a.val[1])), vmovl_u8(vget_high_u8(a.val[bi]))));
+        vst1_u8(y1 + x, lumaNeon(vmovl_u8(vget_low_u8(b.val[ri])), vmovl_u8(vget_low_u8(b.val[1])), vmovl_u8(vget_low_u8(b.val[bi]))));
+        vst1_u8(y1 + x + 8, lumaNeon(vmovl_u8(vget_high_u8(b.val[ri])), vmovl_u8(vget_high_u8(b.val[1])), vmovl_u8(vget_high_u8(b.val[bi]))));
+
+        const uint16x8_t r = vpadalq_u8(vpaddlq_u8(a.val[ri]), b.val[ri]);
+        const uint16x8_t g = vpadalq_u8(vpaddlq_u8(a.val[1]), b.val[1]);
+        const uint16x8_t bl = vpadalq_u8(vpaddlq_u8(a.val[bi]), b.val[bi]);
+        vst1_u8(cb + x / 2, chromaNeon(bl, r, CbR, g, CbG));
+        vst1_u8(cr + x / 2, chromaNeon(r, g, CrG, bl, CrB));
+    }
+    rgbaToYuv420Scalar(row0 + x * 4, row1 + x * 4, y0 + x, y1 + x, cb + x / 2, cr + x / 2, width - x, bgra);
+}
+
+static void halveNeon(const uchar *row0, const uchar *row1, uchar *dst, int width)
+{
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        const uint8x16x4_t a = vld4q_u8(row0 + x * 8);
+        const uint8x16x4_t b = vld4q_u8(row1 + x * 8);
+        uint8x8x4_t out;
+        for (int c = 0; c < 4; ++c)
+            out.val[c] = vrshrn_n_u16(vpadalq_u8(vpaddlq_u8(a.val[c]), b.val[c]), 2);
+        vst4_u8(dst + x * 4, out);
+    }
+    halveRgbaRowsScalar(row0 + x * 8, row1 + x * 8, dst + x * 4, width - x);
+}
+#endif
+
+Yuv420Function rgbaToYuv420Sse2()
+{
+#ifdef PIXELCONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        return yuv420Sse2;
+#endif
+    return nullptr;
+}
+
+Yuv420Function rgbaToYuv420Neon()
+{
+#ifdef PIXELCONVERT_NEON
+#if !defined(__aarch64__)
+    if (!(getauxval(AT_HWCAP) & HWCAP_NEON))
+        return nullptr;
+#endif
+    return yuv420Neon;
+#else
+    return nullptr;
+#endif
+}
+
+HalveFunction halveRgbaRowsSse2()
+{
+#ifdef PIXELCONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        return halveSse2;
+#endif
+    return nullptr;
+}
+
+HalveFunction halveRgbaRowsNeon()
+{
+#ifdef PIXELCONVERT_NEON
+#if !defined(__aarch64__)
+    if (!(getauxval(AT_HWCAP) & HWCAP_NEON))
+        return nullptr;
+#endif
+    return halveNeon;
+#else
+    return nullptr;
+#endif
+}
+
+struct Yuv420Kernel {
+    Yuv420Function convert;
+    HalveFunction halve;
+    const char *name;
+};
+
+static Yuv420Kernel selectYuv420Kernel()
+{
+    Yuv420Function convert = rgbaToYuv420Sse2();
+    HalveFunction halve = halveRgbaRowsSse2();
+    if (convert && halve)
+        return { convert, halve, "sse2" };
+    convert = rgbaToYuv420Neon();
+    halve = halveRgbaRowsNeon();
+    if (convert && halve)
+        return { convert, halve, "neon" };
+    return { rgbaToYuv420Scalar, halveRgbaRowsScalar, "scalar" };
+}
+
+static const Yuv420Kernel &yuv420Kernel()
+{
+    static const Yuv420Kernel selected = selectYuv420Kernel();
+    return selected;
+}
+
+void rgbaToYuv420(const uchar *row0, const uchar *row1, uchar *y0, uchar *y1,
+                  uchar *cb, uchar *cr, int width, bool bgra)
+{
+    yuv420Kernel().convert(row0, row1, y0, y1, cb, cr, width, bgra);
+}
+
+void halveRgbaRows(const uchar *row0, const uchar *row1, uchar *dst, int width)
+{
+    yuv420Kernel().halve(row0, row1, dst, width);
+}
+
+const char *yuv420Implementation()
+{
+    return yuv420Kernel().name;
+}
+
+} // namespace PixelConvert
@@ -0,0 +1,55 @@
+#ifndef PIXELCONVERT_H
+#define PIXELCONVERT_H
+
+#include <QtGlobal>
+
+namespace PixelConvert {
+
+typedef void (*RowFunction)(const quint32 *src, quint32 *dst, int width);
+
+/**
+ * Converts @p height rows of RGBA8888 byte order (what lipstick writes into the
+ * ARGB8888 shm buffers) into QImage::Format_RGB32. With @p flip set the source
+ * is walked bottom-up, so Y-inverted frames need no separate mirroring pass.
+ */
+void rgbaToRgb32(const uchar *src, int srcStride, uchar *dst, int dstStride, int width, int height, bool flip);
+
+// Name of the row kernel selected for this CPU.
+const char *implementation();
+
+// Individual row kernels, exposed to compare them against the scalar reference.
+void rgbaToRgb32RowScalar(const quint32 *src, quint32 *dst, int width);
+RowFunction rgbaToRgb32RowSse2();
+RowFunction rgbaToRgb32RowAvx2();
+RowFunction rgbaToRgb32RowNeon();
+
+typedef void (*Yuv420Function)(const uchar *row0, const uchar *row1, uchar *y0, uchar *y1,
+                               uchar *cb, uchar *cr, int width, bool bgra);
+typedef void (*HalveFunction)(const uchar *row0, const uchar *row1, uchar *dst, int width);
+
+/**
+ * Converts two rows of @p width pixels into two rows of JFIF luma and one row of
+ * Cb and Cr averaged over 2x2 pixels, with the fixed point math of libjpeg.
+ * Pixels are in RGBA8888 byte order, or BGRA (QImage::Format_RGB32) with @p bgra
+ * set. An odd last column is paired with itself.
+ */
+void rgbaToYuv420(const uchar *row0, const uchar *row1, uchar *y0, uchar *y1,
+                  uchar *cb, uchar *cr, int width, bool bgra);
+
+// Box-filters two rows of 2 * @p width RGBA8888 pixels into one row of @p width pixels.
+void halveRgbaRows(const uchar *row0, const uchar *row1, uchar *dst, int width);
+
+// Name of the YCbCr kernels selected for this CPU.
+const char *yuv420Implementation();
+
+void rgbaToYuv420Scalar(const uchar *row0, const uchar *row1, uchar *y0, uchar *y1,
+                        uchar *cb, uchar *cr, int width, bool bgra);
+void halveRgbaRowsScalar(const uchar *row0, const uchar *row1, uchar *dst, int width);
+Yuv420Function rgbaToYuv420Sse2();
+Yuv420Function rgbaToYuv420Neon();
+HalveFunction halveRgbaRowsSse2();
+HalveFunction halveRgbaRowsNeon();
+
+} // namespace PixelConvert
+
+#endif // PIXELCONVERT_H
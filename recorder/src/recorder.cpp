@@ -13,24 +13,16 @@
 **
 ****************************************************************************/
 
-#include <stdlib.h>
-#include <sys/mman.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <errno.h>
-
 #include <QGuiApplication>
 #include <QScreen>
 #include <qpa/qplatformnativeinterface.h>
 #include <QDebug>
-#include <QThread>
-#include <QMutexLocker>
-#include <QElapsedTimer>
+#include <QSocketNotifier>
 #include <QTimer>
-#include <QThreadPool>
-#include <QtConcurrent>
 #include <QLoggingCategory>
 #include <QDateTime>
+#include <QFile>
+#include <QStandardPaths>
 
 #include <MDConfGroup>
 
@@ -38,68 +30,43 @@
 #include "recorder.h"
 
 #include "QAviWriter.h"
+#include "audiocapture.h"
+#include "audiosource.h"
+#include "encoderthread.h"
+#include "framescheduler.h"
+#include "loadcontroller.h"
+#include "shmpool.h"
+#include "spoolfile.h"
+#include "spooltranscoder.h"
 
 Q_LOGGING_CATEGORY(logrecorder, "screenrecorder.recorder", QtDebugMsg)
-Q_LOGGING_CATEGORY(logbuffer, "screenrecorder.recorder.buffer", QtDebugMsg)
-
-static Recorder *s_instance = nullptr;
 
-class Buffer
-{
-public:
-    static Buffer *create(wl_shm *shm, int width, int height, int stride, int format)
-    {
-        int size = stride * height;
-
-        char filename[] = "/tmp/lipstick-recorder-shm-XXXXXX";
-        int fd = mkstemp(filename);
-        if (fd < 0) {
-            qCWarning(logbuffer) << "creating a buffer file for" << size << "B failed";
-            return nullptr;
-        }
-        int flags = fcntl(fd, F_GETFD);
-        if (flags != -1)
-            fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
-
-        if (ftruncate(fd, size) < 0) {
-            qCWarning(logbuffer) << "ftruncate failed:" << strerror(errno);
-            close(fd);
-            return nullptr;
-        }
+// One buffer with the compositor, one waiting in the scheduler and one being encoded.
+static const int MinBuffers = 3;
 
-        uchar *data = (uchar *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-        unlink(filename);
-        if (data == (uchar *)MAP_FAILED) {
-            qCWarning(logbuffer) << "mmap failed";
-            close(fd);
-            return nullptr;
-        }
-
-        Buffer *buf = new Buffer;
-
-        wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-        buf->buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, WL_SHM_FORMAT_ARGB8888);
-        wl_buffer_set_user_data(buf->buffer, buf);
-        wl_shm_pool_destroy(pool);
-        buf->data = data;
-        buf->image = QImage(data, width, height, stride, QImage::Format_RGBA8888);
-        close(fd);
-        return buf;
-    }
+static const char *const s_overflowNames[] = {
+    "block",
+    "drop-oldest",
+    "drop-newest",
+    "degrade",
+};
 
-    wl_buffer *buffer;
-    uchar *data;
-    QImage image;
-    QPixmap pixmap;
-    bool busy = false;
+// Also the file extensions.
+static const char *const s_containerNames[] = {
+    "avi",
+    "mkv",
 };
 
+static Recorder *s_instance = nullptr;
+
 Recorder::Recorder(const Options &options, QObject *parent)
     : QObject(parent)
     , m_avi(new QAviWriter(QStringLiteral("MJPG"), this))
     , m_options(options)
-    , m_pool(new QThreadPool(this))
-    , m_timer(new QTimer(this))
+    , m_encoder(new EncoderThread(m_avi, this))
+    , m_scheduler(new FrameScheduler(m_encoder, this))
+    , m_controller(new LoadController(m_encoder, m_scheduler, this))
+    , m_progressTimer(new QTimer(this))
 {
     qCDebug(logrecorder) << "Writing to" << options.destination;
     qCDebug(logrecorder) << "Fps:" << options.fps;
@@ -107,6 +74,19 @@ Recorder::Recorder(const Options &options, QObject *parent)
     qCDebug(logrecorder) << "Scale:" << options.scale;
     qCDebug(logrecorder) << "Smooth:" << options.smooth;
     qCDebug(logrecorder) << "Quality:" << options.quality;
+    qCDebug(logrecorder) << "Encoders:" << options.encoders;
+    qCDebug(logrecorder) << "Stripes:" << options.stripes;
+    qCDebug(logrecorder) << "Min quality:" << options.minQuality;
+    qCDebug(logrecorder) << "Min fps:" << options.minFps;
+    qCDebug(logrecorder) << "Max queue MB:" << options.maxQueueMb;
+    qCDebug(logrecorder) << "Prefault:" << options.prefault;
+    qCDebug(logrecorder) << "Overflow:" << overflowName(options.overflow);
+    qCDebug(logrecorder) << "Checkpoint:" << options.checkpoint;
+    qCDebug(logrecorder) << "Segment seconds:" << options.segmentSeconds;
+    qCDebug(logrecorder) << "Segment MB:" << options.segmentMb;
+    qCDebug(logrecorder) << "Container:" << containerName(options.container);
+    qCDebug(logrecorder) << "Audio:" << options.audio;
+    qCDebug(logrecorder) << "Spool:" << options.spool;
     if (options.fullMode) {
         qCDebug(logrecorder) << "Writing full fps frames.";
     } else {
@@ -115,12 +95,14 @@ Recorder::Recorder(const Options &options, QObject *parent)
 
     m_screen = QGuiApplication::screens().first();
 
-    m_pool->setMaxThreadCount(1);
+    m_releasedNotifier = new QSocketNotifier(m_encoder->releasedFd(), QSocketNotifier::Read, this);
+    connect(m_releasedNotifier, &QSocketNotifier::activated, this, &Recorder::buffersReleased);
 
-    m_timer->setTimerType(Qt::PreciseTimer);
-    m_timer->setInterval(1000 / m_options.fps);
-    m_timer->setSingleShot(true);
-    connect(m_timer, &QTimer::timeout, this, &Recorder::saveFrame);
+    connect(m_encoder, &QThread::finished, this, &Recorder::finishSaving);
+    // Segments are finalized on a thread of the writer.
+    connect(m_avi, &QAviWriter::segmentFinished, this, &Recorder::segmentSaved, Qt::QueuedConnection);
+    m_progressTimer->setInterval(500);
+    connect(m_progressTimer, &QTimer::timeout, this, &Recorder::reportProgress);
 
     s_instance = this;
 }
@@ -132,6 +114,9 @@ Recorder *Recorder::instance()
 
 Recorder::~Recorder()
 {
+    delete m_transcoder;
+    releaseBuffers();
+    delete m_spool;
 }
 
 Recorder::Status Recorder::status() const
@@ -157,10 +142,82 @@ Recorder::Options Recorder::readOptions()
         dconf.value(QStringLiteral("scale"), 1.0f).toDouble(),
         dconf.value(QStringLiteral("quality"), 100).toInt(),
         dconf.value(QStringLiteral("smooth"), false).toBool(),
+        dconf.value(QStringLiteral("encoders"), 0).toInt(),
+        dconf.value(QStringLiteral("stripes"), 0).toInt(),
+        dconf.value(QStringLiteral("minquality"), 60).toInt(),
+        dconf.value(QStringLiteral("minfps"), 12).toInt(),
+        dconf.value(QStringLiteral("maxqueuemb"), 256).toInt(),
+        dconf.value(QStringLiteral("prefault"), false).toBool(),
+        overflowFromName(dconf.value(QStringLiteral("overflow"), QStringLiteral("block")).toString()),
+        dconf.value(QStringLiteral("checkpoint"), 10).toInt(),
+        dconf.value(QStringLiteral("segmentseconds"), 0).toInt(),
+        dconf.value(QStringLiteral("segmentmb"), 0).toInt(),
+        containerFromName(dconf.value(QStringLiteral("container"), QStringLiteral("avi")).toString()),
+        dconf.value(QStringLiteral("audio"), QString()).toString(),
+        dconf.value(QStringLiteral("spool"), false).toBool(),
         false,
     };
 }
 
+Recorder::Overflow Recorder::overflowFromName(const QString &name, bool *ok)
+{
+    for (int i = 0; i < int(sizeof(s_overflowNames) / sizeof(s_overflowNames[0])); ++i) {
+        if (name == QLatin1String(s_overflowNames[i])) {
+            if (ok)
+                *ok = true;
+            return Overflow(i);
+        }
+    }
+    if (ok)
+        *ok = false;
+    return OverflowBlock;
+}
+
+QString Recorder::overflowName(Overflow overflow)
+{
+    return QLatin1String(s_overflowNames[overflow]);
+}
+
+Recorder::Container Recorder::containerFromName(const QString &name, bool *ok)
+{
+    for (int i = 0; i < int(sizeof(s_containerNames) / sizeof(s_containerNames[0])); ++i) {
+        if (name == QLatin1String(s_containerNames[i])) {
+            if (ok)
+                *ok = true;
+            return Container(i);
+        }
+    }
+    if (ok)
+        *ok = false;
+    return ContainerAvi;
+}
+
+QString Recorder::containerName(Container container)
+{
+    return QLatin1String(s_containerNames[container]);
+}
+
+bool Recorder::recover(const QString &fileName)
+{
+    const int result = QAviWriter::recover(fileName);
+    if (result < 0) {
+        qCWarning(logrecorder) << Q_FUNC_INFO << "Could not recover" << fileName;
+        return false;
+    }
+    if (result > 0)
+        qCDebug(logrecorder) << "Nothing to recover in" << fileName;
+    else
+        qCDebug(logrecorder) << "Recovered" << fileName;
+    return true;
+}
+
+Recorder::OverflowStats Recorder::overflowStats() const
+{
+    OverflowStats stats = m_overflowStats;
+    stats.droppedOldest = m_encoder->droppedOldest();
+    return stats;
+}
+
 void Recorder::init()
 {
     QPlatformNativeInterface *native = QGuiApplication::platformNativeInterface();
@@ -196,12 +253,45 @@ void Recorder::start()
 
 
     const QString dateString = QDateTime::currentDateTime().toString(QStringLiteral("dd-MM-yy_HH-mm-ss"));
-    const QString filename = QStringLiteral("/screenrecorder-%1.avi").arg(dateString);
+    const QString filename = QStringLiteral("/screenrecorder-%1.%2").arg(dateString, containerName(m_options.container));
 
     m_avi->setFileName(m_options.destination + filename);
     m_avi->setFps(m_options.fps);
     m_avi->setSize(m_size);
-    m_avi->open();
+    m_avi->setCheckpointInterval(m_options.checkpoint);
+    m_avi->setSegmentLimits(m_options.segmentSeconds, m_options.segmentMb);
+    m_avi->setContainer(m_options.container == ContainerMatroska ? QAviWriter::Matroska : QAviWriter::Avi);
+    m_spoolName = m_options.spool ? m_avi->fileName() + QStringLiteral(".spool") : QString();
+
+    if (!m_options.audio.isEmpty() && m_options.spool) {
+        // The muxer takes the audio along with the video, which is only written after the recording.
+        qCWarning(logrecorder) << "Audio is not recorded when spooling";
+    } else if (!m_options.audio.isEmpty()) {
+        AudioSource *source = AudioSource::create(m_options.audio);
+        if (source) {
+            m_audio = new AudioCapture(source, this);
+            qCDebug(logrecorder) << "Audio:" << source->format().sampleRate << "Hz,"
+                                 << source->format().channels << "channels," << source->format().bits << "bit";
+        } else {
+            qCWarning(logrecorder) << "Recording without audio";
+        }
+    }
+    m_avi->setAudio(m_audio);
+
+    if (!m_avi->open()) {
+        qCWarning(logrecorder) << "Could not create" << m_avi->fileName() << "- not recording";
+        m_avi->setAudio(nullptr);
+        delete m_audio;
+        m_audio = nullptr;
+        return;
+    }
+    qCDebug(logrecorder) << "Writing with" << m_avi->outputName();
+
+    // Audio needs the video in real time, idle periods are kept as repeated frames.
+    m_scheduler->start(m_options.fps, m_options.fullMode || m_audio);
+    if (m_audio)
+        m_audio->start();
+    m_overflowStats = OverflowStats();
 
     QPlatformNativeInterface *native = QGuiApplication::platformNativeInterface();
     wl_output *output = static_cast<wl_output *>(native->nativeResourceForScreen(QByteArrayLiteral("output"), m_screen));
@@ -217,24 +307,139 @@ void Recorder::start()
     setStatus(StatusRecording);
 }
 
-QString Recorder::stop()
+bool Recorder::stop()
 {
     if (m_status != StatusRecording) {
         qCWarning(logrecorder) << Q_FUNC_INFO << "Not recording!";
-        return QString();
+        return false;
     }
 
     setStatus(StatusSaving);
 
     qCDebug(logrecorder) << "Saving frames, please wait!";
-    m_pool->waitForDone();
+    m_controller->stop();
+    m_scheduler->stop();
+    if (m_audio)
+        m_audio->requestStop();
+
+    // No more frames arrive, the encoder writes out what it has and finishSaving()
+    // completes the file once its thread is done.
+    lipstick_recorder_destroy(m_recorder);
+    m_recorder = nullptr;
+    m_encoder->requestStop();
+    // Stopped before the compositor sent setup: the encoder thread never ran and
+    // emits no finished(), so complete the (empty) recording from the event loop.
+    if (!m_encoder->isRunning())
+        QMetaObject::invokeMethod(this, "finishSaving", Qt::QueuedConnection);
+
+    reportProgress();
+    m_progressTimer->start();
+    return true;
+}
+
+void Recorder::reportProgress()
+{
+    const int remaining = m_encoder->backlog() + (m_transcoder ? m_transcoder->remaining() : 0);
+    const qint64 written = m_avi->bytesWritten();
+    qCDebug(logrecorder) << "Saving:" << remaining << "frames left," << written << "bytes written";
+    emit saveProgress(remaining, written);
+}
+
+void Recorder::finishSaving()
+{
+    if (m_status != StatusSaving)
+        return;
+
+    // The spool is complete, its frames now go through the encoder.
+    if (m_spool && transcode())
+        return;
+
+    m_progressTimer->stop();
+    m_encoder->wait();
+    if (m_transcoder) {
+        const bool complete = m_transcoder->isComplete();
+        delete m_transcoder;
+        m_transcoder = nullptr;
+        m_releasedNotifier->setEnabled(true);
+        if (complete)
+            QFile::remove(m_spoolName);
+        else
+            qCWarning(logrecorder) << "Not every spooled frame was encoded, keeping" << m_spoolName;
+    }
     m_avi->close();
+    if (m_audio) {
+        m_avi->setAudio(nullptr);
+        delete m_audio;
+        m_audio = nullptr;
+    }
+    // Deliver the segments closed so far before announcing the whole recording.
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
 
+    const OverflowStats stats = overflowStats();
+    qCDebug(logrecorder) << "Overflow: blocked" << stats.blocked
+                         << "dropped oldest" << stats.droppedOldest
+                         << "dropped newest" << stats.droppedNewest
+                         << "degraded" << stats.degraded;
+
+    releaseBuffers();
     setStatus(StatusReady);
 
-    lipstick_recorder_destroy(m_recorder);
+    qCDebug(logrecorder) << "File saved to:" << m_avi->fileName();
+    emit saveProgress(0, m_avi->bytesWritten());
+    emit recordingFinished(m_avi->fileName());
+
+    if (m_shutdown)
+        qGuiApp->sendEvent(qGuiApp, new QEvent(QEvent::Quit));
+}
 
-    return m_avi->fileName();
+/**
+ * Second phase of a spooled recording. Closes the spool and runs the encoder
+ * again with a SpoolTranscoder in place of the capture. Returns false if the
+ * spool cannot be read back, the recording then ends without its frames.
+ */
+bool Recorder::transcode()
+{
+    m_encoder->wait();
+    m_encoder->setSpool(nullptr);
+    const bool closed = m_spool->close();
+    delete m_spool;
+    m_spool = nullptr;
+
+    SpoolReader *reader = closed ? SpoolReader::open(m_spoolName) : nullptr;
+    if (!reader) {
+        qCWarning(logrecorder) << "Could not read back" << m_spoolName;
+        return false;
+    }
+    qCDebug(logrecorder) << "Encoding" << reader->records() << "spooled frames";
+
+    m_encoder->setBuffers(m_buffers);
+    setupEncoder();
+    m_encoder->setDropOldest(false);
+    m_transcoder = new SpoolTranscoder(reader, m_encoder, m_buffers, this);
+    // The transcoder is the producer now and waits on the released eventfd itself.
+    m_releasedNotifier->setEnabled(false);
+    m_encoder->start();
+    m_transcoder->start();
+    return true;
+}
+
+void Recorder::segmentSaved(const QString &fileName, bool ok)
+{
+    if (!ok)
+        qCWarning(logrecorder) << "Segment may be damaged:" << fileName;
+    qCDebug(logrecorder) << "Segment saved to:" << fileName;
+    emit segmentFinished(fileName);
+}
+
+void Recorder::releaseBuffers()
+{
+    m_encoder->requestStop();
+    m_encoder->wait();
+
+    qDeleteAll(m_buffers);
+    m_buffers.clear();
+    delete m_shmPool;
+    m_shmPool = nullptr;
 }
 
 void Recorder::handleShutDown()
@@ -244,49 +449,65 @@ void Recorder::handleShutDown()
     }
     m_shutdown = true;
 
-    qCDebug(logrecorder) << "File saved to:" << stop();
+    // A recording being saved quits the application once the file is complete.
+    if (m_status == StatusSaving || stop())
+        return;
     qGuiApp->sendEvent(qGuiApp, new QEvent(QEvent::Quit));
 }
 
 void Recorder::recordFrame()
 {
-    Buffer *buf = nullptr;
-    for (Buffer *b : m_buffers) {
-        if (!b->busy) {
-            buf = b;
-            break;
-        }
+    int index = m_encoder->acquireBuffer();
+    if (index < 0) {
+        // Ask to be notified first, then retry: a buffer released in between
+        // would otherwise not wake us up.
+        m_encoder->setStarving(true);
+        index = m_encoder->acquireBuffer();
     }
-    if (buf) {
-        lipstick_recorder_record_frame(m_recorder, buf->buffer);
-        wl_display_flush(m_display);
-        buf->busy = true;
-        m_starving = false;
+    if (index >= 0) {
+        recordInto(index);
     } else {
-        qCWarning(logrecorder) << "No free buffers.";
+        if (!m_starving)
+            overflow();
         m_starving = true;
     }
 }
 
-void Recorder::saveFrame()
+void Recorder::recordInto(int index)
 {
-    if (!m_lastFrame) {
-        return;
-    }
+    lipstick_recorder_record_frame(m_recorder, m_buffers.at(index)->buffer);
+    wl_display_flush(m_display);
+    m_encoder->setStarving(false);
+    m_starving = false;
+}
 
-    if (m_shutdown) {
-        return;
+/**
+ * Called once each time the capture runs out of buffers. Dropping policies
+ * count where the frame is dropped.
+ */
+void Recorder::overflow()
+{
+    switch (m_options.overflow) {
+    case OverflowBlock:
+        qCWarning(logrecorder) << "No free buffers.";
+        ++m_overflowStats.blocked;
+        break;
+    case OverflowDegrade:
+        qCWarning(logrecorder) << "No free buffers, lowering the load.";
+        ++m_overflowStats.degraded;
+        m_controller->degrade();
+        break;
+    case OverflowDropOldest:
+    case OverflowDropNewest:
+        break;
     }
+}
 
-    QAviWriter *avi = m_avi;
-    QPixmap pix = m_lastFrame->pixmap;
-    int quality = m_options.quality;
-    QtConcurrent::run(m_pool, [avi, pix, quality] {
-        avi->addFrame(pix, "JPG", quality);
-    });
-    if (m_starving)
+void Recorder::buffersReleased()
+{
+    m_encoder->clearReleased();
+    if (m_starving && m_recorder && !m_shutdown)
         recordFrame();
-    m_timer->start();
 }
 
 void Recorder::callback(void *data, wl_callback *cb, uint32_t time)
@@ -295,8 +516,6 @@ void Recorder::callback(void *data, wl_callback *cb, uint32_t time)
     wl_callback_destroy(cb);
 
     Recorder *rec = static_cast<Recorder *>(data);
-    QMutexLocker lock(&rec->m_mutex);
-
     rec->setStatus(StatusReady);
 
     if (!rec->m_options.daemonize) {
@@ -306,18 +525,67 @@ void Recorder::callback(void *data, wl_callback *cb, uint32_t time)
 
 void Recorder::setup(void *data, lipstick_recorder *recorder, int width, int height, int stride, int format)
 {
+    Q_UNUSED(recorder)
+    Q_UNUSED(format)
+
     Recorder *rec = static_cast<Recorder *>(data);
-    QMutexLocker lock(&rec->m_mutex);
+    rec->releaseBuffers();
+
+    const size_t bufferSize = ShmPool::alignedSize(size_t(stride) * size_t(height));
+    int count = rec->m_options.buffers;
+    if (rec->m_options.maxQueueMb > 0) {
+        const quint64 budget = (quint64(rec->m_options.maxQueueMb) << 20) / bufferSize;
+        if (budget < quint64(count)) {
+            count = qMax(int(budget), MinBuffers);
+            qCDebug(logrecorder) << "Queue budget of" << rec->m_options.maxQueueMb << "MB allows" << count << "buffers";
+        }
+    }
 
-    for (int i = 0; i < rec->m_options.buffers; ++i) {
-        Buffer *buffer = Buffer::create(rec->m_shm, width, height, stride, format);
+    const ShmPool::Flags poolFlags = rec->m_options.prefault ? ShmPool::Populate | ShmPool::HugePages
+                                                             : ShmPool::NoFlags;
+    rec->m_shmPool = ShmPool::create(rec->m_shm, bufferSize * size_t(count), poolFlags);
+    if (!rec->m_shmPool)
+        qFatal("Failed to create the buffer pool.");
+
+    for (int i = 0; i < count; ++i) {
+        Buffer *buffer = Buffer::create(rec->m_shmPool, i, bufferSize * size_t(i), width, height, stride);
         if (!buffer)
             qFatal("Failed to create a buffer.");
         rec->m_buffers << buffer;
     }
+
+    rec->m_encoder->setBuffers(rec->m_buffers);
+    rec->setupEncoder();
+    if (!rec->m_spoolName.isEmpty() && !rec->m_spool) {
+        rec->m_spool = SpoolWriter::create(rec->m_spoolName, width, height, stride);
+        if (!rec->m_spool) {
+            qCWarning(logrecorder) << "Encoding while recording instead of spooling";
+            rec->m_spoolName.clear();
+        }
+    }
+    rec->m_encoder->setSpool(rec->m_spool);
+    rec->m_encoder->setDropOldest(rec->m_options.overflow == OverflowDropOldest);
+    rec->m_encoder->start();
+    // Spooling keeps up without lowering the quality or the framerate.
+    if (!rec->m_spool)
+        rec->m_controller->start(rec->m_options.quality, rec->m_options.minQuality,
+                                 rec->m_options.fps, rec->m_options.minFps, count);
+
     rec->recordFrame();
 }
 
+void Recorder::setupEncoder()
+{
+    m_encoder->setSettings({
+        m_size,
+        m_options.scale,
+        m_options.smooth,
+        m_options.quality,
+        m_options.encoders,
+        m_options.stripes,
+    });
+}
+
 void Recorder::frame(void *data, lipstick_recorder *recorder, wl_buffer *buffer, uint32_t timestamp, int transform)
 {
     Q_UNUSED(recorder)
@@ -328,28 +596,23 @@ void Recorder::frame(void *data, lipstick_recorder *recorder, wl_buffer *buffer,
     }
 
     rec->recordFrame();
-    static uint32_t time = 0;
 
-    QMutexLocker lock(&rec->m_mutex);
-    Buffer *buf = static_cast<Buffer *>(wl_buffer_get_user_data(buffer));
-    QImage img = transform == LIPSTICK_RECORDER_TRANSFORM_Y_INVERTED ? buf->image.mirrored(false, true) : buf->image;
-    if (rec->m_options.scale != 1.0f) {
-        img = img.scaled(rec->m_size, Qt::KeepAspectRatio, rec->m_options.smooth ? Qt::SmoothTransformation : Qt::FastTransformation).convertToFormat(QImage::Format_RGBA8888);
-    }
-    buf->pixmap = QPixmap::fromImage(img);;
-    QAviWriter *avi = rec->m_avi;
-    QPixmap pix = buf->pixmap;
-    int quality = rec->m_options.quality;
-    QtConcurrent::run(rec->m_pool, [avi, pix, quality] {
-        avi->addFrame(pix, "JPG", quality);
-    });
-    if (rec->m_options.fullMode) {
-        rec->m_timer->start();
-        rec->m_lastFrame = buf;
+    const Buffer *buf = static_cast<Buffer *>(wl_buffer_get_user_data(buffer));
+    if (rec->m_starving && rec->m_options.overflow == OverflowDropNewest) {
+        // Nothing is free, the new frame is not encoded and its buffer takes the next capture.
+        ++rec->m_overflowStats.droppedNewest;
+        rec->recordInto(buf->index);
+        return;
     }
-    buf->busy = false;
 
-    time = timestamp;
+    FrameDescriptor frame;
+    frame.type = FrameDescriptor::Frame;
+    frame.buffer = buf->index;
+    frame.timestamp = timestamp;
+    frame.transform = transform;
+    rec->m_scheduler->addFrame(frame);
+    if (rec->m_audio)
+        rec->m_audio->setOrigin(rec->m_scheduler->originTime());
 }
 
 void Recorder::failed(void *data, lipstick_recorder *recorder, int result, wl_buffer *buffer)
@@ -367,9 +630,11 @@ void Recorder::cancel(void *data, lipstick_recorder *recorder, wl_buffer *buffer
 
     Recorder *rec = static_cast<Recorder *>(data);
 
-    QMutexLocker lock(&rec->m_mutex);
-    Buffer *buf = static_cast<Buffer *>(wl_buffer_get_user_data(buffer));
-    buf->busy = false;
+    const Buffer *buf = static_cast<Buffer *>(wl_buffer_get_user_data(buffer));
+    FrameDescriptor release;
+    release.type = FrameDescriptor::Release;
+    release.buffer = buf->index;
+    rec->m_encoder->submit(release);
 }
 
 void Recorder::global(void *data, wl_registry *registry, uint32_t id, const char *interface, uint32_t version)
@@ -17,14 +17,16 @@
 #define LIPSTICKRECORDER_RECORDER_H
 
 #include <QObject>
-#include <QMutex>
+#include <QSize>
 #include <wayland-client.h>
-#include <QImage>
-#include <QPixmap>
 
 class QScreen;
+class QSocketNotifier;
 class QAviWriter;
-class QThreadPool;
+class AudioCapture;
+class SpoolTranscoder;
+class SpoolWriter;
+class QTimer;
 
 struct wl_display;
 struct wl_registry;
@@ -32,11 +34,29 @@ struct lipstick_recorder_manager;
 struct lipstick_recorder;
 
 class Buffer;
+class EncoderThread;
+class FrameScheduler;
+class LoadController;
+class ShmPool;
 
 class Recorder : public QObject
 {
     Q_OBJECT
 public:
+    // What happens when a frame arrives while every capture buffer is taken.
+    enum Overflow {
+        OverflowBlock,      // stop capturing until the encoder frees a buffer
+        OverflowDropOldest, // the oldest queued frame gives up its buffer
+        OverflowDropNewest, // the frame just received gives its buffer back to the compositor
+        OverflowDegrade,    // block, and have the load controller step down right away
+    };
+
+    // File format of the recording.
+    enum Container {
+        ContainerAvi,
+        ContainerMatroska,
+    };
+
     struct Options {
         QString destination;
         int fps;
@@ -45,9 +65,30 @@ public:
         double scale;
         int quality;
         bool smooth;
+        int encoders;
+        int stripes;
+        int minQuality; // lower bounds for the load controller
+        int minFps;
+        int maxQueueMb; // capture buffer budget, 0 for only the buffer count
+        bool prefault; // fault the buffers in ahead of the capture, on huge pages where possible
+        Overflow overflow;
+        int checkpoint; // seconds between checkpoints of the file, 0 for none
+        int segmentSeconds; // limits of one file when recording in segments, 0 for none
+        int segmentMb;
+        Container container;
+        QString audio; // AudioSource spec, empty for no audio
+        bool spool; // encode after the recording stopped
         bool daemonize;
     };
 
+    // How often each overflow policy acted during the current recording.
+    struct OverflowStats {
+        quint64 blocked = 0;
+        quint64 droppedOldest = 0;
+        quint64 droppedNewest = 0;
+        quint64 degraded = 0;
+    };
+
     explicit Recorder(const Options &options, QObject *parent = nullptr);
     static Recorder *instance();
     virtual ~Recorder();
@@ -63,19 +104,36 @@ public:
     void setStatus(Status status);
 
     static Options readOptions();
+    static Overflow overflowFromName(const QString &name, bool *ok = nullptr);
+    static QString overflowName(Overflow overflow);
+    static Container containerFromName(const QString &name, bool *ok = nullptr);
+    static QString containerName(Container container);
+    // Repairs a recording that was interrupted before it was finished.
+    static bool recover(const QString &fileName);
+
+    OverflowStats overflowStats() const;
 
 signals:
     void statusChanged(Status status);
+    // Emitted periodically while StatusSaving, until the file is complete.
+    void saveProgress(int framesRemaining, qint64 bytesWritten);
+    void recordingFinished(const QString &fileName);
+    // A segment of a recording is complete, the last one comes before recordingFinished().
+    void segmentFinished(const QString &fileName);
 
 public slots:
     void init();
     void start();
-    QString stop();
+    // Returns right away, the file is finished in the background.
+    bool stop();
     void handleShutDown();
 
 private slots:
     void recordFrame();
-    void saveFrame();
+    void buffersReleased();
+    void reportProgress();
+    void finishSaving();
+    void segmentSaved(const QString &fileName, bool ok);
 
 private:
     static void global(void *data, wl_registry *registry, uint32_t id, const char *interface, uint32_t version);
@@ -86,6 +144,12 @@ private:
     static void failed(void *data, lipstick_recorder *recorder, int result, wl_buffer *buffer);
     static void cancel(void *data, lipstick_recorder *recorder, wl_buffer *buffer);
 
+    void releaseBuffers();
+    void recordInto(int index);
+    void overflow();
+    void setupEncoder();
+    bool transcode();
+
     wl_display *m_display = nullptr;
     wl_registry *m_registry = nullptr;
     wl_shm *m_shm = nullptr;
@@ -93,18 +157,25 @@ private:
     lipstick_recorder *m_recorder = nullptr;
     QScreen *m_screen = nullptr;
     QSize m_size;
+    ShmPool *m_shmPool = nullptr;
     QList<Buffer *> m_buffers;
-    Buffer *m_lastFrame = nullptr;
     bool m_starving = false;
-    QMutex m_mutex;
+    OverflowStats m_overflowStats;
 
     QAviWriter *m_avi = nullptr;
+    AudioCapture *m_audio = nullptr;
+    QString m_spoolName;
+    SpoolWriter *m_spool = nullptr;
+    SpoolTranscoder *m_transcoder = nullptr;
+    QSocketNotifier *m_releasedNotifier = nullptr;
     bool m_shutdown = false;
 
     Options m_options;
 
-    QThreadPool *m_pool;
-    QTimer *m_timer;
+    EncoderThread *m_encoder;
+    FrameScheduler *m_scheduler;
+    LoadController *m_controller;
+    QTimer *m_progressTimer;
 
     Status m_status = StatusIdle;
 
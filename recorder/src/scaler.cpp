@@ -0,0 +1,365 @@
+#include "scaler.h"
+
+#include <cmath>
+#include <vector>
+
+#if defined(__i386__) || defined(__x86_64__)
+#define SCALER_X86
+#include <emmintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SCALER_NEON
+#include <arm_neon.h>
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+#endif
+
+// Filter weights are 14 bit fixed point, the vertical pass keeps 6 fractional bits.
+static const int s_weightBits = 14;
+static const int s_verticalShift = 8;
+static const int s_horizontalShift = s_weightBits * 2 - s_verticalShift;
+
+typedef void (*VerticalFunction)(const uchar *const *rows, const qint16 *weights, int taps, qint16 *out, int bytes);
+typedef void (*AccumulateFunction)(const uchar *src, quint16 *acc, int bytes);
+
+static void verticalScalar(const uchar *const *rows, const qint16 *weights, int taps, qint16 *out, int bytes)
+{
+    for (int i = 0; i < bytes; ++i) {
+        int acc = 0;
+        for (int k = 0; k < taps; ++k)
+            acc += weights[k] * rows[k][i];
+        acc = (acc + (1 << (s_verticalShift - 1))) >> s_verticalShift;
+        out[i] = qint16(qBound(-32768, acc, 32767));
+    }
+}
+
+static void accumulateScalar(const uchar *src, quint16 *acc, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+        acc[i] += src[i];
+}
+
+#ifdef SCALER_X86
+__attribute__((target("sse2")))
+static void verticalSse2(const uchar *const *rows, const qint16 *weights, int taps, qint16 *out, int bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rounding = _mm_set1_epi32(1 << (s_verticalShift - 1));
+
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        __m128i acc0 = _mm_setzero_si128();
+        __m128i acc1 = _mm_setzero_si128();
+        __m128i acc2 = _mm_setzero_si128();
+        __m128i acc3 = _mm_setzero_si128();
+        // Two source rows per step, pmaddwd multiplies and adds the interleaved pair.
+        for (int k = 0; k < taps; k += 2) {
+            const bool pair = k + 1 < taps;
+            const quint16 w0 = quint16(weights[k]);
+            const quint16 w1 = pair ? quint16(weights[k + 1]) : 0;
+            const __m128i w = _mm_set1_epi32(int(quint32(w1) << 16 | w0));
+            const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k] + i));
+            const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[pair ? k + 1 : k] + i));
+            const __m128i aLow = _mm_unpacklo_epi8(a, zero);
+            const __m128i aHigh = _mm_unpackhi_epi8(a, zero);
+            const __m128i bLow = _mm_unpacklo_epi8(b, zero);
+            const __m128i bHigh = _mm_unpackhi_epi8(b, zero);
+            acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(_mm_unpacklo_epi16(aLow, bLow), w));
+            acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(_mm_unpackhi_epi16(aLow, bLow), w));
+            acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(_mm_unpacklo_epi16(aHigh, bHigh), w));
+            acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(_mm_unpackhi_epi16(aHigh, bHigh), w));
+        }
+        acc0 = _mm_srai_epi32(_mm_add_epi32(acc0, rounding), s_verticalShift);
+        acc1 = _mm_srai_epi32(_mm_add_epi32(acc1, rounding), s_verticalShift);
+        acc2 = _mm_srai_epi32(_mm_add_epi32(acc2, rounding), s_verticalShift);
+        acc3 = _mm_srai_epi32(_mm_add_epi32(acc3, rounding), s_verticalShift);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packs_epi32(acc0, acc1));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i + 8), _mm_packs_epi32(acc2, acc3));
+    }
+
+    if (i < bytes) {
+        const uchar *tail[64];
+        for (int k = 0; k < taps; ++k)
+            tail[k] = rows[k] + i;
+        verticalScalar(tail, weights, taps, out + i, bytes - i);
+    }
+}
+
+__attribute__((target("sse2")))
+static void accumulateSse2(const uchar *src, quint16 *acc, int bytes)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+        __m128i *dst = reinterpret_cast<__m128i *>(acc + i);
+        _mm_storeu_si128(dst, _mm_add_epi16(_mm_loadu_si128(dst), _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128(dst + 1, _mm_add_epi16(_mm_loadu_si128(dst + 1), _mm_unpackhi_epi8(v, zero)));
+    }
+    accumulateScalar(src + i, acc + i, bytes - i);
+}
+#endif
+
+#ifdef SCALER_NEON
+static void verticalNeon(const uchar *const *rows, const qint16 *weights, int taps, qint16 *out, int bytes)
+{
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        int32x4_t acc0 = vdupq_n_s32(0);
+        int32x4_t acc1 = vdupq_n_s32(0);
+        int32x4_t acc2 = vdupq_n_s32(0);
+        int32x4_t acc3 = vdupq_n_s32(0);
+        for (int k = 0; k < taps; ++k) {
+            const uint8x16_t v = vld1q_u8(rows[k] + i);
+            const int16x8_t low = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v)));
+            const int16x8_t high = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v)));
+            acc0 = vmlal_n_s16(acc0, vget_low_s16(low), weights[k]);
+            acc1 = vmlal_n_s16(acc1, vget_high_s16(low), weights[k]);
+            acc2 = vmlal_n_s16(acc2, vget_low_s16(high), weights[k]);
+            acc3 = vmlal_n_s16(acc3, vget_high_s16(high), weights[k]);
+        }
+        vst1q_s16(out + i, vcombine_s16(vqrshrn_n_s32(acc0, s_verticalShift), vqrshrn_n_s32(acc1, s_verticalShift)));
+        vst1q_s16(out + i + 8, vcombine_s16(vqrshrn_n_s32(acc2, s_verticalShift), vqrshrn_n_s32(acc3, s_verticalShift)));
+    }
+
+    if (i < bytes) {
+        const uchar *tail[64];
+        for (int k = 0; k < taps; ++k)
+            tail[k] = rows[k] + i;
+        verticalScalar(tail, weights, taps, out + i, bytes - i);
+    }
+}
+
+static void accumulateNeon(const uchar *src, quint16 *acc, int bytes)
+{
+    int i = 0;
+    for (; i + 16 <= bytes; i += 16) {
+        const uint8x16_t v = vld1q_u8(src + i);
+        vst1q_u16(acc + i, vaddw_u8(vld1q_u16(acc + i), vget_low_u8(v)));
+        vst1q_u16(acc + i + 8, vaddw_u8(vld1q_u16(acc + i + 8), vget_high_u8(v)));
+    }
+    accumulateScalar(src + i, acc + i, bytes - i);
+}
+#endif
+
+struct Kernels {
+    VerticalFunction vertical;
+    AccumulateFunction accumulate;
+};
+
+static Kernels selectKernels()
+{
+#ifdef SCALER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2"))
+        return { verticalSse2, accumulateSse2 };
+#endif
+#ifdef SCALER_NEON
+#if !defined(__aarch64__)
+    if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+        return { verticalNeon, accumulateNeon };
+#endif
+    return { verticalScalar, accumulateScalar };
+}
+
+static const Kernels &kernels()
+{
+    static const Kernels selected = selectKernels();
+    return selected;
+}
+
+static inline quint32 packRgb32(int r, int g, int b)
+{
+    return 0xff000000u | quint32(r) << 16 | quint32(g) << 8 | quint32(b);
+}
+
+static double lanczos2(double x)
+{
+    x = std::fabs(x);
+    if (x < 1e-8)
+        return 1.0;
+    if (x >= 2.0)
+        return 0.0;
+    const double pix = M_PI * x;
+    return 2.0 * std::sin(pix) * std::sin(pix / 2.0) / (pix * pix);
+}
+
+void Scaler::setup(const QSize &source, const QSize &destination, bool smooth)
+{
+    m_source = source;
+    m_destination = destination;
+    m_factor = 1;
+    m_horizontal = Contributions();
+    m_vertical = Contributions();
+
+    if (source == destination || destination.isEmpty()) {
+        m_filter = None;
+        return;
+    }
+
+    for (int factor : { 2, 4 }) {
+        if (destination.width() * factor == source.width() && destination.height() * factor == source.height()) {
+            m_filter = Box;
+            m_factor = factor;
+            return;
+        }
+    }
+
+    m_filter = smooth ? Lanczos : Bilinear;
+    m_horizontal = contributions(source.width(), destination.width(), m_filter);
+    m_vertical = contributions(source.height(), destination.height(), m_filter);
+}
+
+const char *Scaler::filterName(Filter filter)
+{
+    switch (filter) {
+    case None:
+        return "none";
+    case Box:
+        return "box";
+    case Bilinear:
+        return "bilinear";
+    case Lanczos:
+        return "lanczos2";
+    }
+    return "unknown";
+}
+
+/**
+ * Precomputes the taps for one axis. Windows that cross the image edge are
+ * clamped, the weights of the missing samples fold onto the edge pixel.
+ */
+Scaler::Contributions Scaler::contributions(int source, int destination, Filter filter)
+{
+    Contributions c;
+    const double ratio = double(source) / double(destination);
+    const double filterScale = filter == Lanczos ? qMax(ratio, 1.0) : 1.0;
+    const double support = filter == Lanczos ? 2.0 * filterScale : 1.0;
+    c.taps = qMin(int(std::ceil(support * 2.0)) + 1, qMin(source, 64));
+    if (filter == Bilinear)
+        c.taps = qMin(2, source);
+
+    c.first.resize(destination);
+    c.weights.resize(destination * c.taps);
+
+    std::vector<double> weights(size_t(c.taps));
+    for (int i = 0; i < destination; ++i) {
+        const double center = (i + 0.5) * ratio - 0.5;
+        const int start = filter == Bilinear ? int(std::floor(center)) : int(std::floor(center - support)) + 1;
+        const int first = qBound(0, start, source - c.taps);
+        std::fill(weights.begin(), weights.end(), 0.0);
+
+        const int samples = filter == Bilinear ? 2 : c.taps;
+        double sum = 0.0;
+        for (int j = start; j < start + samples; ++j) {
+            const double distance = j - center;
+            const double w = filter == Bilinear ? qMax(0.0, 1.0 - std::fabs(distance))
+                                                : lanczos2(distance / filterScale);
+            const int index = qBound(0, j, source - 1) - first;
+            weights[size_t(qBound(0, index, c.taps - 1))] += w;
+            sum += w;
+        }
+
+        qint16 *fixed = c.weights.data() + i * c.taps;
+        int total = 0;
+        int largest = 0;
+        for (int t = 0; t < c.taps; ++t) {
+            fixed[t] = qint16(qRound(weights[size_t(t)] / sum * (1 << s_weightBits)));
+            total += fixed[t];
+            if (fixed[t] > fixed[largest])
+                largest = t;
+        }
+        // Make the taps sum up exactly, so flat areas stay flat.
+        fixed[largest] = qint16(fixed[largest] + (1 << s_weightBits) - total);
+        c.first[i] = first;
+    }
+    return c;
+}
+
+void Scaler::scale(const uchar *src, qptrdiff srcStride, uchar *dst, int dstStride) const
+{
+    scale(src, srcStride, dst, dstStride, 0, m_destination.height());
+}
+
+void Scaler::scale(const uchar *src, qptrdiff srcStride, uchar *dst, int dstStride, int rowBegin, int rowEnd) const
+{
+    switch (m_filter) {
+    case None:
+        break;
+    case Box:
+        scaleBox(src, srcStride, dst, dstStride, rowBegin, rowEnd);
+        break;
+    case Bilinear:
+    case Lanczos:
+        scaleSeparable(src, srcStride, dst, dstStride, rowBegin, rowEnd);
+        break;
+    }
+}
+
+void Scaler::scaleBox(const uchar *src, qptrdiff srcStride, uchar *dst, int dstStride, int rowBegin, int rowEnd) const
+{
+    const AccumulateFunction accumulate = kernels().accumulate;
+    const int factor = m_factor;
+    const int shift = factor == 2 ? 2 : 4;
+    const int rounding = 1 << (shift - 1);
+    const int bytes = m_source.width() * 4;
+    std::vector<quint16> acc(static_cast<size_t>(bytes));
+
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        std::fill(acc.begin(), acc.end(), 0);
+        for (int k = 0; k < factor; ++k)
+            accumulate(src + qptrdiff(y * factor + k) * srcStride, acc.data(), bytes);
+
+        quint32 *out = reinterpret_cast<quint32 *>(dst + qptrdiff(y) * dstStride);
+        const quint16 *in = acc.data();
+        for (int x = 0; x < m_destination.width(); ++x) {
+            int sum[3] = { 0, 0, 0 };
+            for (int k = 0; k < factor; ++k, in += 4) {
+                sum[0] += in[0];
+                sum[1] += in[1];
+                sum[2] += in[2];
+            }
+            out[x] = packRgb32((sum[0] + rounding) >> shift, (sum[1] + rounding) >> shift, (sum[2] + rounding) >> shift);
+        }
+    }
+}
+
+void Scaler::scaleSeparable(const uchar *src, qptrdiff srcStride, uchar *dst, int dstStride, int rowBegin, int rowEnd) const
+{
+    const VerticalFunction vertical = kernels().vertical;
+    const int bytes = m_source.width() * 4;
+    const int rounding = 1 << (s_horizontalShift - 1);
+    std::vector<qint16> row(static_cast<size_t>(bytes));
+    const uchar *rows[64];
+
+    for (int y = rowBegin; y < rowEnd; ++y) {
+        const int first = m_vertical.first.at(y);
+        for (int k = 0; k < m_vertical.taps; ++k)
+            rows[k] = src + qptrdiff(first + k) * srcStride;
+        vertical(rows, m_vertical.weights.constData() + y * m_vertical.taps, m_vertical.taps, row.data(), bytes);
+
+        quint32 *out = reinterpret_cast<quint32 *>(dst + qptrdiff(y) * dstStride);
+        const qint16 *weights = m_horizontal.weights.constData();
+        for (int x = 0; x < m_destination.width(); ++x, weights += m_horizontal.taps) {
+            const qint16 *in = row.data() + m_horizontal.first.at(x) * 4;
+            int r = 0;
+            int g = 0;
+            int b = 0;
+            for (int t = 0; t < m_horizontal.taps; ++t, in += 4) {
+                r += weights[t] * in[0];
+                g += weights[t] * in[1];
+                b += weights[t] * in[2];
+            }
+            out[x] = packRgb32(qBound(0, (r + rounding) >> s_horizontalShift, 255),
+                               qBound(0, (g + rounding) >> s_horizontalShift, 255),
+                               qBound(0, (b + rounding) >> s_horizontalShift, 255));
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef SCALER_H
+#define SCALER_H
+
+#include <QSize>
+#include <QVector>
+
+/**
+ * Downscales captured frames for the "scale" option. Coefficients are computed
+ * once in setup() for a fixed source and destination size, scale() then only
+ * runs the integer kernels.
+ *
+ * Input is the shm buffer in RGBA8888 byte order, output is QImage::Format_RGB32,
+ * so the channel swizzle is folded into the last pass.
+ */
+class Scaler
+{
+public:
+    enum Filter {
+        None,
+        Box,      // exact 2x or 4x reduction
+        Bilinear, // two taps per axis
+        Lanczos,  // Lanczos2 windowed sinc, used for smooth scaling
+    };
+
+    void setup(const QSize &source, const QSize &destination, bool smooth);
+
+    Filter filter() const { return m_filter; }
+    // Reduction factor of the Box filter, 1 otherwise.
+    int factor() const { return m_factor; }
+    QSize sourceSize() const { return m_source; }
+    QSize destinationSize() const { return m_destination; }
+
+    // @p srcStride may be negative to walk a Y-inverted buffer bottom-up.
+    void scale(const uchar *src, qptrdiff srcStride, uchar *dst, int dstStride) const;
+    void scale(const uchar *src, qptrdiff srcStride, uchar *dst, int dstStride, int rowBegin, int rowEnd) const;
+
+    static const char *filterName(Filter filter);
+
+private:
+    struct Contributions {
+        QVector<int> first;     // first source index per output index
+        QVector<qint16> weights; // taps weights per output index, 14 bit fixed point
+        int taps = 0;
+    };
+
+    static Contributions contributions(int source, int destination, Filter filter);
+
+    void scaleBox(const uchar *src, qptrdiff srcStride, uchar *dst, int dstStride, int rowBegin, int rowEnd) const;
+    void scaleSeparable(const uchar *src, qptrdiff srcStride, uchar *dst, int dstStride, int rowBegin, int rowEnd) const;
+
+    Filter m_filter = None;
+    QSize m_source;
+    QSize m_destination;
+    int m_factor = 1;
+    Contributions m_horizontal;
+    Contributions m_vertical;
+};
+
+#endif // SCALER_H
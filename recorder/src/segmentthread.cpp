@@ -0,0 +1,69 @@
+#include "segmentthread.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "eventfd.h"
+
+// A few closed segments may wait for the one being finalized.
+static const size_t TaskCapacity = 8;
+
+SegmentThread::SegmentThread(QObject *parent)
+    : QThread(parent)
+    , m_tasks(TaskCapacity)
+    , m_wakeFd(eventfd(0, EFD_CLOEXEC))
+    , m_doneFd(eventfd(0, EFD_CLOEXEC))
+{
+    if (m_wakeFd < 0 || m_doneFd < 0)
+        qFatal("Failed to create segment eventfd.");
+}
+
+SegmentThread::~SegmentThread()
+{
+    requestStop();
+    wait();
+
+    close(m_wakeFd);
+    close(m_doneFd);
+}
+
+void SegmentThread::post(const std::function<void()> &task)
+{
+    if (!m_tasks.push(task)) {
+        waitForTasks();
+        m_tasks.push(task);
+    }
+    ++m_posted;
+    signalEventFd(m_wakeFd);
+}
+
+void SegmentThread::waitForTasks()
+{
+    // The counter of the eventfd keeps a completion that happens between the
+    // check and the read, so the read cannot miss it.
+    while (m_done.load(std::memory_order_acquire) < m_posted)
+        drainEventFd(m_doneFd);
+}
+
+void SegmentThread::requestStop()
+{
+    m_stop.store(true, std::memory_order_release);
+    signalEventFd(m_wakeFd);
+}
+
+void SegmentThread::run()
+{
+    forever {
+        std::function<void()> task;
+        while (m_tasks.pop(task)) {
+            task();
+            m_done.fetch_add(1, std::memory_order_release);
+            signalEventFd(m_doneFd);
+        }
+
+        if (m_stop.load(std::memory_order_acquire) && m_tasks.isEmpty())
+            break;
+
+        drainEventFd(m_wakeFd);
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef SEGMENTTHREAD_H
+#define SEGMENTTHREAD_H
+
+#include <QThread>
+
+#include <atomic>
+#include <functional>
+
+#include "spscring.h"
+
+/**
+ * Runs the slow parts of splitting a recording into segments off the muxer:
+ * opening the next file ahead of time and finalizing the ones that are done.
+ * Tasks run one after the other in the order they were posted. Only one thread
+ * at a time may post tasks and wait for them.
+ */
+class SegmentThread : public QThread
+{
+public:
+    explicit SegmentThread(QObject *parent = nullptr);
+    virtual ~SegmentThread();
+
+    void post(const std::function<void()> &task);
+    // Waits until every task posted so far has run.
+    void waitForTasks();
+    void requestStop();
+
+protected:
+    void run() override;
+
+private:
+    SpscRing<std::function<void()>> m_tasks;
+    int m_wakeFd = -1;
+    int m_doneFd = -1;
+    quint64 m_posted = 0;
+    std::atomic<quint64> m_done{0};
+    std::atomic<bool> m_stop{false};
+};
+
+#endif // SEGMENTTHREAD_H
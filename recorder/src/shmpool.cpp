@@ -0,0 +1,218 @@
+#include "shmpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <QLoggingCategory>
+#include <QThread>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+Q_LOGGING_CATEGORY(logshmpool, "screenrecorder.recorder.shmpool", QtDebugMsg)
+Q_LOGGING_CATEGORY(logbuffer, "screenrecorder.recorder.buffer", QtDebugMsg)
+
+/**
+ * Faults the pages of a pool in without changing their contents, so it may run
+ * while the compositor already writes the first frames. Works in chunks to stop
+ * early when the pool goes away.
+ */
+class Prefaulter : public QThread
+{
+public:
+    Prefaulter(uchar *data, size_t size)
+        : m_data(data)
+        , m_size(size)
+    {
+    }
+
+protected:
+    void run() override
+    {
+        static const size_t chunk = 4 << 20;
+        static const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+        // MADV_POPULATE_WRITE needs Linux 5.14, a read fault allocates shmem pages as well.
+        bool populate = true;
+        for (size_t offset = 0; offset < m_size && !isInterruptionRequested(); offset += chunk) {
+            const size_t length = qMin(chunk, m_size - offset);
+            if (populate && madvise(m_data + offset, length, MADV_POPULATE_WRITE) == 0)
+                continue;
+            populate = false;
+            for (size_t page = 0; page < length; page += pageSize)
+                (void)*static_cast<volatile uchar *>(m_data + offset + page);
+        }
+        qCDebug(logshmpool) << "prefaulted" << m_size << "B";
+    }
+
+private:
+    uchar *m_data;
+    size_t m_size;
+};
+
+/**
+ * Creates a single shared memory pool of at least @p size bytes and maps it.
+ * All capture buffers are carved from it by offset, see createBuffer().
+ *
+ * @return the pool or nullptr if the backing file could not be created or mapped.
+ */
+ShmPool *ShmPool::create(wl_shm *shm, size_t size, Flags flags)
+{
+    size = alignedSize(size);
+    if (size > size_t(INT32_MAX)) {
+        qCWarning(logshmpool) << "pool size" << size << "B exceeds wl_shm limit";
+        return nullptr;
+    }
+
+    const int fd = createFile(size);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    uchar *data = static_cast<uchar *>(mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    if (data == static_cast<uchar *>(MAP_FAILED)) {
+        qCWarning(logshmpool) << "mmap failed:" << strerror(errno);
+        close(fd);
+        return nullptr;
+    }
+
+    if (flags & HugePages) {
+        // Only honoured when shmem transparent hugepages are set to "advise", and
+        // only for pages faulted in afterwards.
+        if (madvise(data, size, MADV_HUGEPAGE) < 0) {
+            qCDebug(logshmpool) << "MADV_HUGEPAGE not available:" << strerror(errno);
+        }
+    }
+
+    ShmPool *pool = new ShmPool;
+    pool->m_pool = wl_shm_create_pool(shm, fd, int32_t(size));
+    pool->m_data = data;
+    pool->m_size = size;
+    close(fd);
+
+    // Faulting in a pool of a few hundred MB takes long enough to stall the
+    // caller, the capture does not wait for it.
+    if (flags & Populate) {
+        pool->m_prefaulter = new Prefaulter(data, size);
+        pool->m_prefaulter->start();
+    }
+
+    qCDebug(logshmpool) << "created pool of" << size << "B";
+    return pool;
+}
+
+ShmPool::~ShmPool()
+{
+    if (m_prefaulter) {
+        m_prefaulter->requestInterruption();
+        m_prefaulter->wait();
+        delete m_prefaulter;
+    }
+    if (m_pool) {
+        wl_shm_pool_destroy(m_pool);
+    }
+    if (m_data) {
+        munmap(m_data, m_size);
+    }
+}
+
+wl_buffer *ShmPool::createBuffer(size_t offset, int width, int height, int stride, uint32_t format)
+{
+    if (offset + size_t(stride) * size_t(height) > m_size) {
+        qCWarning(logshmpool) << "buffer at" << offset << "does not fit into the pool";
+        return nullptr;
+    }
+    return wl_shm_pool_create_buffer(m_pool, int32_t(offset), width, height, stride, format);
+}
+
+/**
+ * Rounds @p size up to the page size so that every buffer view starts page aligned.
+ */
+size_t ShmPool::alignedSize(size_t size)
+{
+    static const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+    return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+int ShmPool::createFile(size_t size)
+{
+    int fd = -1;
+    bool sealable = false;
+
+#ifdef __NR_memfd_create
+    fd = int(syscall(__NR_memfd_create, "lipstick-recorder-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+    sealable = fd >= 0;
+#endif
+
+    if (fd < 0) {
+        // Kernels without memfd_create, fall back to an unlinked temporary file.
+        char filename[] = "/tmp/lipstick-recorder-shm-XXXXXX";
+        fd = mkstemp(filename);
+        if (fd < 0) {
+            qCWarning(logshmpool) << "creating a buffer file for" << size << "B failed";
+            return -1;
+        }
+        unlink(filename);
+        int flags = fcntl(fd, F_GETFD);
+        if (flags != -1)
+            fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+    }
+
+    if (ftruncate(fd, off_t(size)) < 0) {
+        qCWarning(logshmpool) << "ftruncate failed:" << strerror(errno);
+        close(fd);
+        return -1;
+    }
+
+    if (sealable && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+        qCDebug(logshmpool) << "sealing failed:" << strerror(errno);
+    }
+
+    return fd;
+}
+
+/**
+ * Creates a view of @p pool starting at @p offset. The returned buffer does not
+ * own any memory, it only keeps the wl_buffer and a QImage wrapping its pixels.
+ */
+Buffer *Buffer::create(ShmPool *pool, int index, size_t offset, int width, int height, int stride)
+{
+    wl_buffer *buffer = pool->createBuffer(offset, width, height, stride, WL_SHM_FORMAT_ARGB8888);
+    if (!buffer) {
+        qCWarning(logbuffer) << "creating a buffer at" << offset << "failed";
+        return nullptr;
+    }
+
+    Buffer *buf = new Buffer;
+    buf->buffer = buffer;
+    wl_buffer_set_user_data(buf->buffer, buf);
+    buf->index = index;
+    buf->offset = offset;
+    buf->stride = stride;
+    buf->size = size_t(stride) * size_t(height);
+    buf->data = pool->data() + offset;
+    buf->image = QImage(buf->data, width, height, stride, QImage::Format_RGBA8888);
+    return buf;
+}
+
+Buffer::~Buffer()
+{
+    wl_buffer_destroy(buffer);
+}
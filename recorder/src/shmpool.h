@@ -0,0 +1,60 @@
+#ifndef SHMPOOL_H
+#define SHMPOOL_H
+
+#include <QAtomicInt>
+#include <QImage>
+
+#include <wayland-client.h>
+
+class QThread;
+
+class ShmPool
+{
+public:
+    enum Flag {
+        NoFlags = 0x0,
+        Populate = 0x1,  // fault the pages in on a background thread
+        HugePages = 0x2, // ask for transparent huge pages, before anything is faulted in
+    };
+    Q_DECLARE_FLAGS(Flags, Flag)
+
+    static ShmPool *create(wl_shm *shm, size_t size, Flags flags = NoFlags);
+    ~ShmPool();
+
+    wl_buffer *createBuffer(size_t offset, int width, int height, int stride, uint32_t format);
+
+    uchar *data() const { return m_data; }
+    size_t size() const { return m_size; }
+
+    static size_t alignedSize(size_t size);
+
+private:
+    ShmPool() = default;
+
+    static int createFile(size_t size);
+
+    wl_shm_pool *m_pool = nullptr;
+    uchar *m_data = nullptr;
+    size_t m_size = 0;
+    QThread *m_prefaulter = nullptr;
+};
+Q_DECLARE_OPERATORS_FOR_FLAGS(ShmPool::Flags)
+
+class Buffer
+{
+public:
+    static Buffer *create(ShmPool *pool, int index, size_t offset, int width, int height, int stride);
+    ~Buffer();
+
+    wl_buffer *buffer;
+    int index;
+    size_t offset;
+    int stride;
+    size_t size;
+    uchar *data;
+    QImage image;
+    // Number of FrameHandles referencing this buffer.
+    QAtomicInt refs;
+};
+
+#endif // SHMPOOL_H
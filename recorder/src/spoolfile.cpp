@@ -0,0 +1,314 @@
+// Spool files grow past 2 GB in long recordings, also on 32-bit targets.
+#define _FILE_OFFSET_BITS 64
+
+#include "spoolfile.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <lz4.h>
+
+#include <QFile>
+#include <QLoggingCategory>
+
+Q_LOGGING_CATEGORY(logspool, "screenrecorder.spool", QtDebugMsg)
+
+// Mapped at a time, a window also grows to hold at least one whole record.
+static const size_t WindowSize = 32 * 1024 * 1024;
+
+static const char SpoolMagic[8] = { 'S', 'R', 'S', 'P', 'O', 'O', 'L', '1' };
+
+struct SpoolHeader
+{
+    char magic[8];
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t reserved;
+    uint64_t records;
+    uint64_t end; // 0 until the writer was closed
+};
+
+struct SpoolRecord
+{
+    uint32_t type;
+    uint32_t size; // of the payload, without the padding
+    uint32_t timestamp;
+    int32_t transform;
+};
+
+static size_t padded(size_t size)
+{
+    return (size + 7) & ~size_t(7);
+}
+
+static int64_t pageStart(int64_t offset)
+{
+    static const int64_t pageSize = sysconf(_SC_PAGESIZE);
+    return offset - offset % pageSize;
+}
+
+static size_t pageAligned(size_t size)
+{
+    static const size_t pageSize = size_t(sysconf(_SC_PAGESIZE));
+    return (size + pageSize - 1) / pageSize * pageSize;
+}
+
+SpoolWriter::SpoolWriter(int fd, int width, int height, int stride)
+    : m_fd(fd)
+    , m_width(width)
+    , m_height(height)
+    , m_stride(stride)
+    , m_frameSize(size_t(stride) * size_t(height))
+    , m_offset(sizeof(SpoolHeader))
+{
+}
+
+SpoolWriter::~SpoolWriter()
+{
+    unmap();
+    if (m_fd >= 0)
+        ::close(m_fd);
+}
+
+SpoolWriter *SpoolWriter::create(const QString &fileName, int width, int height, int stride)
+{
+    if (size_t(stride) * size_t(height) > size_t(LZ4_MAX_INPUT_SIZE)) {
+        qCWarning(logspool) << "Frames of" << width << "x" << height << "are too large to spool";
+        return nullptr;
+    }
+
+    const int fd = ::open(QFile::encodeName(fileName).constData(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        qCWarning(logspool) << "Could not create" << fileName << "-" << strerror(errno);
+        return nullptr;
+    }
+    return new SpoolWriter(fd, width, height, stride);
+}
+
+bool SpoolWriter::addFrame(const uchar *data, size_t size, uint32_t timestamp, int transform)
+{
+    if (size != m_frameSize) {
+        qCWarning(logspool) << "Frame of" << size << "bytes does not match the spool," << m_frameSize << "expected";
+        return false;
+    }
+
+    const int bound = LZ4_compressBound(int(size));
+    char *out = reserve(sizeof(SpoolRecord) + size_t(bound));
+    if (!out)
+        return false;
+
+    const int compressed = LZ4_compress_default(reinterpret_cast<const char *>(data), out + sizeof(SpoolRecord),
+                                                int(size), bound);
+    if (compressed <= 0) {
+        qCWarning(logspool) << "Could not compress a frame";
+        return false;
+    }
+
+    const SpoolRecord record = { SpoolReader::Record::Frame, uint32_t(compressed), timestamp, transform };
+    memcpy(out, &record, sizeof(record));
+    m_offset += int64_t(padded(sizeof(record) + size_t(compressed)));
+    ++m_records;
+    return true;
+}
+
+bool SpoolWriter::addRepeat()
+{
+    char *out = reserve(sizeof(SpoolRecord));
+    if (!out)
+        return false;
+
+    const SpoolRecord record = { SpoolReader::Record::Repeat, 0, 0, 0 };
+    memcpy(out, &record, sizeof(record));
+    m_offset += int64_t(sizeof(record));
+    ++m_records;
+    return true;
+}
+
+bool SpoolWriter::close()
+{
+    unmap();
+
+    SpoolHeader header;
+    memcpy(header.magic, SpoolMagic, sizeof(header.magic));
+    header.width = uint32_t(m_width);
+    header.height = uint32_t(m_height);
+    header.stride = uint32_t(m_stride);
+    header.reserved = 0;
+    header.records = m_records;
+    header.end = uint64_t(m_offset);
+
+    const bool ok = ftruncate(m_fd, m_offset) == 0
+            && pwrite(m_fd, &header, sizeof(header), 0) == ssize_t(sizeof(header));
+    if (!ok)
+        qCWarning(logspool) << "Could not finish the spool file -" << strerror(errno);
+    ::close(m_fd);
+    m_fd = -1;
+    return ok;
+}
+
+/**
+ * Returns where @p size bytes at the current offset can be written, moving the
+ * window on when they do not fit the one mapped.
+ */
+char *SpoolWriter::reserve(size_t size)
+{
+    if (m_map && m_offset + int64_t(size) <= m_mapStart + int64_t(m_mapLength))
+        return m_map + (m_offset - m_mapStart);
+
+    unmap();
+
+    const int64_t start = pageStart(m_offset);
+    const size_t length = pageAligned(qMax(WindowSize, size_t(m_offset - start) + size));
+    // Real blocks, unlike a sparse file grown by ftruncate().
+    const int error = posix_fallocate(m_fd, start, int64_t(length));
+    if (error) {
+        qCWarning(logspool) << "Could not allocate spool space -" << strerror(error);
+        return nullptr;
+    }
+
+    void *map = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, start);
+    if (map == MAP_FAILED) {
+        qCWarning(logspool) << "Could not map the spool file -" << strerror(errno);
+        return nullptr;
+    }
+    m_map = static_cast<char *>(map);
+    m_mapStart = start;
+    m_mapLength = length;
+    return m_map + (m_offset - m_mapStart);
+}
+
+/**
+ * Hands the window just finished to writeback right away, then waits for the
+ * one before and drops it from the page cache, so the dirty and cached pages
+ * stay bounded by about two windows. Nothing reads the spool until it is closed.
+ * Failing here only costs memory, it is not an error.
+ */
+void SpoolWriter::unmap()
+{
+    if (!m_map)
+        return;
+    munmap(m_map, m_mapLength);
+    m_map = nullptr;
+
+    if (m_writebackPos > m_droppedPos
+            && sync_file_range(m_fd, m_droppedPos, m_writebackPos - m_droppedPos,
+                               SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == 0)
+        posix_fadvise(m_fd, m_droppedPos, m_writebackPos - m_droppedPos, POSIX_FADV_DONTNEED);
+    m_droppedPos = m_writebackPos;
+
+    if (m_offset > m_writebackPos)
+        sync_file_range(m_fd, m_writebackPos, m_offset - m_writebackPos, SYNC_FILE_RANGE_WRITE);
+    m_writebackPos = m_offset;
+}
+
+SpoolReader::SpoolReader(int fd)
+    : m_fd(fd)
+    , m_offset(sizeof(SpoolHeader))
+{
+}
+
+SpoolReader::~SpoolReader()
+{
+    if (m_map)
+        munmap(m_map, m_mapLength);
+    ::close(m_fd);
+}
+
+SpoolReader *SpoolReader::open(const QString &fileName)
+{
+    const int fd = ::open(QFile::encodeName(fileName).constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        qCWarning(logspool) << "Could not open" << fileName << "-" << strerror(errno);
+        return nullptr;
+    }
+
+    SpoolHeader header;
+    const off_t size = lseek(fd, 0, SEEK_END);
+    if (pread(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))
+            || memcmp(header.magic, SpoolMagic, sizeof(SpoolMagic))
+            || header.end < sizeof(header) || header.end > uint64_t(size)) {
+        qCWarning(logspool) << fileName << "is not a complete spool file";
+        ::close(fd);
+        return nullptr;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    SpoolReader *reader = new SpoolReader(fd);
+    reader->m_width = int(header.width);
+    reader->m_height = int(header.height);
+    reader->m_stride = int(header.stride);
+    reader->m_records = header.records;
+    reader->m_end = int64_t(header.end);
+    return reader;
+}
+
+bool SpoolReader::next(Record *record)
+{
+    if (m_error || m_read == m_records)
+        return false;
+
+    const char *in = map(sizeof(SpoolRecord));
+    SpoolRecord header;
+    if (in)
+        memcpy(&header, in, sizeof(header));
+    if (!in || (header.type != Record::Frame && header.type != Record::Repeat)
+            || (header.type == Record::Frame && !(in = map(sizeof(header) + header.size)))) {
+        qCWarning(logspool) << "Damaged spool record at" << m_offset;
+        m_error = true;
+        return false;
+    }
+
+    record->type = Record::Type(header.type);
+    record->timestamp = header.timestamp;
+    record->transform = header.transform;
+    record->payload = in + sizeof(header);
+    record->payloadSize = header.size;
+    m_offset += int64_t(padded(sizeof(header) + header.size));
+    ++m_read;
+    return true;
+}
+
+bool SpoolReader::decompress(const Record &record, uchar *data) const
+{
+    const int size = LZ4_decompress_safe(record.payload, reinterpret_cast<char *>(data),
+                                         int(record.payloadSize), int(frameSize()));
+    if (size != int(frameSize())) {
+        qCWarning(logspool) << "Damaged spooled frame";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Maps the @p size bytes at the current offset, the window before is dropped.
+ * Returns nullptr if they go past the end of the records.
+ */
+const char *SpoolReader::map(size_t size)
+{
+    if (m_offset + int64_t(size) > m_end)
+        return nullptr;
+    if (m_map && m_offset + int64_t(size) <= m_mapStart + int64_t(m_mapLength))
+        return m_map + (m_offset - m_mapStart);
+
+    if (m_map)
+        munmap(m_map, m_mapLength);
+    m_map = nullptr;
+
+    const int64_t start = pageStart(m_offset);
+    const size_t length = size_t(qMin(int64_t(pageAligned(qMax(WindowSize, size_t(m_offset - start) + size))),
+                                      m_end - start));
+    void *map = mmap(nullptr, length, PROT_READ, MAP_SHARED, m_fd, start);
+    if (map == MAP_FAILED) {
+        qCWarning(logspool) << "Could not map the spool file -" << strerror(errno);
+        return nullptr;
+    }
+    madvise(map, length, MADV_SEQUENTIAL);
+    m_map = static_cast<char *>(map);
+    m_mapStart = start;
+    m_mapLength = length;
+    return m_map + (m_offset - m_mapStart);
+}
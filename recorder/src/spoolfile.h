@@ -0,0 +1,115 @@
+#ifndef SPOOLFILE_H
+#define SPOOLFILE_H
+
+#include <QString>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Raw frames of a recording that is encoded after it stopped. The file starts
+ * with a header giving the geometry of the capture buffers, followed by records:
+ * a frame is the LZ4 compressed contents of one buffer, a repeat has no payload.
+ * Records are 8 byte aligned.
+ *
+ * The writer compresses straight into a shared mapping of the file, which is
+ * mapped in windows of a few megabytes, so the capture side costs about one pass
+ * over the buffer. Each window is allocated before it is mapped, a full disk is
+ * reported by the write instead of a SIGBUS on the mapping.
+ */
+class SpoolWriter
+{
+public:
+    // Returns nullptr if the file cannot be created.
+    static SpoolWriter *create(const QString &fileName, int width, int height, int stride);
+    ~SpoolWriter();
+
+    size_t frameSize() const { return m_frameSize; }
+
+    // @p size must be frameSize(), the stride times the height.
+    bool addFrame(const uchar *data, size_t size, uint32_t timestamp, int transform);
+    bool addRepeat();
+    // Writes the header and gives back the space allocated ahead.
+    bool close();
+
+    quint64 records() const { return m_records; }
+
+private:
+    SpoolWriter(int fd, int width, int height, int stride);
+
+    char *reserve(size_t size);
+    void unmap();
+
+    int m_fd;
+    int m_width;
+    int m_height;
+    int m_stride;
+    size_t m_frameSize;
+
+    char *m_map = nullptr;
+    int64_t m_mapStart = 0;
+    size_t m_mapLength = 0;
+    int64_t m_offset = 0; // end of the records written so far
+    quint64 m_records = 0;
+
+    int64_t m_writebackPos = 0; // data before this was handed to writeback
+    int64_t m_droppedPos = 0;   // data before this was dropped from the page cache
+};
+
+/**
+ * Reads the records of a finished spool file front to back.
+ */
+class SpoolReader
+{
+public:
+    struct Record {
+        enum Type {
+            Frame = 1,
+            Repeat = 2,
+        };
+
+        Type type = Frame;
+        uint32_t timestamp = 0;
+        int transform = 0;
+        const char *payload = nullptr;
+        size_t payloadSize = 0;
+    };
+
+    // Returns nullptr if the file cannot be opened or was not closed properly.
+    static SpoolReader *open(const QString &fileName);
+    ~SpoolReader();
+
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+    int stride() const { return m_stride; }
+    size_t frameSize() const { return size_t(m_stride) * size_t(m_height); }
+    quint64 records() const { return m_records; }
+
+    // The payload stays valid until the next call. Returns false at the end of
+    // the file, and on a damaged record, which hasError() tells apart.
+    bool next(Record *record);
+    // Unpacks a frame record into @p data, which has room for frameSize() bytes.
+    bool decompress(const Record &record, uchar *data) const;
+    bool hasError() const { return m_error; }
+
+private:
+    explicit SpoolReader(int fd);
+
+    const char *map(size_t size);
+
+    int m_fd;
+    int m_width = 0;
+    int m_height = 0;
+    int m_stride = 0;
+    quint64 m_records = 0;
+    int64_t m_end = 0;
+
+    char *m_map = nullptr;
+    int64_t m_mapStart = 0;
+    size_t m_mapLength = 0;
+    int64_t m_offset = 0;
+    quint64 m_read = 0;
+    bool m_error = false;
+};
+
+#endif // SPOOLFILE_H
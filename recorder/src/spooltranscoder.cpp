@@ -0,0 +1,109 @@
+#include "spooltranscoder.h"
+
+#include <errno.h>
+#include <poll.h>
+
+#include <QLoggingCategory>
+
+#include "encoderthread.h"
+#include "shmpool.h"
+#include "spoolfile.h"
+
+Q_LOGGING_CATEGORY(logtranscoder, "screenrecorder.transcoder", QtDebugMsg)
+
+// A repeat waits for queue room rather than a buffer, which no eventfd signals.
+static const int RetryMs = 10;
+
+SpoolTranscoder::SpoolTranscoder(SpoolReader *reader, EncoderThread *encoder, const QList<Buffer *> &buffers,
+                                 QObject *parent)
+    : QThread(parent)
+    , m_reader(reader)
+    , m_encoder(encoder)
+    , m_buffers(buffers)
+    , m_remaining(int(reader->records()))
+{
+}
+
+SpoolTranscoder::~SpoolTranscoder()
+{
+    requestStop();
+    wait();
+    delete m_reader;
+}
+
+void SpoolTranscoder::requestStop()
+{
+    m_stop.store(true, std::memory_order_release);
+}
+
+void SpoolTranscoder::run()
+{
+    const size_t frameSize = m_reader->frameSize();
+    if (!m_buffers.isEmpty() && size_t(m_buffers.first()->stride) * size_t(m_buffers.first()->image.height()) != frameSize) {
+        qCWarning(logtranscoder) << "Spooled frames do not fit the capture buffers";
+        m_encoder->requestStop();
+        return;
+    }
+
+    SpoolReader::Record record;
+    while (!m_stop.load(std::memory_order_acquire) && m_reader->next(&record)) {
+        FrameDescriptor frame;
+        if (record.type == SpoolReader::Record::Repeat) {
+            frame.type = FrameDescriptor::Repeat;
+            while (!m_encoder->submit(frame) && !m_stop.load(std::memory_order_acquire))
+                waitForEncoder();
+        } else {
+            const int index = acquireBuffer();
+            if (index < 0)
+                break;
+            if (!m_reader->decompress(record, m_buffers.at(index)->data)) {
+                // A repeat keeps the timing of the lost frame.
+                frame.type = FrameDescriptor::Release;
+                frame.buffer = index;
+                m_encoder->submit(frame);
+                frame = FrameDescriptor();
+                frame.type = FrameDescriptor::Repeat;
+                while (!m_encoder->submit(frame) && !m_stop.load(std::memory_order_acquire))
+                    waitForEncoder();
+            } else {
+                frame.type = FrameDescriptor::Frame;
+                frame.buffer = index;
+                frame.timestamp = record.timestamp;
+                frame.transform = record.transform;
+                m_encoder->submit(frame);
+            }
+        }
+        m_remaining.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    m_complete.store(m_remaining.load(std::memory_order_relaxed) == 0 && !m_reader->hasError(),
+                     std::memory_order_release);
+    m_encoder->requestStop();
+}
+
+/**
+ * Waits for a free capture buffer the way the capture does, returns -1 once
+ * stopped.
+ */
+int SpoolTranscoder::acquireBuffer()
+{
+    int index = m_encoder->acquireBuffer();
+    while (index < 0 && !m_stop.load(std::memory_order_acquire)) {
+        // Ask to be notified first, then retry: a buffer released in between
+        // would otherwise not wake us up.
+        m_encoder->setStarving(true);
+        index = m_encoder->acquireBuffer();
+        if (index < 0)
+            waitForEncoder();
+    }
+    m_encoder->setStarving(false);
+    return index;
+}
+
+void SpoolTranscoder::waitForEncoder()
+{
+    pollfd fd = { m_encoder->releasedFd(), POLLIN, 0 };
+    while (poll(&fd, 1, RetryMs) < 0 && errno == EINTR) {
+    }
+    m_encoder->clearReleased();
+}
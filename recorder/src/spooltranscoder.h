@@ -0,0 +1,52 @@
+#ifndef SPOOLTRANSCODER_H
+#define SPOOLTRANSCODER_H
+
+#include <QList>
+#include <QThread>
+
+#include <atomic>
+
+class Buffer;
+class EncoderThread;
+class SpoolReader;
+
+/**
+ * Second phase of a spooled recording. Takes the place of the capture as the
+ * producer of the encoder: every frame of the spool is unpacked into a free
+ * capture buffer and submitted with its original timestamp and transform, so
+ * the frames go through the encoder workers like live ones. Stops the encoder
+ * once the spool is done.
+ */
+class SpoolTranscoder : public QThread
+{
+public:
+    // Takes ownership of the reader. The encoder must be running with @p buffers,
+    // and nothing else may drain its releasedFd() while the transcoder runs.
+    SpoolTranscoder(SpoolReader *reader, EncoderThread *encoder, const QList<Buffer *> &buffers,
+                    QObject *parent = nullptr);
+    virtual ~SpoolTranscoder();
+
+    void requestStop();
+
+    // Records of the spool not submitted yet.
+    int remaining() const { return m_remaining.load(std::memory_order_relaxed); }
+    // Whether every record made it to the encoder.
+    bool isComplete() const { return m_complete.load(std::memory_order_acquire); }
+
+protected:
+    void run() override;
+
+private:
+    int acquireBuffer();
+    void waitForEncoder();
+
+    SpoolReader *m_reader;
+    EncoderThread *m_encoder;
+    QList<Buffer *> m_buffers;
+
+    std::atomic<int> m_remaining{0};
+    std::atomic<bool> m_complete{false};
+    std::atomic<bool> m_stop{false};
+};
+
+#endif // SPOOLTRANSCODER_H
@@ -0,0 +1,107 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+/**
+ * Fixed-capacity lock-free ring for exactly one producer and one consumer thread.
+ * Capacity is rounded up to a power of two. push() must only be called from the
+ * producer, pop() only from the consumer; size() is exact on either side for the
+ * index it owns and conservative for the other one.
+ */
+template <typename T>
+class SpscRing
+{
+public:
+    explicit SpscRing(size_t capacity = 0)
+    {
+        reset(capacity);
+    }
+
+    // Not thread-safe, call before the producer and consumer start.
+    void reset(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        m_items.assign(size, T());
+        m_mask = size - 1;
+        m_head.store(0, std::memory_order_relaxed);
+        m_tail.store(0, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const
+    {
+        return m_mask + 1;
+    }
+
+    size_t size() const
+    {
+        const size_t tail = m_tail.load(std::memory_order_acquire);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        return tail - head;
+    }
+
+    bool isEmpty() const
+    {
+        return size() == 0;
+    }
+
+    bool push(const T &item)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) > m_mask)
+            return false;
+        m_items[tail & m_mask] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire))
+            return false;
+        item = m_items[head & m_mask];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer side, copies as many items as fit and returns their number.
+    size_t pushMany(const T *items, size_t count)
+    {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        count = std::min(count, capacity() - (tail - m_head.load(std::memory_order_acquire)));
+        const size_t first = std::min(count, capacity() - (tail & m_mask));
+        std::copy(items, items + first, m_items.begin() + (tail & m_mask));
+        std::copy(items + first, items + count, m_items.begin());
+        m_tail.store(tail + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer side, copies out up to @p count items and returns their number.
+    size_t popMany(T *items, size_t count)
+    {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        count = std::min(count, m_tail.load(std::memory_order_acquire) - head);
+        const size_t first = std::min(count, capacity() - (head & m_mask));
+        std::copy(m_items.begin() + (head & m_mask), m_items.begin() + (head & m_mask) + first, items);
+        std::copy(m_items.begin(), m_items.begin() + (count - first), items + first);
+        m_head.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+private:
+    std::vector<T> m_items;
+    size_t m_mask = 0;
+    // Keep the consumer and producer indices on separate cache lines.
+    char m_padding0[64];
+    std::atomic<size_t> m_head{0};
+    char m_padding1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> m_tail{0};
+};
+
+#endif // SPSCRING_H
@@ -14,11 +14,13 @@ Source0:    %{name}-%{version}.tar.bz2
 BuildRequires:  pkgconfig(Qt5Core)
 BuildRequires:  pkgconfig(Qt5Gui)
 BuildRequires:  pkgconfig(Qt5DBus)
-BuildRequires:  pkgconfig(Qt5Concurrent)
 BuildRequires:  qt5-qtplatformsupport-devel
 BuildRequires:  qt5-qtwayland-wayland_egl-devel
 BuildRequires:  pkgconfig(wayland-client)
 BuildRequires:  pkgconfig(mlite5)
+BuildRequires:  pkgconfig(libpulse-simple)
+BuildRequires:  pkgconfig(liblz4)
+BuildRequires:  pkgconfig(libjpeg)
 BuildRequires:  systemd
 BuildRequires:  sailfish-svg2png
 
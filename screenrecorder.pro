@@ -3,7 +3,8 @@ SUBDIRS = \
     recorder \
     gui \
     icons \
-    settings
+    settings \
+    tests
 
 gui.depends = recorder
 
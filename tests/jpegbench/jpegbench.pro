@@ -0,0 +1,22 @@
+TEMPLATE = app
+TARGET = jpegbench
+CONFIG += console
+CONFIG -= app_bundle
+
+QT = core gui
+CONFIG += link_pkgconfig
+PKGCONFIG += libjpeg
+
+RECORDER_SRC = $$PWD/../../recorder/src
+INCLUDEPATH += $$RECORDER_SRC
+
+SOURCES += \
+    main.cpp \
+    $$RECORDER_SRC/jpegencoder.cpp \
+    $$RECORDER_SRC/pixelconvert.cpp
+
+HEADERS += \
+    $$RECORDER_SRC/jpegencoder.h \
+    $$RECORDER_SRC/pixelconvert.h
+
+DEFINES += QT_NO_CAST_FROM_ASCII QT_NO_CAST_TO_ASCII
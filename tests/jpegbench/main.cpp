@@ -0,0 +1,202 @@
+/*
+ * Per-frame cost of the MJPEG encoding paths on one core:
+ *
+ *   encoder  JpegEncoder as the encoder workers use it, the stripes of a frame
+ *            one after the other
+ *   libjpeg  libjpeg compressing the capture buffer rows directly
+ *   qimage   conversion to QImage::Format_RGB32 and QImage::save(), the path
+ *            the recorder used before JpegEncoder
+ *
+ * Usage: jpegbench [width height [frames [stripes]]], 1080x1920, 30 frames and
+ * a single stripe by default.
+ */
+
+#include <QBuffer>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QImage>
+#include <QStringList>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <jpeglib.h>
+
+#include "jpegencoder.h"
+#include "pixelconvert.h"
+
+struct Result {
+    double convertMs = 0;
+    double totalMs = 0;
+    int bytes = 0;
+};
+
+static double millis(qint64 nanos, int frames)
+{
+    return double(nanos) / 1e6 / frames;
+}
+
+/**
+ * Something like a phone screen in RGBA8888 byte order: a status bar, flat
+ * list items with a few lines of noisy "text" each and a gradient wallpaper
+ * showing through at the bottom.
+ */
+static QImage makeFrame(int width, int height)
+{
+    QImage frame(width, height, QImage::Format_RGBA8888);
+    quint32 seed = 12345;
+    for (int y = 0; y < height; ++y) {
+        uchar *row = frame.scanLine(y);
+        const int item = y % 160;
+        for (int x = 0; x < width; ++x) {
+            uchar r, g, b;
+            if (y < 80) {
+                r = 20; g = 24; b = 32;
+            } else if (y > height * 3 / 4) {
+                r = uchar(x * 255 / width);
+                g = uchar(y * 255 / height);
+                b = uchar(128 + (x + y) % 64);
+            } else if (item > 40 && item < 120 && x > 48 && x < width - 48 && (item / 20) % 2 == 0) {
+                seed = seed * 1103515245u + 12345u;
+                const uchar ink = (seed >> 16) % 3 == 0 ? 230 : 40;
+                r = g = b = ink;
+            } else {
+                r = g = b = item == 0 ? 90 : 40;
+            }
+            row[x * 4] = r;
+            row[x * 4 + 1] = g;
+            row[x * 4 + 2] = b;
+            row[x * 4 + 3] = 255;
+        }
+    }
+    return frame;
+}
+
+static Result benchEncoder(const QImage &frame, int quality, bool flip, int stripes, int frames)
+{
+    JpegEncoder jpeg;
+    Result result;
+    if (!jpeg.open(frame.size(), quality, stripes))
+        return result;
+
+    const qptrdiff stride = flip ? -qptrdiff(frame.bytesPerLine()) : qptrdiff(frame.bytesPerLine());
+    const uchar *top = flip ? frame.constScanLine(frame.height() - 1) : frame.constBits();
+    QByteArray out;
+    qint64 convert = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < frames; ++i) {
+        result.bytes = 0;
+        for (int stripe = 0; stripe < jpeg.stripeCount(); ++stripe) {
+            QElapsedTimer step;
+            step.start();
+            jpeg.loadStripe(top + jpeg.stripeTop(stripe) * stride, stride, stripe, JpegEncoder::Rgba8888);
+            convert += step.nsecsElapsed();
+            result.bytes += jpeg.encodeStripe(stripe, &out);
+        }
+    }
+    result.totalMs = millis(timer.nsecsElapsed(), frames);
+    result.convertMs = millis(convert, frames);
+    return result;
+}
+
+static Result benchLibjpeg(const QImage &frame, int quality, bool flip, int frames)
+{
+    Result result;
+#ifdef JCS_EXTENSIONS
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr error;
+    cinfo.err = jpeg_std_error(&error);
+    jpeg_create_compress(&cinfo);
+    cinfo.image_width = JDIMENSION(frame.width());
+    cinfo.image_height = JDIMENSION(frame.height());
+    cinfo.input_components = 4;
+    cinfo.in_color_space = JCS_EXT_RGBX;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+
+    QVector<JSAMPROW> rows(frame.height());
+    for (int y = 0; y < frame.height(); ++y)
+        rows[y] = const_cast<JSAMPROW>(frame.constScanLine(flip ? frame.height() - 1 - y : y));
+
+    unsigned char *buffer = nullptr;
+    unsigned long size = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < frames; ++i) {
+        jpeg_mem_dest(&cinfo, &buffer, &size);
+        jpeg_start_compress(&cinfo, TRUE);
+        jpeg_write_scanlines(&cinfo, rows.data(), JDIMENSION(frame.height()));
+        jpeg_finish_compress(&cinfo);
+    }
+    result.totalMs = millis(timer.nsecsElapsed(), frames);
+    result.bytes = int(size);
+    jpeg_destroy_compress(&cinfo);
+    free(buffer);
+#else
+    Q_UNUSED(frame)
+    Q_UNUSED(quality)
+    Q_UNUSED(flip)
+    Q_UNUSED(frames)
+#endif
+    return result;
+}
+
+static Result benchQImage(const QImage &frame, int quality, bool flip, int frames)
+{
+    Result result;
+    QImage converted(frame.size(), QImage::Format_RGB32);
+    QByteArray out;
+    qint64 convert = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < frames; ++i) {
+        QElapsedTimer step;
+        step.start();
+        PixelConvert::rgbaToRgb32(frame.constBits(), frame.bytesPerLine(), converted.bits(), converted.bytesPerLine(),
+                                  frame.width(), frame.height(), flip);
+        convert += step.nsecsElapsed();
+        out.clear();
+        QBuffer buffer(&out);
+        buffer.open(QIODevice::WriteOnly);
+        converted.save(&buffer, "JPG", quality);
+    }
+    result.totalMs = millis(timer.nsecsElapsed(), frames);
+    result.convertMs = millis(convert, frames);
+    result.bytes = out.size();
+    return result;
+}
+
+static void print(const char *name, int quality, bool flip, const Result &result)
+{
+    if (result.totalMs == 0) {
+        printf("q%-3d %-7s %-8s unavailable\n", quality, flip ? "flipped" : "", name);
+        return;
+    }
+    printf("q%-3d %-7s %-8s %6.2f ms  (convert %5.2f ms, encode %6.2f ms)  %8d bytes\n",
+           quality, flip ? "flipped" : "", name, result.totalMs, result.convertMs,
+           result.totalMs - result.convertMs, result.bytes);
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const QStringList args = app.arguments();
+    const int width = args.size() > 2 ? args.at(1).toInt() : 1080;
+    const int height = args.size() > 2 ? args.at(2).toInt() : 1920;
+    const int frames = args.size() > 3 ? qMax(1, args.at(3).toInt()) : 30;
+    const int stripes = args.size() > 4 ? qMax(1, args.at(4).toInt()) : 1;
+
+    const QImage frame = makeFrame(width, height);
+    printf("%dx%d, %d frames per case, colour conversion: %s, JPEG backend: %s\n",
+           width, height, frames, PixelConvert::yuv420Implementation(), JpegEncoder::implementation());
+
+    const int qualities[] = { 50, 90 };
+    for (int quality : qualities) {
+        for (int flip = 0; flip < 2; ++flip) {
+            print("encoder", quality, flip, benchEncoder(frame, quality, flip, stripes, frames));
+            print("libjpeg", quality, flip, benchLibjpeg(frame, quality, flip, frames));
+            print("qimage", quality, flip, benchQImage(frame, quality, flip, frames));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,195 @@
+/*
+ * Checks every SIMD kernel of PixelConvert the CPU supports bit-exact against
+ * the scalar reference, over widths that exercise the vector loops as well as
+ * their scalar tails. Each output is followed by guard bytes that must stay
+ * untouched. Exits with the number of failed checks.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "pixelconvert.h"
+
+using namespace PixelConvert;
+
+static const int Guard = 64;
+static const uchar GuardByte = 0xa5;
+
+static int s_failures = 0;
+static int s_checks = 0;
+
+static quint32 s_seed = 1;
+
+static uchar randomByte()
+{
+    s_seed = s_seed * 1103515245u + 12345u;
+    return uchar(s_seed >> 16);
+}
+
+enum Pattern {
+    Random,
+    Extremes, // only 0 and 255, the saturation corners of the fixed point math
+};
+
+static std::vector<uchar> makePixels(int bytes, Pattern pattern)
+{
+    std::vector<uchar> data(static_cast<size_t>(bytes));
+    for (uchar &byte : data)
+        byte = pattern == Random ? randomByte() : (randomByte() & 1 ? 255 : 0);
+    return data;
+}
+
+static std::vector<uchar> guarded(int bytes)
+{
+    return std::vector<uchar>(size_t(bytes + Guard), GuardByte);
+}
+
+static void check(bool ok, const char *what, const char *kernel, int width, const char *detail = "")
+{
+    ++s_checks;
+    if (ok)
+        return;
+    ++s_failures;
+    printf("FAIL %s (%s) width %d %s\n", what, kernel, width, detail);
+}
+
+static bool guardIntact(const std::vector<uchar> &buffer, int bytes)
+{
+    for (size_t i = size_t(bytes); i < buffer.size(); ++i) {
+        if (buffer[i] != GuardByte)
+            return false;
+    }
+    return true;
+}
+
+static void testRows(RowFunction row, const char *name, int width, Pattern pattern)
+{
+    // One pixel in, so the kernels cannot count on aligned rows.
+    const std::vector<uchar> src = makePixels((width + 1) * 4, pattern);
+    const quint32 *in = reinterpret_cast<const quint32 *>(src.data()) + 1;
+    std::vector<uchar> expected = guarded(width * 4 + 4);
+    std::vector<uchar> actual = guarded(width * 4 + 4);
+
+    rgbaToRgb32RowScalar(in, reinterpret_cast<quint32 *>(expected.data() + 4), width);
+    row(in, reinterpret_cast<quint32 *>(actual.data() + 4), width);
+    check(memcmp(expected.data(), actual.data(), expected.size()) == 0, "rgbaToRgb32 row", name, width);
+    check(guardIntact(actual, width * 4 + 4), "rgbaToRgb32 row guard", name, width);
+}
+
+// The dispatched frame conversion, which walks the rows bottom-up when flipping.
+static void testFrame(int width, int height, bool flip)
+{
+    const int stride = width * 4 + 12;
+    const std::vector<uchar> src = makePixels(stride * height, Random);
+    std::vector<uchar> expected = guarded(stride * height);
+    std::vector<uchar> actual = guarded(stride * height);
+
+    for (int y = 0; y < height; ++y) {
+        const int source = flip ? height - 1 - y : y;
+        rgbaToRgb32RowScalar(reinterpret_cast<const quint32 *>(src.data() + source * stride),
+                             reinterpret_cast<quint32 *>(expected.data() + y * stride), width);
+    }
+    rgbaToRgb32(src.data(), stride, actual.data(), stride, width, height, flip);
+    check(memcmp(expected.data(), actual.data(), expected.size()) == 0,
+          flip ? "rgbaToRgb32 flipped" : "rgbaToRgb32", implementation(), width);
+}
+
+struct Planes {
+    explicit Planes(int width)
+        : y0(guarded(width))
+        , y1(guarded(width))
+        , cb(guarded((width + 1) / 2))
+        , cr(guarded((width + 1) / 2))
+    {
+    }
+
+    bool operator==(const Planes &other) const
+    {
+        return y0 == other.y0 && y1 == other.y1 && cb == other.cb && cr == other.cr;
+    }
+
+    std::vector<uchar> y0, y1, cb, cr;
+};
+
+static void testYuv420(Yuv420Function convert, const char *name, int width, bool bgra, Pattern pattern)
+{
+    const std::vector<uchar> row0 = makePixels((width + 1) * 4, pattern);
+    const std::vector<uchar> row1 = makePixels((width + 1) * 4, pattern);
+    Planes expected(width);
+    Planes actual(width);
+
+    rgbaToYuv420Scalar(row0.data() + 4, row1.data() + 4, expected.y0.data(), expected.y1.data(),
+                       expected.cb.data(), expected.cr.data(), width, bgra);
+    convert(row0.data() + 4, row1.data() + 4, actual.y0.data(), actual.y1.data(),
+            actual.cb.data(), actual.cr.data(), width, bgra);
+    // The planes were filled with guard bytes, comparing them whole covers overruns too.
+    check(expected == actual, "rgbaToYuv420", name, width, bgra ? "bgra" : "rgba");
+    check(guardIntact(actual.y0, width) && guardIntact(actual.cb, (width + 1) / 2),
+          "rgbaToYuv420 guard", name, width, bgra ? "bgra" : "rgba");
+}
+
+static void testHalve(HalveFunction halve, const char *name, int width, Pattern pattern)
+{
+    const std::vector<uchar> row0 = makePixels((width * 2 + 1) * 4, pattern);
+    const std::vector<uchar> row1 = makePixels((width * 2 + 1) * 4, pattern);
+    std::vector<uchar> expected = guarded(width * 4);
+    std::vector<uchar> actual = guarded(width * 4);
+
+    halveRgbaRowsScalar(row0.data() + 4, row1.data() + 4, expected.data(), width);
+    halve(row0.data() + 4, row1.data() + 4, actual.data(), width);
+    check(expected == actual, "halveRgbaRows", name, width);
+    check(guardIntact(actual, width * 4), "halveRgbaRows guard", name, width);
+}
+
+int main()
+{
+    struct {
+        RowFunction row;
+        const char *name;
+    } rows[] = {
+        { rgbaToRgb32RowSse2(), "sse2" },
+        { rgbaToRgb32RowAvx2(), "avx2" },
+        { rgbaToRgb32RowNeon(), "neon" },
+    };
+    struct {
+        Yuv420Function convert;
+        HalveFunction halve;
+        const char *name;
+    } yuv420[] = {
+        { rgbaToYuv420Sse2(), halveRgbaRowsSse2(), "sse2" },
+        { rgbaToYuv420Neon(), halveRgbaRowsNeon(), "neon" },
+        { rgbaToYuv420, halveRgbaRows, "dispatched" },
+    };
+
+    std::vector<int> widths;
+    for (int width = 1; width <= 80; ++width)
+        widths.push_back(width);
+    const int large[] = { 127, 128, 129, 255, 256, 257, 540, 720, 1079, 1080, 1081, 1920 };
+    widths.insert(widths.end(), large, large + sizeof(large) / sizeof(large[0]));
+
+    const Pattern patterns[] = { Random, Extremes };
+    for (int width : widths) {
+        for (Pattern pattern : patterns) {
+            for (const auto &kernel : rows) {
+                if (kernel.row)
+                    testRows(kernel.row, kernel.name, width, pattern);
+            }
+            for (const auto &kernel : yuv420) {
+                if (kernel.convert) {
+                    testYuv420(kernel.convert, kernel.name, width, false, pattern);
+                    testYuv420(kernel.convert, kernel.name, width, true, pattern);
+                }
+                if (kernel.halve)
+                    testHalve(kernel.halve, kernel.name, width, pattern);
+            }
+        }
+        testFrame(width, 5, false);
+        testFrame(width, 5, true);
+    }
+
+    printf("rgbaToRgb32: %s, rgbaToYuv420: %s, %d checks, %d failed\n",
+           implementation(), yuv420Implementation(), s_checks, s_failures);
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,18 @@
+TEMPLATE = app
+TARGET = tst_pixelconvert
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+QT = core
+
+RECORDER_SRC = $$PWD/../../recorder/src
+INCLUDEPATH += $$RECORDER_SRC
+
+SOURCES += \
+    main.cpp \
+    $$RECORDER_SRC/pixelconvert.cpp
+
+HEADERS += \
+    $$RECORDER_SRC/pixelconvert.h
+
+DEFINES += QT_NO_CAST_FROM_ASCII QT_NO_CAST_TO_ASCII